@@ -0,0 +1,135 @@
+#include "host.h"
+#include "fake_rn4020.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Driver benchmarks against the fake module. Throughput figures are in virtual time, so they show what the driver
+ * gets out of the UART at a given baud rate, the parser figure is host CPU time per line.
+ *
+ *   rn4020_bench [iterations]
+ */
+
+static RN4020 rn4020;
+static UART_HandleTypeDef uart;
+
+static const uint8_t serviceUUID[16] = {
+  0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0x00, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+};
+static const uint8_t characteristicUUID[16] = {
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+
+static uint64_t wallNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void check(HAL_StatusTypeDef status, const char* what) {
+  if (status != HAL_OK) {
+    fprintf(stderr, "%s failed: %d\n", what, status);
+    exit(1);
+  }
+}
+
+static uint16_t setup(uint32_t baudRate) {
+  Host_reset();
+  FakeRN4020_reset();
+  FakeRN4020_attach(&rn4020, &uart);
+  check(RN4020_setup(&rn4020), "setup");
+  if (baudRate != 115200) {
+    check(RN4020_setBaudRate(&rn4020, baudRate, true), "setBaudRate");
+  }
+  check(RN4020_clearPrivate(&rn4020), "clearPrivate");
+  check(RN4020_addPrivateService(&rn4020, serviceUUID), "addPrivateService");
+  check(RN4020_addPrivateCharacteristic(&rn4020, characteristicUUID, RN4020_PRIVATE_CHARACTERISTIC_PROPERTY_READ, 20, RN4020_PRIVATE_CHARACTERISTIC_SECURITY_NONE), "addPrivateCharacteristic");
+  check(RN4020_refreshHandleLookup(&rn4020), "refreshHandleLookup");
+  // no client configuration descriptor, a connected central hears every write
+  FakeRN4020_connect();
+  Host_run(&rn4020, 5);
+  return rn4020.handleLookup[0].handle;
+}
+
+static void benchSetup(void) {
+  Host_reset();
+  FakeRN4020_reset();
+  FakeRN4020_attach(&rn4020, &uart);
+  uint64_t startNs = Host_nowNs();
+  check(RN4020_setup(&rn4020), "setup");
+  printf("setup                      %10.1f ms\n", (Host_nowNs() - startNs) / 1e6);
+}
+
+static void benchCommands(uint32_t baudRate, uint32_t iterations) {
+  setup(baudRate);
+  uint64_t startNs = Host_nowNs();
+  for (uint32_t i = 0; i < iterations; i++) {
+    check(RN4020_setSupportedFeatures(&rn4020, RN4020_FEATURE_UART_FLOW_CONTROL), "setSupportedFeatures");
+  }
+  double seconds = (Host_nowNs() - startNs) / 1e9;
+  printf("commands/s     %7lu baud %10.0f blocking\n", (unsigned long)baudRate, iterations / seconds);
+
+  startNs = Host_nowNs();
+  RN4020_CommandToken token = 0;
+  for (uint32_t i = 0; i < iterations; i++) {
+    HAL_StatusTypeDef status;
+    while ((status = RN4020_sendCommandAsync(&rn4020, "SR,02000000", NULL, NULL, &token)) == HAL_BUSY) {
+      RN4020_tick(&rn4020);
+    }
+    check(status, "sendCommandAsync");
+  }
+  check(RN4020_waitForCommand(&rn4020, token), "waitForCommand");
+  seconds = (Host_nowNs() - startNs) / 1e9;
+  printf("commands/s     %7lu baud %10.0f queued\n", (unsigned long)baudRate, iterations / seconds);
+}
+
+static void benchWrites(uint32_t baudRate, uint32_t iterations) {
+  uint16_t handle = setup(baudRate);
+  uint8_t data[20];
+  memset(data, 0x5a, sizeof(data));
+  uint64_t startNs = Host_nowNs();
+  RN4020_CommandToken token = 0;
+  for (uint32_t i = 0; i < iterations; i++) {
+    HAL_StatusTypeDef status;
+    data[0] = i;
+    while ((status = RN4020_writeServerCharacteristicHandleAsync(&rn4020, handle, data, sizeof(data), NULL, NULL, &token)) == HAL_BUSY) {
+      RN4020_tick(&rn4020);
+    }
+    check(status, "writeServerCharacteristicHandleAsync");
+  }
+  check(RN4020_waitForCommand(&rn4020, token), "waitForCommand");
+  double seconds = (Host_nowNs() - startNs) / 1e9;
+  printf("write bytes/s  %7lu baud %10.0f\n", (unsigned long)baudRate, iterations * sizeof(data) / seconds);
+}
+
+static void benchParse(uint32_t iterations) {
+  uint16_t handle = setup(115200);
+  char line[64];
+  int lineLength = snprintf(line, sizeof(line), "WV,%04X,000102030405060708090A0B0C0D0E0F10111213.\r\n", handle);
+  uint32_t linesPerBatch = (RN4020_RX_BUFFER_SIZE - 1) / lineLength;
+  uint64_t totalNs = 0;
+  uint32_t lines = 0;
+  while (lines < iterations) {
+    for (uint32_t i = 0; i < linesPerBatch; i++) {
+      Host_rxWrite((const uint8_t*)line, lineLength);
+    }
+    uint64_t startNs = wallNs();
+    RN4020_tick(&rn4020);
+    totalNs += wallNs() - startNs;
+    lines += linesPerBatch;
+  }
+  printf("parse                      %10.1f ns/line\n", (double)totalNs / lines);
+}
+
+int main(int argc, char** argv) {
+  uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000;
+  benchSetup();
+  benchCommands(115200, iterations);
+  benchCommands(921600, iterations);
+  benchWrites(115200, iterations);
+  benchWrites(921600, iterations);
+  benchParse(iterations * 100);
+  return 0;
+}
@@ -0,0 +1,117 @@
+#include "../rn4020_hex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Hex codec against the sprintf("%02X") / strtol path it replaced, on a 20 byte characteristic value and a 4 digit
+ * handle. Reports host ns per call.
+ *
+ *   rn4020_bench_hex [iterations]
+ */
+
+#define VALUE_LENGTH 20
+
+// keeps the compiler from dropping the loops
+static volatile uint32_t sink;
+
+static uint64_t wallNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void encodeOld(char* dest, const uint8_t* data, uint32_t dataLength) {
+  for (uint32_t i = 0; i < dataLength; i++) {
+    sprintf(dest + i * 2, "%02X", data[i]);
+  }
+}
+
+static void decodeOld(uint8_t* dest, const char* str, uint32_t strLength) {
+  char temp[3];
+  temp[2] = '\0';
+  for (uint32_t i = 0; i < strLength / 2; i++) {
+    temp[0] = str[i * 2];
+    temp[1] = str[i * 2 + 1];
+    dest[i] = strtol(temp, NULL, 16);
+  }
+}
+
+static uint16_t decodeHandleOld(const char* str) {
+  char handleStr[5];
+  memcpy(handleStr, str, 4);
+  handleStr[4] = '\0';
+  return strtol(handleStr, NULL, 16);
+}
+
+static void report(const char* name, uint64_t oldNs, uint64_t newNs, uint32_t iterations) {
+  printf("%-14s %8.1f ns sprintf/strtol %8.1f ns table %6.1fx\n",
+         name, (double)oldNs / iterations, (double)newNs / iterations, (double)oldNs / (newNs ? newNs : 1));
+}
+
+int main(int argc, char** argv) {
+  uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  uint8_t data[VALUE_LENGTH];
+  uint8_t decoded[VALUE_LENGTH];
+  char str[VALUE_LENGTH * 2 + 1];
+  char check[VALUE_LENGTH * 2 + 1];
+  for (int i = 0; i < VALUE_LENGTH; i++) {
+    data[i] = i * 13 + 7;
+  }
+
+  // both paths must agree before timing them
+  encodeOld(check, data, VALUE_LENGTH);
+  *RN4020_hexEncode(str, data, VALUE_LENGTH) = '\0';
+  if (strcmp(check, str) != 0 || RN4020_hexDecode(decoded, str, VALUE_LENGTH * 2) != VALUE_LENGTH
+      || memcmp(decoded, data, VALUE_LENGTH) != 0) {
+    fprintf(stderr, "codec mismatch\n");
+    return 1;
+  }
+
+  uint64_t startNs = wallNs();
+  for (uint32_t i = 0; i < iterations; i++) {
+    data[0] = i;
+    encodeOld(str, data, VALUE_LENGTH);
+    sink += str[1];
+  }
+  uint64_t oldNs = wallNs() - startNs;
+  startNs = wallNs();
+  for (uint32_t i = 0; i < iterations; i++) {
+    data[0] = i;
+    RN4020_hexEncode(str, data, VALUE_LENGTH);
+    sink += str[1];
+  }
+  report("encode 20B", oldNs, wallNs() - startNs, iterations);
+
+  startNs = wallNs();
+  for (uint32_t i = 0; i < iterations; i++) {
+    str[1] = "0123456789ABCDEF"[i & 0xf];
+    decodeOld(decoded, str, VALUE_LENGTH * 2);
+    sink += decoded[0];
+  }
+  oldNs = wallNs() - startNs;
+  startNs = wallNs();
+  for (uint32_t i = 0; i < iterations; i++) {
+    str[1] = "0123456789ABCDEF"[i & 0xf];
+    RN4020_hexDecode(decoded, str, VALUE_LENGTH * 2);
+    sink += decoded[0];
+  }
+  report("decode 20B", oldNs, wallNs() - startNs, iterations);
+
+  startNs = wallNs();
+  for (uint32_t i = 0; i < iterations; i++) {
+    str[3] = "0123456789ABCDEF"[i & 0xf];
+    sink += decodeHandleOld(str);
+  }
+  oldNs = wallNs() - startNs;
+  startNs = wallNs();
+  for (uint32_t i = 0; i < iterations; i++) {
+    uint16_t handle;
+    str[3] = "0123456789ABCDEF"[i & 0xf];
+    RN4020_hexDecodeU16(str, &handle);
+    sink += handle;
+  }
+  report("decode handle", oldNs, wallNs() - startNs, iterations);
+  return 0;
+}
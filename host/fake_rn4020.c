@@ -0,0 +1,359 @@
+#include "fake_rn4020.h"
+#include "host.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FAKE_RN4020_HANDLE_START 0x000B
+
+FakeRN4020 fakeRN4020;
+GPIO_TypeDef FakeRN4020_wakeswPort = { 1 };
+GPIO_TypeDef FakeRN4020_wakehwPort = { 2 };
+GPIO_TypeDef FakeRN4020_cmdMldpPort = { 3 };
+GPIO_TypeDef FakeRN4020_connectionPort = { 4 };
+const char* (*FakeRN4020_respond)(const char* line);
+
+static const uint32_t fakeBaudRates[] = { 2400, 9600, 19200, 38400, 115200, 230400, 460800, 921600 };
+
+static void _FakeRN4020_wake(void);
+static void _FakeRN4020_sleep(void);
+static void _FakeRN4020_processLine(const char* line, uint64_t endNs);
+static const char* _FakeRN4020_defaultReply(const char* line, uint64_t replyNs);
+static FakeRN4020_Characteristic* _FakeRN4020_findHandle(uint16_t handle);
+static void _FakeRN4020_listServices(uint64_t replyNs);
+
+void FakeRN4020_reset(void) {
+  memset(&fakeRN4020, 0, sizeof(fakeRN4020));
+  fakeRN4020.aokLatencyUs = 200;
+  fakeRN4020.rebootTimeUs = 50000;
+  fakeRN4020.wakeTimeUs = 5000;
+  fakeRN4020.baudRate = 115200;
+  fakeRN4020.pendingBaudIndex = 4;
+  strcpy(fakeRN4020.name, "RN4020");
+  fakeRN4020.nextHandle = FAKE_RN4020_HANDLE_START;
+  FakeRN4020_respond = NULL;
+}
+
+void FakeRN4020_attach(RN4020* rn4020, UART_HandleTypeDef* uart) {
+  memset(uart, 0, sizeof(UART_HandleTypeDef));
+  uart->Init.BaudRate = 115200;
+  uart->Init.HwFlowCtl = UART_HWCONTROL_NONE;
+  HAL_UART_Init(uart);
+  rn4020->uart = uart;
+  rn4020->wakeswPort = &FakeRN4020_wakeswPort;
+  rn4020->wakeswPin = 1;
+  rn4020->wakehwPort = &FakeRN4020_wakehwPort;
+  rn4020->wakehwPin = 2;
+  rn4020->cmdMldpPort = &FakeRN4020_cmdMldpPort;
+  rn4020->cmdMldpPin = 3;
+}
+
+void FakeRN4020_emit(const char* text) {
+  FakeRN4020_emitAt(text, Host_nowNs());
+}
+
+void FakeRN4020_emitAt(const char* text, uint64_t startNs) {
+  if (!fakeRN4020.awake) {
+    fakeRN4020.bytesLost += strlen(text);
+    return;
+  }
+  uint64_t byteTimeNs = Host_byteTimeNs(fakeRN4020.baudRate);
+  uint64_t dueNs = startNs > fakeRN4020.outputLastDueNs ? startNs : fakeRN4020.outputLastDueNs;
+  for (const char* p = text; *p; p++) {
+    if (fakeRN4020.outputLength == FAKE_RN4020_OUTPUT_SIZE) {
+      fakeRN4020.bytesLost++;
+      continue;
+    }
+    dueNs += byteTimeNs;
+    uint32_t index = (fakeRN4020.outputHead + fakeRN4020.outputLength++) % FAKE_RN4020_OUTPUT_SIZE;
+    FakeRN4020_OutputByte* out = &fakeRN4020.output[index];
+    out->byte = *p;
+    out->baudRate = fakeRN4020.baudRate;
+    out->flowControl = fakeRN4020.flowControl;
+    out->dueNs = dueNs;
+  }
+  fakeRN4020.outputLastDueNs = dueNs;
+}
+
+void FakeRN4020_connect(void) {
+  fakeRN4020.connected = true;
+  fakeRN4020.advertising = false;
+  FakeRN4020_emit("Connected\r\n");
+}
+
+void FakeRN4020_disconnect(void) {
+  // the status is sent in MLDP mode too, then the module is back in command mode
+  fakeRN4020.connected = false;
+  fakeRN4020.mldp = false;
+  FakeRN4020_emit("Connection End\r\n");
+}
+
+uint32_t FakeRN4020_countLines(const char* prefix) {
+  uint32_t count = 0;
+  size_t prefixLength = strlen(prefix);
+  const char* line = fakeRN4020.txLog;
+  while (*line) {
+    if (strncmp(line, prefix, prefixLength) == 0) {
+      count++;
+    }
+    const char* end = strchr(line, '\n');
+    if (end == NULL) {
+      break;
+    }
+    line = end + 1;
+  }
+  return count;
+}
+
+void FakeRN4020_clearTxLog(void) {
+  fakeRN4020.txLogLength = 0;
+  fakeRN4020.txLog[0] = '\0';
+}
+
+bool FakeRN4020_getPin(GPIO_TypeDef* port, uint16_t pin) {
+  if (port == &FakeRN4020_connectionPort) {
+    return fakeRN4020.connected;
+  }
+  if (port == &FakeRN4020_wakehwPort) {
+    return fakeRN4020.wakehw;
+  }
+  if (port == &FakeRN4020_wakeswPort) {
+    return fakeRN4020.wakesw;
+  }
+  return port == &FakeRN4020_cmdMldpPort && fakeRN4020.cmdMldp;
+}
+
+void FakeRN4020_setPin(GPIO_TypeDef* port, uint16_t pin, bool high) {
+  if (port == &FakeRN4020_wakehwPort) {
+    fakeRN4020.wakehw = high;
+    if (!high) {
+      // hardware wake low powers the radio down, the link and MLDP go with it
+      fakeRN4020.connected = false;
+      fakeRN4020.advertising = false;
+      fakeRN4020.mldp = false;
+      _FakeRN4020_sleep();
+    } else if (fakeRN4020.wakesw) {
+      _FakeRN4020_wake();
+    }
+  } else if (port == &FakeRN4020_wakeswPort) {
+    bool rising = high && !fakeRN4020.wakesw;
+    fakeRN4020.wakesw = high;
+    if (!high) {
+      _FakeRN4020_sleep();
+    } else if (rising && fakeRN4020.wakehw) {
+      _FakeRN4020_wake();
+    }
+  } else if (port == &FakeRN4020_cmdMldpPort) {
+    fakeRN4020.cmdMldp = high;
+    if (!high && fakeRN4020.mldp) {
+      fakeRN4020.mldp = false;
+      FakeRN4020_emitAt("CMD\r\n", Host_nowNs() + fakeRN4020.aokLatencyUs * 1000ULL);
+    }
+  }
+}
+
+static void _FakeRN4020_wake(void) {
+  fakeRN4020.awake = true;
+  fakeRN4020.lineLength = 0;
+  FakeRN4020_emitAt("CMD\r\n", Host_nowNs() + fakeRN4020.wakeTimeUs * 1000ULL);
+}
+
+static void _FakeRN4020_sleep(void) {
+  // the UART is off while dormant, anything not yet on the wire is gone
+  fakeRN4020.awake = false;
+  fakeRN4020.bytesLost += fakeRN4020.outputLength;
+  fakeRN4020.outputLength = 0;
+  fakeRN4020.lineLength = 0;
+}
+
+void FakeRN4020_receive(uint32_t baudRate, bool flowControl, const uint8_t* data, uint16_t length, uint64_t endNs) {
+  if (!fakeRN4020.awake || baudRate != fakeRN4020.baudRate || flowControl != fakeRN4020.flowControl) {
+    fakeRN4020.bytesGarbled += length;
+    fakeRN4020.lineLength = 0;
+    return;
+  }
+  if (fakeRN4020.mldp) {
+    fakeRN4020.mldpBytesReceived += length;
+    return;
+  }
+  for (uint16_t i = 0; i < length; i++) {
+    char c = data[i];
+    if (c == '\n') {
+      fakeRN4020.lineBuffer[fakeRN4020.lineLength] = '\0';
+      fakeRN4020.lineLength = 0;
+      _FakeRN4020_processLine(fakeRN4020.lineBuffer, endNs);
+    } else if (c != '\r' && fakeRN4020.lineLength < sizeof(fakeRN4020.lineBuffer) - 1) {
+      fakeRN4020.lineBuffer[fakeRN4020.lineLength++] = c;
+    }
+  }
+}
+
+void FakeRN4020_pump(uint32_t baudRate, bool flowControl, uint64_t nowNs) {
+  while (fakeRN4020.outputLength > 0) {
+    FakeRN4020_OutputByte* out = &fakeRN4020.output[fakeRN4020.outputHead];
+    if (out->dueNs > nowNs) {
+      break;
+    }
+    if (out->baudRate == baudRate && out->flowControl == flowControl) {
+      Host_rxWrite(&out->byte, 1);
+    } else {
+      fakeRN4020.bytesLost++;
+    }
+    fakeRN4020.outputHead = (fakeRN4020.outputHead + 1) % FAKE_RN4020_OUTPUT_SIZE;
+    fakeRN4020.outputLength--;
+  }
+}
+
+static void _FakeRN4020_processLine(const char* line, uint64_t endNs) {
+  fakeRN4020.linesReceived++;
+  size_t lineLength = strlen(line);
+  if (fakeRN4020.txLogLength + lineLength + 2 < sizeof(fakeRN4020.txLog)) {
+    memcpy(fakeRN4020.txLog + fakeRN4020.txLogLength, line, lineLength);
+    fakeRN4020.txLogLength += lineLength;
+    fakeRN4020.txLog[fakeRN4020.txLogLength++] = '\n';
+    fakeRN4020.txLog[fakeRN4020.txLogLength] = '\0';
+  }
+
+  uint64_t replyNs = endNs + fakeRN4020.aokLatencyUs * 1000ULL;
+  const char* reply = FakeRN4020_respond ? FakeRN4020_respond(line) : NULL;
+  if (reply == NULL) {
+    reply = _FakeRN4020_defaultReply(line, replyNs);
+  }
+  if (reply != NULL && *reply != '\0') {
+    FakeRN4020_emitAt(reply, replyNs);
+  }
+}
+
+static const char* _FakeRN4020_defaultReply(const char* line, uint64_t replyNs) {
+  static char value[40];
+
+  if (strcmp(line, "R,1") == 0) {
+    FakeRN4020_emitAt("Reboot\r\n", replyNs);
+    fakeRN4020.baudRate = fakeBaudRates[fakeRN4020.pendingBaudIndex];
+    fakeRN4020.flowControl = (fakeRN4020.features & RN4020_FEATURE_UART_FLOW_CONTROL) != 0;
+    fakeRN4020.connected = false;
+    fakeRN4020.advertising = false;
+    fakeRN4020.mldp = false;
+    FakeRN4020_emitAt("CMD\r\n", replyNs + fakeRN4020.rebootTimeUs * 1000ULL);
+    return "";
+  } else if (strcmp(line, "SF,1") == 0) {
+    fakeRN4020.services = 0;
+    fakeRN4020.features = 0;
+    strcpy(fakeRN4020.name, "RN4020");
+    fakeRN4020.pendingBaudIndex = 4;
+    return "AOK\r\n";
+  } else if (strncmp(line, "SS,", 3) == 0) {
+    fakeRN4020.services = strtoul(line + 3, NULL, 16);
+    return "AOK\r\n";
+  } else if (strncmp(line, "SR,", 3) == 0) {
+    fakeRN4020.features = strtoul(line + 3, NULL, 16);
+    return "AOK\r\n";
+  } else if (strncmp(line, "SN,", 3) == 0) {
+    if (strlen(line + 3) > 20) {
+      return "ERR\r\n";
+    }
+    strcpy(fakeRN4020.name, line + 3);
+    return "AOK\r\n";
+  } else if (strncmp(line, "SB,", 3) == 0) {
+    int index = line[3] - '0';
+    if (line[4] != '\0' || index < 0 || index >= (int)(sizeof(fakeBaudRates) / sizeof(fakeBaudRates[0]))) {
+      return "ERR\r\n";
+    }
+    fakeRN4020.pendingBaudIndex = index;
+    return "AOK\r\n";
+  } else if (strcmp(line, "GS") == 0 || strcmp(line, "GR") == 0) {
+    snprintf(value, sizeof(value), "%08X\r\n", (unsigned)(line[1] == 'S' ? fakeRN4020.services : fakeRN4020.features));
+    return value;
+  } else if (strcmp(line, "GN") == 0) {
+    snprintf(value, sizeof(value), "%s\r\n", fakeRN4020.name);
+    return value;
+  } else if (strcmp(line, "PZ") == 0) {
+    fakeRN4020.characteristicsLength = 0;
+    fakeRN4020.serviceUUID[0] = '\0';
+    fakeRN4020.nextHandle = FAKE_RN4020_HANDLE_START;
+    return "AOK\r\n";
+  } else if (strncmp(line, "PS,", 3) == 0) {
+    if (strlen(line + 3) != 32) {
+      return "ERR\r\n";
+    }
+    strcpy(fakeRN4020.serviceUUID, line + 3);
+    fakeRN4020.nextHandle++;
+    return "AOK\r\n";
+  } else if (strncmp(line, "PC,", 3) == 0) {
+    if (fakeRN4020.serviceUUID[0] == '\0'
+        || fakeRN4020.characteristicsLength == FAKE_RN4020_MAX_CHARACTERISTICS
+        || strlen(line) < 3 + 32 + 6
+        || line[3 + 32] != ',') {
+      return "ERR\r\n";
+    }
+    FakeRN4020_Characteristic* characteristic = &fakeRN4020.characteristics[fakeRN4020.characteristicsLength++];
+    strcpy(characteristic->serviceUUID, fakeRN4020.serviceUUID);
+    memcpy(characteristic->uuid, line + 3, 32);
+    characteristic->uuid[32] = '\0';
+    characteristic->properties = strtoul(line + 3 + 33, NULL, 16);
+    // declaration, value and, for notify or indicate, the client configuration descriptor
+    fakeRN4020.nextHandle++;
+    characteristic->handle = fakeRN4020.nextHandle++;
+    characteristic->configurationHandle = (characteristic->properties & 0x30) ? fakeRN4020.nextHandle++ : 0;
+    return "AOK\r\n";
+  } else if (strcmp(line, "LS") == 0) {
+    _FakeRN4020_listServices(replyNs);
+    return "";
+  } else if (strncmp(line, "SHW,", 4) == 0) {
+    uint16_t handle = strtoul(line + 4, NULL, 16);
+    FakeRN4020_Characteristic* characteristic = _FakeRN4020_findHandle(handle);
+    if (characteristic == NULL || line[8] != ',' || strlen(line + 9) % 2 != 0) {
+      return "ERR\r\n";
+    }
+    return "AOK\r\n";
+  } else if (strcmp(line, "I") == 0) {
+    if (!fakeRN4020.cmdMldp) {
+      return "ERR\r\n";
+    }
+    fakeRN4020.mldp = true;
+    return "MLDP\r\n";
+  } else if (strncmp(line, "A", 1) == 0 && (line[1] == '\0' || line[1] == ',')) {
+    fakeRN4020.advertising = true;
+    return "AOK\r\n";
+  } else if (strcmp(line, "Y") == 0) {
+    fakeRN4020.advertising = false;
+    return "AOK\r\n";
+  } else if (strcmp(line, "K") == 0) {
+    if (!fakeRN4020.connected) {
+      return "ERR\r\n";
+    }
+    fakeRN4020.connected = false;
+    FakeRN4020_emitAt("AOK\r\n", replyNs);
+    return "Connection End\r\n";
+  }
+  return "AOK\r\n";
+}
+
+static FakeRN4020_Characteristic* _FakeRN4020_findHandle(uint16_t handle) {
+  for (uint8_t i = 0; i < fakeRN4020.characteristicsLength; i++) {
+    if (fakeRN4020.characteristics[i].handle == handle) {
+      return &fakeRN4020.characteristics[i];
+    }
+  }
+  return NULL;
+}
+
+static void _FakeRN4020_listServices(uint64_t replyNs) {
+  char line[80];
+  const char* serviceUUID = "";
+  for (uint8_t i = 0; i < fakeRN4020.characteristicsLength; i++) {
+    FakeRN4020_Characteristic* characteristic = &fakeRN4020.characteristics[i];
+    if (strcmp(characteristic->serviceUUID, serviceUUID) != 0) {
+      serviceUUID = characteristic->serviceUUID;
+      snprintf(line, sizeof(line), "%s\r\n", serviceUUID);
+      FakeRN4020_emitAt(line, replyNs);
+    }
+    snprintf(line, sizeof(line), "  %s,%04X,%02X\r\n", characteristic->uuid, characteristic->handle, characteristic->properties);
+    FakeRN4020_emitAt(line, replyNs);
+    if (characteristic->configurationHandle != 0) {
+      snprintf(line, sizeof(line), "  %s,%04X,10\r\n", characteristic->uuid, characteristic->configurationHandle);
+      FakeRN4020_emitAt(line, replyNs);
+    }
+  }
+  FakeRN4020_emitAt("END\r\n", replyNs);
+}
@@ -0,0 +1,127 @@
+#ifndef _HOST_FAKE_RN4020_H_
+#define _HOST_FAKE_RN4020_H_
+
+#include <platform_config.h>
+#include "../rn4020.h"
+
+#ifndef FAKE_RN4020_OUTPUT_SIZE
+#define FAKE_RN4020_OUTPUT_SIZE 8192
+#endif
+
+#ifndef FAKE_RN4020_TX_LOG_SIZE
+#define FAKE_RN4020_TX_LOG_SIZE 16384
+#endif
+
+#ifndef FAKE_RN4020_MAX_CHARACTERISTICS
+#define FAKE_RN4020_MAX_CHARACTERISTICS 16
+#endif
+
+typedef struct {
+  char serviceUUID[33];
+  char uuid[33];
+  uint8_t properties;
+  uint16_t handle;
+  uint16_t configurationHandle; // 0 unless the characteristic can notify or indicate
+} FakeRN4020_Characteristic;
+
+typedef struct {
+  uint8_t byte;
+  uint32_t baudRate;
+  bool flowControl;
+  uint64_t dueNs;
+} FakeRN4020_OutputByte;
+
+/**
+ * Scripted RN4020. Lines the driver transmits are answered the way the module does: AOK for settings, values for
+ * the get commands, an LS listing of the private services built with PZ/PS/PC, Reboot and CMD for R,1 and CMD on
+ * wake. Replies go out at the module's baud rate one byte time per byte, so the driver sees the real latency and a
+ * host UART left at the wrong rate receives nothing.
+ */
+typedef struct {
+  // timing, change after FakeRN4020_reset
+  uint32_t aokLatencyUs;      // end of a command line to the start of its reply
+  uint32_t rebootTimeUs;      // Reboot to CMD
+  uint32_t wakeTimeUs;        // WAKE_SW rising to CMD
+
+  // module settings, survive a reboot
+  uint32_t baudRate;
+  bool flowControl;
+  uint32_t services;
+  uint32_t features;
+  char name[21];
+  uint8_t pendingBaudIndex;   // from SB, applied on the next reboot
+  FakeRN4020_Characteristic characteristics[FAKE_RN4020_MAX_CHARACTERISTICS];
+  uint8_t characteristicsLength;
+  char serviceUUID[33];
+  uint16_t nextHandle;
+
+  // pins and modes
+  bool wakehw;
+  bool wakesw;
+  bool cmdMldp;
+  bool awake;
+  bool mldp;
+  bool connected;
+  bool advertising;
+
+  // traffic
+  char lineBuffer[600];
+  uint16_t lineLength;
+  uint32_t linesReceived;
+  uint32_t bytesGarbled;      // received while the host rate did not match or the module was asleep
+  uint32_t bytesLost;         // sent while the host rate did not match or the module was asleep
+  uint32_t mldpBytesReceived;
+  char txLog[FAKE_RN4020_TX_LOG_SIZE];
+  uint32_t txLogLength;
+
+  FakeRN4020_OutputByte output[FAKE_RN4020_OUTPUT_SIZE];
+  uint32_t outputHead;
+  uint32_t outputLength;
+  uint64_t outputLastDueNs;
+} FakeRN4020;
+
+extern FakeRN4020 fakeRN4020;
+
+extern GPIO_TypeDef FakeRN4020_wakeswPort;
+extern GPIO_TypeDef FakeRN4020_wakehwPort;
+extern GPIO_TypeDef FakeRN4020_cmdMldpPort;
+extern GPIO_TypeDef FakeRN4020_connectionPort; // high while connected, not wired by FakeRN4020_attach
+
+/**
+ * Optional script hook called for every command line before the default handling. Return the exact text to send
+ * back (including "\r\n"), "" to swallow the line without a reply or NULL to fall through to the defaults.
+ */
+extern const char* (*FakeRN4020_respond)(const char* line);
+
+/**
+ * Factory state: 115200 baud without flow control, powered off, no private services, empty TX log, no script hook.
+ */
+void FakeRN4020_reset(void);
+
+/**
+ * Fills the pins and UART of rn4020 with the fake's and sets the host UART to 115200 8N1.
+ */
+void FakeRN4020_attach(RN4020* rn4020, UART_HandleTypeDef* uart);
+
+/**
+ * Sends text from the module starting now, e.g. "WV,001A,0102.\r\n". Dropped while the module is asleep.
+ */
+void FakeRN4020_emit(const char* text);
+void FakeRN4020_emitAt(const char* text, uint64_t startNs);
+
+void FakeRN4020_connect(void);
+void FakeRN4020_disconnect(void);
+
+/**
+ * Number of lines in the TX log starting with prefix.
+ */
+uint32_t FakeRN4020_countLines(const char* prefix);
+void FakeRN4020_clearTxLog(void);
+
+// called by the stand-in HAL
+bool FakeRN4020_getPin(GPIO_TypeDef* port, uint16_t pin);
+void FakeRN4020_setPin(GPIO_TypeDef* port, uint16_t pin, bool high);
+void FakeRN4020_receive(uint32_t baudRate, bool flowControl, const uint8_t* data, uint16_t length, uint64_t endNs);
+void FakeRN4020_pump(uint32_t baudRate, bool flowControl, uint64_t nowNs);
+
+#endif
@@ -0,0 +1,10 @@
+#include "rn4020.h"
+
+// must not compile: 0A written as A, built by the gatt_uuid_short_byte test which expects the build to fail
+#define BAD_GATT(SERVICE, CHARACTERISTIC) \
+  SERVICE(BAD_SERVICE, (00, 11, 22, 33, 44, 55, 66, 77, 88, 99, A, BB, CC, DD, EE, FF))
+RN4020_GATT_TABLE(badGatt, BAD_GATT);
+
+int main(void) {
+  return badGatt.length;
+}
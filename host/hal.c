@@ -0,0 +1,115 @@
+#include "host.h"
+#include "fake_rn4020.h"
+#include <utils/ringbufferdma.h>
+#include <utils/time.h>
+#include <string.h>
+
+#define HOST_RUN_STEP_NS 100000
+
+uint32_t Host_tickCostNs = 2000;
+
+static uint64_t hostNowNs;
+static uint64_t hostTxDoneNs;
+static RingBufferDmaU8* hostRxRing;
+static UART_HandleTypeDef* hostUart;
+
+uint64_t Host_nowNs(void) {
+  return hostNowNs;
+}
+
+void Host_advanceNs(uint64_t ns) {
+  hostNowNs += ns;
+}
+
+void Host_reset(void) {
+  hostNowNs = 0;
+  hostTxDoneNs = 0;
+  hostRxRing = NULL;
+  hostUart = NULL;
+  Host_tickCostNs = 2000;
+}
+
+uint64_t Host_byteTimeNs(uint32_t baudRate) {
+  return (10ULL * 1000000000ULL + baudRate - 1) / baudRate;
+}
+
+void Host_rxWrite(const uint8_t* data, uint32_t length) {
+  if (hostRxRing == NULL) {
+    return;
+  }
+  // like the DMA, a full ring is simply overwritten
+  for (uint32_t i = 0; i < length; i++) {
+    hostRxRing->buffer[hostRxRing->head] = data[i];
+    hostRxRing->head = (hostRxRing->head + 1) % hostRxRing->size;
+  }
+}
+
+void Host_run(RN4020* rn4020, uint32_t ms) {
+  uint64_t endNs = hostNowNs + (uint64_t)ms * 1000000;
+  while (hostNowNs < endNs) {
+    hostNowNs += HOST_RUN_STEP_NS;
+    RN4020_tick(rn4020);
+  }
+}
+
+uint32_t HAL_GetTick(void) {
+  hostNowNs += Host_tickCostNs;
+  return (uint32_t)(hostNowNs / 1000000);
+}
+
+void sleep_ms(uint32_t ms) {
+  hostNowNs += (uint64_t)ms * 1000000;
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef* port, uint16_t pin) {
+  return FakeRN4020_getPin(port, pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef* port, uint16_t pin, GPIO_PinState state) {
+  FakeRN4020_setPin(port, pin, state == GPIO_PIN_SET);
+}
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef* uart) {
+  hostUart = uart;
+  hostTxDoneNs = hostNowNs;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef* uart) {
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_DMAStop(UART_HandleTypeDef* uart) {
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef* uart, uint8_t* data, uint16_t size) {
+  if (hostNowNs < hostTxDoneNs) {
+    return HAL_BUSY;
+  }
+  hostUart = uart;
+  hostTxDoneNs = hostNowNs + Host_byteTimeNs(uart->Init.BaudRate) * size;
+  FakeRN4020_receive(uart->Init.BaudRate, uart->Init.HwFlowCtl == UART_HWCONTROL_RTS_CTS, data, size, hostTxDoneNs);
+  return HAL_OK;
+}
+
+HAL_UART_StateTypeDef HAL_UART_GetState(UART_HandleTypeDef* uart) {
+  return hostNowNs < hostTxDoneNs ? HAL_UART_STATE_BUSY_TX : HAL_UART_STATE_READY;
+}
+
+void RingBufferDmaU8_initUSARTRx(RingBufferDmaU8* ring, UART_HandleTypeDef* uart, uint8_t* buffer, uint16_t size) {
+  ring->buffer = buffer;
+  ring->size = size;
+  ring->tailPtr = buffer;
+  ring->head = 0;
+  hostRxRing = ring;
+  hostUart = uart;
+}
+
+uint16_t RingBufferDmaU8_available(RingBufferDmaU8* ring) {
+  if (hostUart != NULL) {
+    FakeRN4020_pump(hostUart->Init.BaudRate, hostUart->Init.HwFlowCtl == UART_HWCONTROL_RTS_CTS, hostNowNs);
+  }
+  uint16_t tail = ring->tailPtr - ring->buffer;
+  return (ring->head + ring->size - tail) % ring->size;
+}
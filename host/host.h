@@ -0,0 +1,41 @@
+#ifndef _HOST_HOST_H_
+#define _HOST_HOST_H_
+
+#include <platform_config.h>
+#include "../rn4020.h"
+
+/**
+ * Virtual clock shared by the stand-in HAL and the fake module, in nanoseconds so UART byte times at 921600 baud
+ * stay exact. Nothing on the host ever sleeps, time only moves when the driver reads the tick or sleeps.
+ */
+uint64_t Host_nowNs(void);
+void Host_advanceNs(uint64_t ns);
+
+/**
+ * Virtual time charged for every HAL_GetTick call. Busy loops in the driver poll the tick, this stands in for the
+ * CPU time those loops would burn on the target so waits make progress.
+ */
+extern uint32_t Host_tickCostNs;
+
+/**
+ * Resets the clock, the UART and the RX ring binding. Call before FakeRN4020_reset at the start of every test.
+ */
+void Host_reset(void);
+
+/**
+ * Time one byte (start bit, 8 data bits, stop bit) takes on the wire.
+ */
+uint64_t Host_byteTimeNs(uint32_t baudRate);
+
+/**
+ * Writes straight into the RX ring as if the DMA had just received the bytes, bypassing the module timing. Used by
+ * the parser benchmark.
+ */
+void Host_rxWrite(const uint8_t* data, uint32_t length);
+
+/**
+ * Ticks the driver until ms of virtual time have passed.
+ */
+void Host_run(RN4020* rn4020, uint32_t ms);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef _HOST_PLATFORM_CONFIG_H_
+#define _HOST_PLATFORM_CONFIG_H_
+
+/**
+ * Stand-in for the STM32 HAL so rn4020.c builds and runs on the host. Only what the driver touches is declared, the
+ * definitions in host/hal.c route UART and GPIO traffic to the scripted module in host/fake_rn4020.c.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef __weak
+#define __weak __attribute__((weak))
+#endif
+
+typedef enum {
+  HAL_OK = 0x00,
+  HAL_ERROR = 0x01,
+  HAL_BUSY = 0x02,
+  HAL_TIMEOUT = 0x03
+} HAL_StatusTypeDef;
+
+typedef struct {
+  int id;
+} GPIO_TypeDef;
+
+typedef enum {
+  GPIO_PIN_RESET = 0,
+  GPIO_PIN_SET
+} GPIO_PinState;
+
+typedef enum {
+  HAL_UART_STATE_RESET = 0x00,
+  HAL_UART_STATE_READY = 0x20,
+  HAL_UART_STATE_BUSY_TX = 0x21,
+  HAL_UART_STATE_BUSY_RX = 0x22,
+  HAL_UART_STATE_BUSY_TX_RX = 0x23
+} HAL_UART_StateTypeDef;
+
+#define UART_HWCONTROL_NONE    0x00000000U
+#define UART_HWCONTROL_RTS_CTS 0x00000300U
+
+typedef struct {
+  uint32_t BaudRate;
+  uint32_t HwFlowCtl;
+} UART_InitTypeDef;
+
+typedef struct {
+  UART_InitTypeDef Init;
+} UART_HandleTypeDef;
+
+uint32_t HAL_GetTick(void);
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef* port, uint16_t pin);
+void HAL_GPIO_WritePin(GPIO_TypeDef* port, uint16_t pin, GPIO_PinState state);
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef* uart);
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef* uart);
+HAL_StatusTypeDef HAL_UART_DMAStop(UART_HandleTypeDef* uart);
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef* uart, uint8_t* data, uint16_t size);
+HAL_UART_StateTypeDef HAL_UART_GetState(UART_HandleTypeDef* uart);
+
+#endif
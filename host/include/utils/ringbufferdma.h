@@ -0,0 +1,20 @@
+#ifndef _HOST_RINGBUFFERDMA_H_
+#define _HOST_RINGBUFFERDMA_H_
+
+#include <platform_config.h>
+
+/**
+ * Host version of the circular RX DMA ring. head plays the part of the DMA write pointer and is advanced by the fake
+ * module as bytes arrive, the driver only reads buffer, size and tailPtr.
+ */
+typedef struct {
+  uint8_t* buffer;
+  uint16_t size;
+  volatile uint8_t* tailPtr;
+  volatile uint16_t head;
+} RingBufferDmaU8;
+
+void RingBufferDmaU8_initUSARTRx(RingBufferDmaU8* ring, UART_HandleTypeDef* uart, uint8_t* buffer, uint16_t size);
+uint16_t RingBufferDmaU8_available(RingBufferDmaU8* ring);
+
+#endif
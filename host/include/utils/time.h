@@ -0,0 +1,11 @@
+#ifndef _HOST_TIME_H_
+#define _HOST_TIME_H_
+
+#include <stdint.h>
+
+/**
+ * Advances the virtual clock, nothing actually sleeps.
+ */
+void sleep_ms(uint32_t ms);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef _HOST_UTILS_H_
+#define _HOST_UTILS_H_
+
+#include <platform_config.h>
+
+#define returnNonOKHALStatus(x) \
+  do { \
+    HAL_StatusTypeDef _status = (x); \
+    if (_status != HAL_OK) { \
+      return _status; \
+    } \
+  } while (0)
+
+#endif
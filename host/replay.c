@@ -0,0 +1,106 @@
+#include "host.h"
+#include "fake_rn4020.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Decodes a trace captured with RN4020_traceDump and replays its RX records through a freshly set up driver with
+ * RN4020_traceReplay. The module side of the replay is the fake, so only the recorded RX drives the state machine.
+ *
+ *   rn4020_replay <trace file> [speed]
+ *
+ * speed is passed to RN4020_traceReplay: 0 as fast as possible (default), 1 at the recorded pace, n n times faster.
+ */
+
+static RN4020 rn4020;
+static UART_HandleTypeDef uart;
+
+void RN4020_onWrite(RN4020* rn4020, uint16_t characteristicHandle, uint8_t* data, uint8_t dataLength) {
+  printf("  onWrite 0x%04X, %d bytes\n", characteristicHandle, dataLength);
+}
+
+void RN4020_connectedStateChanged(RN4020* rn4020, bool connected) {
+  printf("  %s\n", connected ? "connected" : "disconnected");
+}
+
+void RN4020_onMLDPData(RN4020* rn4020, const uint8_t* data, uint16_t dataLength) {
+  printf("  onMLDPData %d bytes\n", dataLength);
+}
+
+static void printPayload(const uint8_t* data, uint8_t length) {
+  for (uint8_t i = 0; i < length; i++) {
+    if (data[i] == '\n') {
+      printf("\\n");
+    } else if (data[i] == '\r') {
+      printf("\\r");
+    } else if (isprint(data[i])) {
+      putchar(data[i]);
+    } else {
+      printf("\\x%02X", data[i]);
+    }
+  }
+}
+
+static uint32_t decode(const uint8_t* trace, uint32_t traceLength) {
+  static const char* types[] = { "??", "TX", "RX", "MLDP" };
+  uint32_t records = 0;
+  uint32_t offset = 0;
+  uint32_t firstTimestamp = 0;
+  while (offset + RN4020_TRACE_HEADER_LENGTH <= traceLength) {
+    const uint8_t* header = trace + offset;
+    uint8_t length = header[1];
+    uint32_t timestamp = header[2] | (header[3] << 8) | (header[4] << 16) | ((uint32_t)header[5] << 24);
+    if (offset + RN4020_TRACE_HEADER_LENGTH + length > traceLength) {
+      fprintf(stderr, "truncated record at offset %lu\n", (unsigned long)offset);
+      break;
+    }
+    if (records == 0) {
+      firstTimestamp = timestamp;
+    }
+    printf("%8lu ms %-4s ", (unsigned long)(timestamp - firstTimestamp), header[0] <= RN4020_TRACE_MLDP_RX ? types[header[0]] : types[0]);
+    printPayload(header + RN4020_TRACE_HEADER_LENGTH, length);
+    printf("\n");
+    offset += RN4020_TRACE_HEADER_LENGTH + length;
+    records++;
+  }
+  return records;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <trace file> [speed]\n", argv[0]);
+    return 2;
+  }
+  uint32_t speed = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+
+  FILE* file = fopen(argv[1], "rb");
+  if (file == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  static uint8_t trace[1024 * 1024];
+  uint32_t traceLength = fread(trace, 1, sizeof(trace), file);
+  fclose(file);
+
+  uint32_t records = decode(trace, traceLength);
+  printf("%lu records, %lu bytes\n", (unsigned long)records, (unsigned long)traceLength);
+
+  Host_reset();
+  FakeRN4020_reset();
+  FakeRN4020_attach(&rn4020, &uart);
+  if (RN4020_setup(&rn4020) != HAL_OK) {
+    fprintf(stderr, "setup failed\n");
+    return 1;
+  }
+  RN4020_resetStats(&rn4020);
+  printf("replay:\n");
+  uint32_t replayed = RN4020_traceReplay(&rn4020, trace, traceLength, speed);
+  RN4020_Stats stats;
+  RN4020_getStats(&rn4020, &stats);
+  printf("%lu records replayed, %lu unexpected lines, %lu command errors, %lu timeouts\n",
+         (unsigned long)replayed, (unsigned long)stats.unexpectedLines,
+         (unsigned long)stats.commandErrors, (unsigned long)stats.commandTimeouts);
+  return 0;
+}
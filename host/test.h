@@ -0,0 +1,39 @@
+#ifndef _HOST_TEST_H_
+#define _HOST_TEST_H_
+
+#include "host.h"
+#include "fake_rn4020.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Minimal test runner for the host tests, each test binary is one ctest test. A failed CHECK prints the location
+ * and exits non-zero.
+ */
+#define CHECK(x) \
+  do { \
+    if (!(x)) { \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #x); \
+      exit(1); \
+    } \
+  } while (0)
+
+#define CHECK_OK(x) CHECK((x) == HAL_OK)
+
+#define RUN_TEST(fn) \
+  do { \
+    printf("%s\n", #fn); \
+    fn(); \
+  } while (0)
+
+/**
+ * Fresh clock and factory-state module, rn4020 wired to the fake and set up at 115200.
+ */
+static inline void testSetup(RN4020* rn4020, UART_HandleTypeDef* uart) {
+  Host_reset();
+  FakeRN4020_reset();
+  FakeRN4020_attach(rn4020, uart);
+  CHECK_OK(RN4020_setup(rn4020));
+}
+
+#endif
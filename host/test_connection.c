@@ -0,0 +1,120 @@
+#include "test.h"
+#include <string.h>
+
+static RN4020 rn4020;
+static UART_HandleTypeDef uart;
+
+static uint32_t parameterReports;
+static RN4020_ConnectionParameters lastParameters;
+
+void RN4020_onConnectionParameters(RN4020* rn4020, const RN4020_ConnectionParameters* parameters) {
+  parameterReports++;
+  lastParameters = *parameters;
+}
+
+static const RN4020_ConnectionTuner tuner = {
+  .fast = { .interval = 0x0006, .latency = 0x0000, .timeout = 0x01f4 },
+  .idle = { .interval = 0x0050, .latency = 0x0004, .timeout = 0x0258 },
+  .fastWritesPerWindow = 5,
+  .idleTime = RN4020_TUNER_WINDOW + 500
+};
+
+// the fake rejects writes to handles it did not allocate
+static const char* acknowledgeWrites(const char* line) {
+  return strncmp(line, "SHW,", 4) == 0 ? "AOK\r\n" : NULL;
+}
+
+static void connect(void) {
+  testSetup(&rn4020, &uart);
+  FakeRN4020_respond = acknowledgeWrites;
+  parameterReports = 0;
+  FakeRN4020_connect();
+  Host_run(&rn4020, 5);
+  CHECK(RN4020_isConnected(&rn4020));
+  FakeRN4020_clearTxLog();
+}
+
+static void writeValues(uint32_t count) {
+  uint8_t data[2] = { 1, 2 };
+  for (uint32_t i = 0; i < count; i++) {
+    CHECK_OK(RN4020_writeServerCharacteristicHandle(&rn4020, 0x0100, data, sizeof(data)));
+  }
+}
+
+static void testConnectionParametersLine(void) {
+  connect();
+  RN4020_ConnectionParameters parameters;
+  CHECK(!RN4020_getConnectionParameters(&rn4020, &parameters));
+  FakeRN4020_emit("ConnParam:0006,0000,01F4\r\n");
+  Host_run(&rn4020, 5);
+  CHECK(parameterReports == 1);
+  CHECK(lastParameters.interval == 0x0006 && lastParameters.latency == 0x0000 && lastParameters.timeout == 0x01f4);
+  CHECK(RN4020_getConnectionParameters(&rn4020, &parameters));
+  CHECK(parameters.interval == 0x0006 && parameters.timeout == 0x01f4);
+
+  // malformed lines leave the last report in place
+  FakeRN4020_emit("ConnParam:00G6,0000,01F4\r\n");
+  FakeRN4020_emit("ConnParam:0006;0000,01F4\r\n");
+  FakeRN4020_emit("ConnParam:0006,0000\r\n");
+  Host_run(&rn4020, 5);
+  CHECK(parameterReports == 1);
+  CHECK(RN4020_getConnectionParameters(&rn4020, &parameters) && parameters.interval == 0x0006);
+
+  FakeRN4020_disconnect();
+  Host_run(&rn4020, 5);
+  CHECK(!RN4020_getConnectionParameters(&rn4020, &parameters));
+}
+
+static void testTunerSwitchesFastAndIdle(void) {
+  connect();
+  RN4020_setConnectionTuner(&rn4020, &tuner);
+  writeValues(tuner.fastWritesPerWindow);
+  Host_run(&rn4020, RN4020_TUNER_WINDOW + 10);
+  CHECK(FakeRN4020_countLines("T,0006,0000,01F4") == 1);
+
+  // still busy, no second request
+  writeValues(tuner.fastWritesPerWindow);
+  Host_run(&rn4020, RN4020_TUNER_WINDOW);
+  CHECK(FakeRN4020_countLines("T,") == 1);
+
+  // the idle request waits for the next window after idleTime without writes
+  Host_run(&rn4020, RN4020_TUNER_WINDOW + tuner.idleTime);
+  CHECK(FakeRN4020_countLines("T,0050,0004,0258") == 1);
+  Host_run(&rn4020, RN4020_TUNER_WINDOW * 3);
+  CHECK(FakeRN4020_countLines("T,") == 2);
+  RN4020_setConnectionTuner(&rn4020, NULL);
+}
+
+static void testTunerIgnoresResetStats(void) {
+  connect();
+  RN4020_setConnectionTuner(&rn4020, &tuner);
+  writeValues(tuner.fastWritesPerWindow - 1);
+  Host_run(&rn4020, RN4020_TUNER_WINDOW + 10);
+  RN4020_resetStats(&rn4020);
+  Host_run(&rn4020, RN4020_TUNER_WINDOW * 3);
+  CHECK(FakeRN4020_countLines("T,") == 0);
+  RN4020_setConnectionTuner(&rn4020, NULL);
+}
+
+static void testTunerIgnoresReadResponses(void) {
+  connect();
+  uint8_t data[2] = { 3, 4 };
+  CHECK_OK(RN4020_setReadValue(&rn4020, 0x0100, data, sizeof(data)));
+  RN4020_setConnectionTuner(&rn4020, &tuner);
+  for (uint32_t i = 0; i < tuner.fastWritesPerWindow * 2; i++) {
+    FakeRN4020_emit("RV,0100.\r\n");
+    Host_run(&rn4020, 10);
+  }
+  CHECK(FakeRN4020_countLines("SHW,0100,0304") == tuner.fastWritesPerWindow * 2);
+  Host_run(&rn4020, RN4020_TUNER_WINDOW * 2);
+  CHECK(FakeRN4020_countLines("T,") == 0);
+  RN4020_setConnectionTuner(&rn4020, NULL);
+}
+
+int main(void) {
+  RUN_TEST(testConnectionParametersLine);
+  RUN_TEST(testTunerSwitchesFastAndIdle);
+  RUN_TEST(testTunerIgnoresResetStats);
+  RUN_TEST(testTunerIgnoresReadResponses);
+  return 0;
+}
@@ -0,0 +1,321 @@
+#include "test.h"
+#include <string.h>
+
+static RN4020 rn4020;
+static UART_HandleTypeDef uart;
+
+static const uint8_t serviceUUID[16] = {
+  0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0x00, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+};
+static const uint8_t characteristicUUID[16] = {
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+
+#define TEST_GATT(SERVICE, CHARACTERISTIC) \
+  SERVICE(TEST_SERVICE, (11, 22, 33, 44, 55, 66, 77, 88, 99, 00, AA, BB, CC, DD, EE, FF)) \
+  CHARACTERISTIC(TEST_VALUE, (00, 01, 02, 03, 04, 05, 06, 07, 08, 09, 0A, 0B, 0C, 0D, 0E, 0F), \
+                 RN4020_PRIVATE_CHARACTERISTIC_PROPERTY_READ | RN4020_PRIVATE_CHARACTERISTIC_PROPERTY_NOTIFY, \
+                 20, RN4020_PRIVATE_CHARACTERISTIC_SECURITY_NONE)
+RN4020_GATT_TABLE(testGatt, TEST_GATT);
+
+static uint16_t lastWriteHandle;
+static uint8_t lastWriteData[20];
+static uint8_t lastWriteLength;
+
+void RN4020_onWrite(RN4020* rn4020, uint16_t characteristicHandle, uint8_t* data, uint8_t dataLength) {
+  lastWriteHandle = characteristicHandle;
+  lastWriteLength = dataLength;
+  memcpy(lastWriteData, data, dataLength);
+}
+
+static void addPrivateService(void) {
+  CHECK_OK(RN4020_clearPrivate(&rn4020));
+  CHECK_OK(RN4020_addPrivateService(&rn4020, serviceUUID));
+  CHECK_OK(RN4020_addPrivateCharacteristic(
+             &rn4020,
+             characteristicUUID,
+             RN4020_PRIVATE_CHARACTERISTIC_PROPERTY_NOTIFY | RN4020_PRIVATE_CHARACTERISTIC_PROPERTY_READ | RN4020_PRIVATE_CHARACTERISTIC_PROPERTY_WRITE,
+             20,
+             RN4020_PRIVATE_CHARACTERISTIC_SECURITY_NONE
+           ));
+  CHECK_OK(RN4020_refreshHandleLookup(&rn4020));
+}
+
+static void connectAndSubscribe(int characteristic) {
+  char line[32];
+  FakeRN4020_connect();
+  snprintf(line, sizeof(line), "WV,%04X,0100.\r\n", fakeRN4020.characteristics[characteristic].configurationHandle);
+  FakeRN4020_emit(line);
+  Host_run(&rn4020, 5);
+  CHECK(RN4020_getClientConfiguration(&rn4020, fakeRN4020.characteristics[characteristic].handle) == RN4020_CLIENT_CONFIGURATION_NOTIFY);
+}
+
+static void testSetupWaitsForCMD(void) {
+  testSetup(&rn4020, &uart);
+  CHECK(rn4020.state == RN4020_STATE_READY);
+  CHECK(fakeRN4020.awake);
+}
+
+static void testSettings(void) {
+  testSetup(&rn4020, &uart);
+  uint32_t services;
+  char name[21];
+  CHECK_OK(RN4020_setSupportedServices(&rn4020, RN4020_SERVICE_BATTERY | RN4020_SERVICE_USER_DEFINED));
+  CHECK_OK(RN4020_getSupportedServices(&rn4020, &services));
+  CHECK(services == (RN4020_SERVICE_BATTERY | RN4020_SERVICE_USER_DEFINED));
+  CHECK_OK(RN4020_setDeviceName(&rn4020, "host"));
+  CHECK_OK(RN4020_getDeviceName(&rn4020, name, sizeof(name)));
+  CHECK(strcmp(name, "host") == 0);
+  CHECK(RN4020_setDeviceName(&rn4020, "a name that is far too long") != HAL_OK);
+  CHECK_OK(RN4020_reset(&rn4020));
+}
+
+static void testHandleLookupAndWrites(void) {
+  testSetup(&rn4020, &uart);
+  addPrivateService();
+  // the value line and the configuration descriptor line
+  CHECK(rn4020.handleLookupLength == 2);
+  uint16_t handle = rn4020.handleLookup[0].handle;
+  CHECK(handle == fakeRN4020.characteristics[0].handle);
+  CHECK(rn4020.handleLookup[0].configurationHandle == fakeRN4020.characteristics[0].configurationHandle);
+
+  connectAndSubscribe(0);
+  uint8_t data[3] = { 1, 2, 3 };
+  CHECK_OK(RN4020_writeServerPrivateCharacteristic(&rn4020, characteristicUUID, data, sizeof(data)));
+  CHECK(FakeRN4020_countLines("SHW,") == 1);
+  CHECK(RN4020_writeServerCharacteristicHandle(&rn4020, 0x0100, data, sizeof(data)) == HAL_ERROR);
+
+  char line[32];
+  snprintf(line, sizeof(line), "WV,%04X,0A0B.\r\n", handle);
+  FakeRN4020_emit(line);
+  Host_run(&rn4020, 5);
+  CHECK(lastWriteHandle == handle);
+  CHECK(lastWriteLength == 2 && lastWriteData[0] == 0x0a && lastWriteData[1] == 0x0b);
+}
+
+static uint32_t writeCallbacks;
+static HAL_StatusTypeDef writeCallbackStatus;
+
+static void writeCallback(RN4020* rn4020, RN4020_CommandToken token, HAL_StatusTypeDef status, void* userData) {
+  writeCallbacks++;
+  writeCallbackStatus = status;
+}
+
+static void testUnheardWritesAreCached(void) {
+  testSetup(&rn4020, &uart);
+  addPrivateService();
+  uint16_t handle = rn4020.handleLookup[0].handle;
+  FakeRN4020_clearTxLog();
+
+  // disconnected: completes at once without waking anything, the value waits in the write cache
+  uint8_t data[2] = { 0xab, 0xcd };
+  RN4020_CommandToken token;
+  writeCallbacks = 0;
+  CHECK_OK(RN4020_writeServerCharacteristicHandleAsync(&rn4020, handle, data, sizeof(data), writeCallback, NULL, &token));
+  CHECK_OK(RN4020_waitForCommand(&rn4020, token));
+  CHECK(writeCallbacks == 1 && writeCallbackStatus == HAL_OK);
+  data[1] = 0xce;
+  CHECK_OK(RN4020_writeServerCharacteristicHandle(&rn4020, handle, data, sizeof(data)));
+  CHECK(FakeRN4020_countLines("SHW,") == 0);
+
+  // connected but not subscribed
+  FakeRN4020_connect();
+  Host_run(&rn4020, 5);
+  CHECK_OK(RN4020_writeServerCharacteristicHandle(&rn4020, handle, data, sizeof(data)));
+  CHECK(FakeRN4020_countLines("SHW,") == 0);
+
+  // the latest value goes out once the client subscribes
+  connectAndSubscribe(0);
+  Host_run(&rn4020, 5);
+  char line[32];
+  snprintf(line, sizeof(line), "SHW,%04X,ABCE", handle);
+  CHECK(FakeRN4020_countLines("SHW,") == 1 && FakeRN4020_countLines(line) == 1);
+}
+
+static bool acceptWrites;
+
+static const char* acknowledgeWrites(const char* line) {
+  if (strncmp(line, "SHW,0100,", 9) != 0) {
+    return NULL;
+  }
+  return acceptWrites ? "AOK\r\n" : "ERR\r\n";
+}
+
+static void testWriteCache(void) {
+  testSetup(&rn4020, &uart);
+  FakeRN4020_respond = acknowledgeWrites;
+  FakeRN4020_connect();
+  Host_run(&rn4020, 5);
+  uint32_t writesCoalesced, writesSent;
+  uint8_t data[2] = { 1, 2 };
+
+  // a rejected write stays pending and is not counted
+  acceptWrites = false;
+  CHECK_OK(RN4020_writeServerCharacteristicHandleDeferred(&rn4020, 0x0100, data, sizeof(data)));
+  CHECK(RN4020_flushWriteCache(&rn4020) == HAL_ERROR);
+  RN4020_getWriteCacheStats(&rn4020, &writesCoalesced, &writesSent);
+  CHECK(writesSent == 0 && rn4020.writeCache[0].pending);
+  acceptWrites = true;
+  CHECK_OK(RN4020_flushWriteCache(&rn4020));
+  RN4020_getWriteCacheStats(&rn4020, &writesCoalesced, &writesSent);
+  CHECK(writesSent == 1 && !rn4020.writeCache[0].pending);
+
+  // the same from RN4020_tick, retried until the module takes it
+  acceptWrites = false;
+  FakeRN4020_clearTxLog();
+  CHECK_OK(RN4020_writeServerCharacteristicHandleDeferred(&rn4020, 0x0100, data, sizeof(data)));
+  Host_run(&rn4020, 10);
+  CHECK(FakeRN4020_countLines("SHW,0100,") >= 2);
+  RN4020_getWriteCacheStats(&rn4020, &writesCoalesced, &writesSent);
+  CHECK(writesSent == 1);
+  acceptWrites = true;
+  Host_run(&rn4020, 10);
+  RN4020_getWriteCacheStats(&rn4020, &writesCoalesced, &writesSent);
+  CHECK(writesSent == 2 && !rn4020.writeCache[0].pending);
+
+  // an idle link does not wait for the interval
+  RN4020_setWriteCacheFlushInterval(&rn4020, 1000);
+  Host_run(&rn4020, 5);
+  FakeRN4020_clearTxLog();
+  CHECK_OK(RN4020_writeServerCharacteristicHandleDeferred(&rn4020, 0x0100, data, sizeof(data)));
+  Host_run(&rn4020, 10);
+  CHECK(FakeRN4020_countLines("SHW,0100,") == 1);
+}
+
+static void testGattTable(void) {
+  CHECK(strcmp(testGatt_entries[TEST_VALUE].command, "PC,000102030405060708090A0B0C0D0E0F") == 0);
+  CHECK(memcmp(testGatt_entries[TEST_VALUE].uuid, characteristicUUID, sizeof(characteristicUUID)) == 0);
+  testSetup(&rn4020, &uart);
+  CHECK_OK(RN4020_clearPrivate(&rn4020));
+  CHECK_OK(RN4020_addGattTable(&rn4020, &testGatt));
+  RN4020_bindGattTable(&rn4020, &testGatt);
+  CHECK_OK(RN4020_refreshHandleLookup(&rn4020));
+  CHECK(RN4020_GATT_HANDLE(testGatt, TEST_VALUE) == fakeRN4020.characteristics[0].handle);
+}
+
+static void testTimeout(void) {
+  testSetup(&rn4020, &uart);
+  FakeRN4020_respond = NULL;
+  fakeRN4020.aokLatencyUs = 2 * RN4020_AOK_TIMEOUT * 1000;
+  uint32_t startTime = HAL_GetTick();
+  CHECK(RN4020_setSupportedFeatures(&rn4020, 0) == HAL_TIMEOUT);
+  CHECK(HAL_GetTick() - startTime >= RN4020_AOK_TIMEOUT);
+}
+
+static void testBaudRate(void) {
+  testSetup(&rn4020, &uart);
+  CHECK_OK(RN4020_setBaudRate(&rn4020, 921600, true));
+  CHECK(fakeRN4020.baudRate == 921600 && fakeRN4020.flowControl);
+  CHECK(uart.Init.BaudRate == 921600 && uart.Init.HwFlowCtl == UART_HWCONTROL_RTS_CTS);
+  uint32_t features;
+  CHECK_OK(RN4020_getSupportedFeatures(&rn4020, &features));
+  CHECK(features & RN4020_FEATURE_UART_FLOW_CONTROL);
+}
+
+static const char* silent(const char* line) {
+  return "";
+}
+
+static void testSetupFallsBackToPreviousRate(void) {
+  // the CMD prompt comes too late, the module is still at the default rate
+  Host_reset();
+  FakeRN4020_reset();
+  FakeRN4020_attach(&rn4020, &uart);
+  rn4020.baudRate = 921600;
+  rn4020.flowControl = true;
+  fakeRN4020.wakeTimeUs = (RN4020_TIMEOUT + 50) * 1000;
+  CHECK_OK(RN4020_setup(&rn4020));
+  CHECK(fakeRN4020.baudRate == 921600 && uart.Init.BaudRate == 921600);
+
+  // no answer at either rate, the uart is left at the rate it started with
+  Host_reset();
+  FakeRN4020_reset();
+  FakeRN4020_attach(&rn4020, &uart);
+  fakeRN4020.wakeTimeUs = (RN4020_TIMEOUT + 50) * 1000;
+  FakeRN4020_respond = silent;
+  CHECK(RN4020_setup(&rn4020) != HAL_OK);
+  CHECK(uart.Init.BaudRate == 115200 && uart.Init.HwFlowCtl == UART_HWCONTROL_NONE);
+  rn4020.baudRate = 0;
+  rn4020.flowControl = false;
+}
+
+static RN4020_GattEntry provisionEntries[12];
+static uint8_t provisionUUIDs[11][16];
+
+static RN4020_Config provisionConfig(uint8_t characteristics, uint8_t propertyOptions) {
+  provisionEntries[0] = (RN4020_GattEntry) { true, serviceUUID, 0, 0, 0, NULL };
+  for (uint8_t i = 0; i < characteristics; i++) {
+    memcpy(provisionUUIDs[i], characteristicUUID, sizeof(characteristicUUID));
+    provisionUUIDs[i][15] = i;
+    provisionEntries[i + 1] = (RN4020_GattEntry) {
+      false, provisionUUIDs[i], propertyOptions, 20, RN4020_PRIVATE_CHARACTERISTIC_SECURITY_NONE, NULL
+    };
+  }
+  return (RN4020_Config) {
+    .services = RN4020_SERVICE_USER_DEFINED,
+    .features = RN4020_FEATURE_REAL_TIME_READ,
+    .deviceName = "provisioned",
+    .privateEntries = provisionEntries,
+    .privateEntriesLength = characteristics + 1
+  };
+}
+
+static void testProvision(void) {
+  testSetup(&rn4020, &uart);
+  RN4020_Config config = provisionConfig(1, RN4020_PRIVATE_CHARACTERISTIC_PROPERTY_READ | RN4020_PRIVATE_CHARACTERISTIC_PROPERTY_NOTIFY);
+  bool changed;
+  FakeRN4020_clearTxLog();
+  CHECK_OK(RN4020_provision(&rn4020, &config, &changed));
+  CHECK(changed);
+  CHECK(FakeRN4020_countLines("R,1") == 1 && FakeRN4020_countLines("PZ") == 1 && FakeRN4020_countLines("PC,") == 1);
+  CHECK(fakeRN4020.services == config.services && fakeRN4020.features == config.features);
+  CHECK(RN4020_lookupUUID(&rn4020, provisionUUIDs[0], 16) != NULL);
+
+  // an already configured module only gets the four queries
+  FakeRN4020_clearTxLog();
+  CHECK_OK(RN4020_provision(&rn4020, &config, &changed));
+  CHECK(!changed);
+  CHECK(FakeRN4020_countLines("") == 4);
+  CHECK(FakeRN4020_countLines("GS") == 1 && FakeRN4020_countLines("GR") == 1);
+  CHECK(FakeRN4020_countLines("GN") == 1 && FakeRN4020_countLines("LS") == 1);
+
+  // a changed property byte is seen in LS and rebuilds the private services
+  config = provisionConfig(1, RN4020_PRIVATE_CHARACTERISTIC_PROPERTY_READ);
+  FakeRN4020_clearTxLog();
+  CHECK_OK(RN4020_provision(&rn4020, &config, &changed));
+  CHECK(changed);
+  CHECK(FakeRN4020_countLines("PZ") == 1 && FakeRN4020_countLines("PC,") == 1 && FakeRN4020_countLines("R,1") == 1);
+  CHECK(FakeRN4020_countLines("SS,") == 0 && FakeRN4020_countLines("SN,") == 0);
+  CHECK(fakeRN4020.characteristics[0].properties == RN4020_PRIVATE_CHARACTERISTIC_PROPERTY_READ);
+}
+
+static void testProvisionLookupOverflow(void) {
+  // every notify characteristic takes two lookup entries, eleven of them overflow the table
+  testSetup(&rn4020, &uart);
+  RN4020_Config config = provisionConfig(11, RN4020_PRIVATE_CHARACTERISTIC_PROPERTY_NOTIFY);
+  CHECK(2 * 11 > RN4020_LOOKUP_TABLE_SIZE);
+  bool changed;
+  CHECK(RN4020_provision(&rn4020, &config, &changed) == HAL_ERROR);
+  CHECK(changed && rn4020.handleLookupOverflow);
+
+  // an incomplete LS cannot confirm the module matches, so it is rebuilt again
+  FakeRN4020_clearTxLog();
+  CHECK(RN4020_provision(&rn4020, &config, &changed) == HAL_ERROR);
+  CHECK(changed);
+  CHECK(FakeRN4020_countLines("PZ") == 1 && FakeRN4020_countLines("PC,") == 11 && FakeRN4020_countLines("R,1") == 1);
+}
+
+int main(void) {
+  RUN_TEST(testSetupWaitsForCMD);
+  RUN_TEST(testSettings);
+  RUN_TEST(testHandleLookupAndWrites);
+  RUN_TEST(testUnheardWritesAreCached);
+  RUN_TEST(testGattTable);
+  RUN_TEST(testWriteCache);
+  RUN_TEST(testTimeout);
+  RUN_TEST(testBaudRate);
+  RUN_TEST(testSetupFallsBackToPreviousRate);
+  RUN_TEST(testProvision);
+  RUN_TEST(testProvisionLookupOverflow);
+  return 0;
+}
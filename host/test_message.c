@@ -0,0 +1,245 @@
+#include "test.h"
+#include "rn4020_hex.h"
+#include <string.h>
+
+static RN4020 rn4020;
+static UART_HandleTypeDef uart;
+static RN4020_MessageChannel channel;
+
+#define TX_HANDLE 0x0100
+#define RX_HANDLE 0x0200
+// the first chunk carries the 3 byte START header, the rest a 1 byte header
+#define FIRST_CHUNK_PAYLOAD (RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH - 3)
+#define CHUNK_PAYLOAD       (RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH - 1)
+
+static uint8_t message[1500];
+static uint8_t rxBuffer[sizeof(message)];
+
+static uint32_t messagesSent;
+static HAL_StatusTypeDef lastSentStatus;
+static uint32_t messagesReceived;
+static uint16_t lastMessageLength;
+static uint32_t messageErrors;
+static RN4020_MessageError lastMessageError;
+static uint32_t rejectChunk; // 1-based chunk answered with ERR, 0 accepts all
+static uint32_t chunksSeen;
+
+void RN4020_onMessageSent(RN4020* rn4020, RN4020_MessageChannel* channel, HAL_StatusTypeDef status) {
+  messagesSent++;
+  lastSentStatus = status;
+}
+
+void RN4020_onMessage(RN4020* rn4020, RN4020_MessageChannel* channel, uint8_t* data, uint16_t dataLength) {
+  messagesReceived++;
+  lastMessageLength = dataLength;
+}
+
+void RN4020_onMessageError(RN4020* rn4020, RN4020_MessageChannel* channel, RN4020_MessageError error) {
+  messageErrors++;
+  lastMessageError = error;
+}
+
+static const char* acknowledgeChunks(const char* line) {
+  if (strncmp(line, "SHW,", 4) != 0) {
+    return NULL;
+  }
+  return ++chunksSeen == rejectChunk ? "ERR\r\n" : "AOK\r\n";
+}
+
+static void openChannel(void) {
+  testSetup(&rn4020, &uart);
+  FakeRN4020_respond = acknowledgeChunks;
+  RN4020_openMessageChannel(&rn4020, &channel, TX_HANDLE, RX_HANDLE, rxBuffer, sizeof(rxBuffer));
+  FakeRN4020_clearTxLog();
+  messagesSent = 0;
+  messagesReceived = 0;
+  messageErrors = 0;
+  rejectChunk = 0;
+  chunksSeen = 0;
+  for (uint32_t i = 0; i < sizeof(message); i++) {
+    message[i] = i * 7;
+  }
+}
+
+static uint32_t expectedChunks(uint16_t length) {
+  if (length <= FIRST_CHUNK_PAYLOAD) {
+    return 1;
+  }
+  return 1 + (length - FIRST_CHUNK_PAYLOAD + CHUNK_PAYLOAD - 1) / CHUNK_PAYLOAD;
+}
+
+// the nth SHW line of the TX log, without "SHW,hhhh," and the line ending
+static const char* chunkHex(uint32_t n, uint32_t* hexLength) {
+  const char* line = fakeRN4020.txLog;
+  while (*line) {
+    const char* end = strchr(line, '\n');
+    if (strncmp(line, "SHW,", 4) == 0 && n-- == 0) {
+      *hexLength = end - line - 9;
+      return line + 9;
+    }
+    line = end + 1;
+  }
+  return NULL;
+}
+
+static uint8_t chunkHeader(uint32_t n) {
+  uint32_t hexLength;
+  uint8_t header;
+  CHECK(RN4020_hexDecode(&header, chunkHex(n, &hexLength), 2) == 1);
+  return header;
+}
+
+// writes the first count SHW lines back as client writes to RX_HANDLE
+static void loopBack(uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t hexLength;
+    const char* hex = chunkHex(i, &hexLength);
+    char line[80];
+    snprintf(line, sizeof(line), "WV,%04X,%.*s.\r\n", RX_HANDLE, (int)hexLength, hex);
+    FakeRN4020_emit(line);
+    Host_run(&rn4020, 10);
+  }
+}
+
+static void emitChunk(const char* hex) {
+  char line[80];
+  snprintf(line, sizeof(line), "WV,%04X,%s.\r\n", RX_HANDLE, hex);
+  FakeRN4020_emit(line);
+  Host_run(&rn4020, 5);
+}
+
+static void testChunking(void) {
+  openChannel();
+  const uint16_t length = 100;
+  CHECK_OK(RN4020_sendMessage(&rn4020, message, length));
+  CHECK(RN4020_isMessageSending(&rn4020));
+  CHECK(RN4020_sendMessage(&rn4020, message, length) == HAL_BUSY);
+  // only the pipeline is queued up front
+  CHECK(rn4020.commandQueueLength == RN4020_MESSAGE_PIPELINE_DEPTH);
+  Host_run(&rn4020, 50);
+  CHECK(!RN4020_isMessageSending(&rn4020));
+  CHECK(messagesSent == 1 && lastSentStatus == HAL_OK);
+
+  uint32_t chunks = expectedChunks(length);
+  CHECK(FakeRN4020_countLines("SHW,0100,") == chunks);
+  uint32_t hexLength;
+  const char* hex = chunkHex(0, &hexLength);
+  // START, sequence 0, length 0x0064 little endian
+  CHECK(strncmp(hex, "806400", 6) == 0 && hexLength == RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH * 2);
+  for (uint32_t i = 1; i < chunks; i++) {
+    uint8_t header = chunkHeader(i);
+    CHECK((header & RN4020_MESSAGE_START) == 0);
+    CHECK((header & RN4020_MESSAGE_SEQUENCE) == i);
+    CHECK(((header & RN4020_MESSAGE_END) != 0) == (i == chunks - 1));
+  }
+  chunkHex(chunks - 1, &hexLength);
+  CHECK(hexLength == (2 + (length - FIRST_CHUNK_PAYLOAD) % CHUNK_PAYLOAD * 2));
+
+  loopBack(chunks);
+  CHECK(messagesReceived == 1 && messageErrors == 0);
+  CHECK(lastMessageLength == length && memcmp(rxBuffer, message, length) == 0);
+}
+
+static void testShortMessage(void) {
+  openChannel();
+  CHECK_OK(RN4020_sendMessage(&rn4020, message, 3));
+  Host_run(&rn4020, 20);
+  uint32_t hexLength;
+  CHECK(FakeRN4020_countLines("SHW,") == 1);
+  CHECK(strncmp(chunkHex(0, &hexLength), "C00300", 6) == 0);
+  loopBack(1);
+  CHECK(messagesReceived == 1 && lastMessageLength == 3 && memcmp(rxBuffer, message, 3) == 0);
+
+  // an empty message is a single START|END chunk
+  FakeRN4020_clearTxLog();
+  CHECK_OK(RN4020_sendMessage(&rn4020, message, 0));
+  Host_run(&rn4020, 20);
+  CHECK(FakeRN4020_countLines("SHW,0100,C00000") == 1);
+  CHECK(messagesSent == 2);
+}
+
+static void testSequenceWraps(void) {
+  openChannel();
+  CHECK_OK(RN4020_sendMessage(&rn4020, message, sizeof(message)));
+  Host_run(&rn4020, 500);
+  CHECK(messagesSent == 1 && lastSentStatus == HAL_OK);
+  uint32_t chunks = expectedChunks(sizeof(message));
+  CHECK(chunks > RN4020_MESSAGE_SEQUENCE + 1);
+  CHECK(FakeRN4020_countLines("SHW,") == chunks);
+  CHECK((chunkHeader(RN4020_MESSAGE_SEQUENCE) & RN4020_MESSAGE_SEQUENCE) == RN4020_MESSAGE_SEQUENCE);
+  CHECK((chunkHeader(RN4020_MESSAGE_SEQUENCE + 1) & RN4020_MESSAGE_SEQUENCE) == 0);
+  loopBack(chunks);
+  CHECK(messagesReceived == 1 && messageErrors == 0);
+  CHECK(lastMessageLength == sizeof(message) && memcmp(rxBuffer, message, sizeof(message)) == 0);
+}
+
+static void testErrorMidMessage(void) {
+  openChannel();
+  rejectChunk = 3;
+  CHECK_OK(RN4020_sendMessage(&rn4020, message, 200));
+  Host_run(&rn4020, 100);
+  CHECK(messagesSent == 1 && lastSentStatus == HAL_ERROR);
+  CHECK(!RN4020_isMessageSending(&rn4020));
+  // chunks already in the pipeline still go out, nothing after them
+  CHECK(FakeRN4020_countLines("SHW,") < rejectChunk + RN4020_MESSAGE_PIPELINE_DEPTH);
+  CHECK(FakeRN4020_countLines("SHW,") < expectedChunks(200));
+
+  // the channel is usable again
+  CHECK_OK(RN4020_sendMessage(&rn4020, message, 10));
+  Host_run(&rn4020, 20);
+  CHECK(messagesSent == 2 && lastSentStatus == HAL_OK);
+}
+
+static void expectError(RN4020_MessageError error) {
+  CHECK(messageErrors == 1 && lastMessageError == error);
+  CHECK(messagesReceived == 0);
+  messageErrors = 0;
+}
+
+static void testReceiveErrors(void) {
+  openChannel();
+
+  emitChunk("Z0");
+  expectError(RN4020_MESSAGE_ERROR_FORMAT);
+  // START without the length bytes
+  emitChunk("C003");
+  expectError(RN4020_MESSAGE_ERROR_FORMAT);
+  emitChunk("C00200AAB");
+  expectError(RN4020_MESSAGE_ERROR_FORMAT);
+
+  // 0x0800 bytes announced, rxBuffer holds 1500
+  emitChunk("800008AABB");
+  expectError(RN4020_MESSAGE_ERROR_OVERFLOW);
+
+  // continuation without a start chunk, then a skipped sequence number
+  emitChunk("01AABB");
+  expectError(RN4020_MESSAGE_ERROR_SEQUENCE);
+  emitChunk("800400AABB");
+  emitChunk("42CCDD");
+  expectError(RN4020_MESSAGE_ERROR_SEQUENCE);
+  // the dropped message does not take later chunks
+  emitChunk("41CCDD");
+  expectError(RN4020_MESSAGE_ERROR_SEQUENCE);
+
+  // more bytes than announced, then fewer
+  emitChunk("800300AABB");
+  emitChunk("41CCDD");
+  expectError(RN4020_MESSAGE_ERROR_LENGTH);
+  emitChunk("C00300AABB");
+  expectError(RN4020_MESSAGE_ERROR_LENGTH);
+
+  // a new start chunk resynchronises
+  emitChunk("800400AABB");
+  emitChunk("41CCDD");
+  CHECK(messageErrors == 0 && messagesReceived == 1 && lastMessageLength == 4);
+  CHECK(rxBuffer[0] == 0xaa && rxBuffer[3] == 0xdd);
+}
+
+int main(void) {
+  RUN_TEST(testChunking);
+  RUN_TEST(testShortMessage);
+  RUN_TEST(testSequenceWraps);
+  RUN_TEST(testErrorMidMessage);
+  RUN_TEST(testReceiveErrors);
+  return 0;
+}
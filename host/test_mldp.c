@@ -0,0 +1,111 @@
+#include "test.h"
+#include <string.h>
+
+static RN4020 rn4020;
+static UART_HandleTypeDef uart;
+
+static uint8_t mldpData[256];
+static uint32_t mldpDataLength;
+static uint32_t disconnects;
+
+void RN4020_onMLDPData(RN4020* rn4020, const uint8_t* data, uint16_t dataLength) {
+  if (mldpDataLength + dataLength <= sizeof(mldpData)) {
+    memcpy(mldpData + mldpDataLength, data, dataLength);
+  }
+  mldpDataLength += dataLength;
+}
+
+void RN4020_connectedStateChanged(RN4020* rn4020, bool connected) {
+  if (!connected) {
+    disconnects++;
+  }
+}
+
+static void enterMLDP(void) {
+  testSetup(&rn4020, &uart);
+  mldpDataLength = 0;
+  disconnects = 0;
+  CHECK_OK(RN4020_setSupportedFeatures(&rn4020, RN4020_FEATURE_ENABLE_MLDP));
+  FakeRN4020_connect();
+  Host_run(&rn4020, 5);
+  CHECK(RN4020_isConnected(&rn4020));
+  CHECK_OK(RN4020_enterMLDP(&rn4020));
+  CHECK(RN4020_isMLDP(&rn4020) && fakeRN4020.mldp);
+}
+
+static void testStreaming(void) {
+  enterMLDP();
+  CHECK(RN4020_mldpWrite(&rn4020, (const uint8_t*)"hello", 5) == 5);
+  Host_run(&rn4020, 5);
+  CHECK(fakeRN4020.mldpBytesReceived == 5);
+  FakeRN4020_emit("world");
+  Host_run(&rn4020, 5);
+  CHECK(mldpDataLength == 5 && memcmp(mldpData, "world", 5) == 0);
+  CHECK_OK(RN4020_exitMLDP(&rn4020));
+  CHECK(!RN4020_isMLDP(&rn4020) && !fakeRN4020.mldp);
+  CHECK_OK(RN4020_setDeviceName(&rn4020, "back"));
+}
+
+static void testCommandsFailFastInMLDP(void) {
+  enterMLDP();
+  uint8_t data[2] = { 1, 2 };
+  RN4020_CommandToken token;
+  uint32_t startTime = HAL_GetTick();
+  CHECK(RN4020_writeServerCharacteristicHandle(&rn4020, 0x001a, data, sizeof(data)) == HAL_BUSY);
+  CHECK(RN4020_setDeviceName(&rn4020, "mldp") == HAL_BUSY);
+  CHECK(RN4020_sendCommandAsync(&rn4020, "SN,mldp", NULL, NULL, &token) == HAL_BUSY);
+  CHECK(HAL_GetTick() - startTime < 10);
+  CHECK(RN4020_isIdle(&rn4020));
+}
+
+static void testConnectionEndLeavesMLDP(void) {
+  enterMLDP();
+  RN4020_mldpWrite(&rn4020, (const uint8_t*)"pending", 7);
+  FakeRN4020_emit("data");
+  FakeRN4020_disconnect();
+  Host_run(&rn4020, 10);
+  CHECK(!RN4020_isMLDP(&rn4020));
+  CHECK(!RN4020_isConnected(&rn4020));
+  CHECK(disconnects == 1);
+  CHECK(!fakeRN4020.cmdMldp);
+  CHECK(RN4020_mldpTxFree(&rn4020) == RN4020_MLDP_TX_BUFFER_SIZE - 1);
+  // the status is passed through with the payload
+  CHECK(mldpDataLength == 4 + strlen("Connection End\r\n") && memcmp(mldpData, "data", 4) == 0);
+  CHECK_OK(RN4020_setDeviceName(&rn4020, "again"));
+}
+
+static void testSplitConnectionEnd(void) {
+  enterMLDP();
+  FakeRN4020_emit("xxConnection E");
+  Host_run(&rn4020, 5);
+  CHECK(RN4020_isMLDP(&rn4020));
+  fakeRN4020.connected = false;
+  fakeRN4020.mldp = false;
+  FakeRN4020_emit("nd\r\n");
+  Host_run(&rn4020, 5);
+  CHECK(!RN4020_isMLDP(&rn4020) && disconnects == 1);
+}
+
+static void testWaitForCommandDeadline(void) {
+  testSetup(&rn4020, &uart);
+  RN4020_CommandToken token;
+  CHECK_OK(RN4020_sendCommandAsync(&rn4020, "SN,held", NULL, NULL, &token));
+  // hold the queue the way MLDP mode does, the command is never dispatched
+  rn4020.mldp = true;
+  uint32_t startTime = HAL_GetTick();
+  CHECK(RN4020_waitForCommand(&rn4020, token) == HAL_TIMEOUT);
+  uint32_t elapsed = HAL_GetTick() - startTime;
+  CHECK(elapsed >= RN4020_WAIT_TIMEOUT && elapsed < RN4020_WAIT_TIMEOUT + 100);
+  CHECK(RN4020_getCommandStatus(&rn4020, token) == HAL_BUSY);
+  rn4020.mldp = false;
+  CHECK_OK(RN4020_waitForCommand(&rn4020, token));
+}
+
+int main(void) {
+  RUN_TEST(testStreaming);
+  RUN_TEST(testCommandsFailFastInMLDP);
+  RUN_TEST(testConnectionEndLeavesMLDP);
+  RUN_TEST(testSplitConnectionEnd);
+  RUN_TEST(testWaitForCommandDeadline);
+  return 0;
+}
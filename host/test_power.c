@@ -0,0 +1,83 @@
+#include "test.h"
+#include <string.h>
+
+static RN4020 rn4020;
+static UART_HandleTypeDef uart;
+
+static const RN4020_PowerSchedule schedule = {
+  .idleTime = 10,
+  .wakeInterval = 100,
+  .wakeBatch = 0,
+  .sleepWhileConnected = false
+};
+
+static const RN4020_PowerSchedule noWindowSchedule = {
+  .idleTime = 10,
+  .wakeInterval = 0,
+  .wakeBatch = 0,
+  .sleepWhileConnected = false
+};
+
+// the fake rejects writes to handles it did not allocate
+static const char* acknowledgeWrites(const char* line) {
+  return strncmp(line, "SHW,", 4) == 0 ? "AOK\r\n" : NULL;
+}
+
+static void asleepWithDeferredWrite(const RN4020_PowerSchedule* powerSchedule) {
+  testSetup(&rn4020, &uart);
+  FakeRN4020_respond = acknowledgeWrites;
+  RN4020_resetStats(&rn4020);
+  RN4020_setPowerSchedule(&rn4020, powerSchedule);
+  Host_run(&rn4020, 20);
+  CHECK(RN4020_getPowerState(&rn4020) == RN4020_POWER_ASLEEP && !fakeRN4020.awake);
+  uint8_t data[2] = { 1, 2 };
+  CHECK_OK(RN4020_writeServerCharacteristicHandleDeferred(&rn4020, 0x001a, data, sizeof(data)));
+  FakeRN4020_clearTxLog();
+}
+
+static void testDisconnectedSleepKeepsWaking(void) {
+  rn4020.connectionPort = NULL;
+  asleepWithDeferredWrite(&schedule);
+  Host_run(&rn4020, 1000);
+  RN4020_Stats stats;
+  RN4020_getStats(&rn4020, &stats);
+  CHECK(stats.wakes >= 5);
+  CHECK(FakeRN4020_countLines("SHW,") == 0);
+
+  // a central connecting during a wake window is seen and gets the write
+  for (int i = 0; i < 200 && !fakeRN4020.awake; i++) {
+    Host_run(&rn4020, 1);
+  }
+  CHECK(fakeRN4020.awake);
+  FakeRN4020_connect();
+  Host_run(&rn4020, 20);
+  CHECK(RN4020_isConnected(&rn4020));
+  CHECK(FakeRN4020_countLines("SHW,001A,0102") == 1);
+}
+
+static void testConnectionPinWakes(void) {
+  asleepWithDeferredWrite(&noWindowSchedule);
+  rn4020.connectionPort = &FakeRN4020_connectionPort;
+  rn4020.connectionPin = 4;
+  // the Connected line is lost while the module sleeps
+  FakeRN4020_connect();
+  Host_run(&rn4020, 50);
+  CHECK(RN4020_isConnected(&rn4020));
+  CHECK(RN4020_getPowerState(&rn4020) == RN4020_POWER_AWAKE);
+  CHECK(FakeRN4020_countLines("SHW,001A,0102") == 1);
+
+  // once idle again the module sleeps through the connection being dropped
+  RN4020_setPowerSchedule(&rn4020, &(RN4020_PowerSchedule) { .idleTime = 10, .sleepWhileConnected = true });
+  Host_run(&rn4020, 50);
+  CHECK(RN4020_getPowerState(&rn4020) == RN4020_POWER_ASLEEP);
+  fakeRN4020.connected = false;
+  Host_run(&rn4020, 5);
+  CHECK(!RN4020_isConnected(&rn4020));
+  rn4020.connectionPort = NULL;
+}
+
+int main(void) {
+  RUN_TEST(testDisconnectedSleepKeepsWaking);
+  RUN_TEST(testConnectionPinWakes);
+  return 0;
+}
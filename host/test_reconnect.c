@@ -0,0 +1,171 @@
+#include "test.h"
+#include <string.h>
+
+static RN4020 rn4020;
+static UART_HandleTypeDef uart;
+
+static const uint8_t serviceUUID[16] = {
+  0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0x00, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+};
+static const uint8_t characteristicUUID[16] = {
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+
+#define WINDOW 3000
+
+static const RN4020_ReconnectPolicy policy = {
+  .fastInterval = 100,
+  .slowInterval = 1000,
+  .window = WINDOW,
+  .keepSubscriptions = false
+};
+
+static const RN4020_ReconnectPolicy keepPolicy = {
+  .fastInterval = 100,
+  .slowInterval = 1000,
+  .window = WINDOW,
+  .keepSubscriptions = true
+};
+
+static uint16_t valueHandle;
+
+// a notify characteristic the central subscribes to
+static void connectAndSubscribe(const RN4020_ReconnectPolicy* reconnectPolicy) {
+  testSetup(&rn4020, &uart);
+  CHECK_OK(RN4020_clearPrivate(&rn4020));
+  CHECK_OK(RN4020_addPrivateService(&rn4020, serviceUUID));
+  CHECK_OK(RN4020_addPrivateCharacteristic(
+             &rn4020,
+             characteristicUUID,
+             RN4020_PRIVATE_CHARACTERISTIC_PROPERTY_NOTIFY | RN4020_PRIVATE_CHARACTERISTIC_PROPERTY_READ,
+             20,
+             RN4020_PRIVATE_CHARACTERISTIC_SECURITY_NONE
+           ));
+  CHECK_OK(RN4020_refreshHandleLookup(&rn4020));
+  valueHandle = fakeRN4020.characteristics[0].handle;
+  RN4020_setReconnectPolicy(&rn4020, reconnectPolicy);
+  RN4020_resetStats(&rn4020);
+
+  char line[32];
+  FakeRN4020_connect();
+  snprintf(line, sizeof(line), "WV,%04X,0100.\r\n", fakeRN4020.characteristics[0].configurationHandle);
+  FakeRN4020_emit(line);
+  Host_run(&rn4020, 5);
+  CHECK(RN4020_isConnected(&rn4020));
+  CHECK(RN4020_getClientConfiguration(&rn4020, valueHandle) == RN4020_CLIENT_CONFIGURATION_NOTIFY);
+  FakeRN4020_clearTxLog();
+}
+
+static void testBackoff(void) {
+  connectAndSubscribe(&policy);
+  FakeRN4020_disconnect();
+  Host_run(&rn4020, 5);
+  CHECK(FakeRN4020_countLines("A,0064,0BB8") == 1);
+
+  // the interval doubles after every window without a connection and stops at slowInterval
+  static const char* steps[] = { "A,00C8,0BB8", "A,0190,0BB8", "A,0320,0BB8", "A,03E8,0BB8" };
+  for (uint32_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+    Host_run(&rn4020, WINDOW);
+    CHECK(FakeRN4020_countLines(steps[i]) == 1);
+    CHECK(FakeRN4020_countLines("A,") == i + 2);
+  }
+  Host_run(&rn4020, WINDOW);
+  CHECK(FakeRN4020_countLines("A,03E8,0BB8") == 2);
+
+  // nothing more once a central is back
+  FakeRN4020_connect();
+  Host_run(&rn4020, 5);
+  CHECK(RN4020_isConnected(&rn4020));
+  Host_run(&rn4020, WINDOW * 2);
+  CHECK(FakeRN4020_countLines("A,") == 6);
+
+  // the next drop starts over at fastInterval
+  FakeRN4020_clearTxLog();
+  FakeRN4020_disconnect();
+  Host_run(&rn4020, 5);
+  CHECK(FakeRN4020_countLines("A,0064,0BB8") == 1);
+  RN4020_setReconnectPolicy(&rn4020, NULL);
+  Host_run(&rn4020, WINDOW * 2);
+  CHECK(FakeRN4020_countLines("A,") == 1);
+}
+
+static void testPendingWritesSentOnConnected(void) {
+  connectAndSubscribe(&keepPolicy);
+  FakeRN4020_disconnect();
+  Host_run(&rn4020, 5);
+  uint8_t data[2] = { 0xbe, 0xef };
+  CHECK_OK(RN4020_writeServerCharacteristicHandle(&rn4020, valueHandle, data, sizeof(data)));
+  Host_run(&rn4020, 50);
+  CHECK(FakeRN4020_countLines("SHW,") == 0);
+
+  // a bonded central does not subscribe again, the kept configuration lets the write out right away
+  FakeRN4020_connect();
+  Host_run(&rn4020, 10);
+  CHECK(RN4020_getClientConfiguration(&rn4020, valueHandle) == RN4020_CLIENT_CONFIGURATION_NOTIFY);
+  char line[32];
+  snprintf(line, sizeof(line), "SHW,%04X,BEEF", valueHandle);
+  CHECK(FakeRN4020_countLines(line) == 1);
+  RN4020_setReconnectPolicy(&rn4020, NULL);
+}
+
+static void testSubscriptionsClearedWithoutKeep(void) {
+  connectAndSubscribe(&policy);
+  FakeRN4020_disconnect();
+  Host_run(&rn4020, 5);
+  CHECK(RN4020_getClientConfiguration(&rn4020, valueHandle) == RN4020_CLIENT_CONFIGURATION_NONE);
+  uint8_t data[2] = { 0xbe, 0xef };
+  CHECK_OK(RN4020_writeServerCharacteristicHandle(&rn4020, valueHandle, data, sizeof(data)));
+
+  // held until the central subscribes again
+  FakeRN4020_connect();
+  Host_run(&rn4020, 10);
+  char line[32];
+  snprintf(line, sizeof(line), "SHW,%04X,BEEF", valueHandle);
+  CHECK(FakeRN4020_countLines(line) == 0);
+  snprintf(line, sizeof(line), "WV,%04X,0100.\r\n", fakeRN4020.characteristics[0].configurationHandle);
+  FakeRN4020_emit(line);
+  Host_run(&rn4020, 10);
+  snprintf(line, sizeof(line), "SHW,%04X,BEEF", valueHandle);
+  CHECK(FakeRN4020_countLines(line) == 1);
+  RN4020_setReconnectPolicy(&rn4020, NULL);
+}
+
+static void testReconnectStats(void) {
+  connectAndSubscribe(&policy);
+  FakeRN4020_disconnect();
+  Host_run(&rn4020, 250);
+  FakeRN4020_connect();
+  Host_run(&rn4020, 5);
+  RN4020_Stats stats;
+  RN4020_getStats(&rn4020, &stats);
+  CHECK(stats.reconnects == 1);
+  CHECK(stats.reconnectTimeTotal >= 250 && stats.reconnectTimeTotal < 260);
+  CHECK(stats.reconnectTimeMax == stats.reconnectTimeTotal);
+
+  uint32_t firstTime = stats.reconnectTimeTotal;
+  FakeRN4020_disconnect();
+  Host_run(&rn4020, 100);
+  FakeRN4020_connect();
+  Host_run(&rn4020, 5);
+  RN4020_getStats(&rn4020, &stats);
+  CHECK(stats.reconnects == 2);
+  CHECK(stats.reconnectTimeTotal >= firstTime + 100 && stats.reconnectTimeTotal < firstTime + 110);
+  CHECK(stats.reconnectTimeMax == firstTime);
+
+  // without a policy a drop and connect is not counted as a reconnect
+  RN4020_setReconnectPolicy(&rn4020, NULL);
+  FakeRN4020_disconnect();
+  Host_run(&rn4020, 50);
+  FakeRN4020_connect();
+  Host_run(&rn4020, 5);
+  RN4020_getStats(&rn4020, &stats);
+  CHECK(stats.reconnects == 2);
+}
+
+int main(void) {
+  RUN_TEST(testBackoff);
+  RUN_TEST(testPendingWritesSentOnConnected);
+  RUN_TEST(testSubscriptionsClearedWithoutKeep);
+  RUN_TEST(testReconnectStats);
+  return 0;
+}
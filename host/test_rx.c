@@ -0,0 +1,135 @@
+#include "test.h"
+#include <string.h>
+
+static RN4020 rn4020;
+static UART_HandleTypeDef uart;
+
+static uint32_t writes;
+static uint8_t lastWriteLength;
+static uint32_t notifies;
+static uint32_t realTimeReads;
+static uint16_t lastRealTimeReadHandle;
+static bool holdReadResponses;
+
+void RN4020_onWrite(RN4020* rn4020, uint16_t characteristicHandle, uint8_t* data, uint8_t dataLength) {
+  writes++;
+  lastWriteLength = dataLength;
+}
+
+void RN4020_onRemoteNotify(RN4020* rn4020, uint16_t characteristicHandle, uint8_t* data, uint8_t dataLength, bool indication) {
+  notifies++;
+}
+
+void RN4020_onRealTimeRead(RN4020* rn4020, uint16_t characteristicHandle) {
+  realTimeReads++;
+  lastRealTimeReadHandle = characteristicHandle;
+}
+
+// the fake rejects writes to handles it did not allocate, held answers are emitted by the test
+static const char* acknowledgeReadResponses(const char* line) {
+  if (strncmp(line, "SHW,", 4) != 0) {
+    return NULL;
+  }
+  return holdReadResponses ? "" : "AOK\r\n";
+}
+
+// prefix followed by hexLength hex digits, a period and the line ending
+static void emitValueLine(const char* prefix, uint32_t hexLength) {
+  static char line[RN4020_RX_BUFFER_SIZE];
+  uint32_t length = strlen(prefix);
+  memcpy(line, prefix, length);
+  for (uint32_t i = 0; i < hexLength; i++) {
+    line[length++] = "0123456789ABCDEF"[i % 16];
+  }
+  strcpy(line + length, ".\r\n");
+  FakeRN4020_emit(line);
+}
+
+static void testOversizedValuesAreRejected(void) {
+  static const char* prefixes[] = { "WV,001A,", "Notify,001A,", "Indicate,001A," };
+  for (int i = 0; i < 3; i++) {
+    // a fresh ring each time so the line is parsed in place instead of going through the scratch copy
+    testSetup(&rn4020, &uart);
+    RN4020_resetStats(&rn4020);
+    writes = 0;
+    notifies = 0;
+
+    // twice what the decode buffer on the stack holds
+    emitValueLine(prefixes[i], RN4020_MAX_RX_LINE_LENGTH * 2);
+    Host_run(&rn4020, 50);
+    CHECK(writes == 0 && notifies == 0);
+    RN4020_Stats stats;
+    RN4020_getStats(&rn4020, &stats);
+    CHECK(stats.unexpectedLines == 1);
+    CHECK(stats.rxOverruns == 0);
+  }
+}
+
+static void testLargestValueIsDelivered(void) {
+  testSetup(&rn4020, &uart);
+  writes = 0;
+  emitValueLine("WV,001A,", RN4020_MAX_RX_LINE_LENGTH);
+  Host_run(&rn4020, 20);
+  CHECK(writes == 1 && lastWriteLength == RN4020_MAX_RX_LINE_LENGTH / 2);
+  emitValueLine("WV,001A,", RN4020_MAX_RX_LINE_LENGTH + 2);
+  Host_run(&rn4020, 20);
+  CHECK(writes == 1);
+}
+
+static void readCacheSetup(void) {
+  testSetup(&rn4020, &uart);
+  FakeRN4020_respond = acknowledgeReadResponses;
+  holdReadResponses = false;
+  realTimeReads = 0;
+  RN4020_resetStats(&rn4020);
+  uint8_t data[2] = { 0x12, 0x34 };
+  CHECK_OK(RN4020_setReadValue(&rn4020, 0x001A, data, sizeof(data)));
+  FakeRN4020_clearTxLog();
+}
+
+static void testCachedReadIsAnswered(void) {
+  readCacheSetup();
+  FakeRN4020_emit("RV,001A.\r\n");
+  Host_run(&rn4020, 10);
+  CHECK(realTimeReads == 0);
+  CHECK(FakeRN4020_countLines("SHW,001A,1234") == 1);
+  RN4020_Stats stats;
+  RN4020_getStats(&rn4020, &stats);
+  CHECK(stats.realTimeReadsAnswered == 1);
+
+  // handles without a cached value still go to the application
+  FakeRN4020_emit("RV,001B.\r\n");
+  Host_run(&rn4020, 10);
+  CHECK(realTimeReads == 1 && lastRealTimeReadHandle == 0x001B);
+  CHECK(FakeRN4020_countLines("SHW,") == 1);
+}
+
+static void testReadValueUpdatedInFlight(void) {
+  readCacheSetup();
+  holdReadResponses = true;
+  FakeRN4020_emit("RV,001A.\r\n");
+  Host_run(&rn4020, 10);
+  CHECK(rn4020.readResponseInFlight >= 0);
+
+  // returns without waiting for the line in flight, which goes out unchanged
+  uint8_t data[2] = { 0x56, 0x78 };
+  CHECK_OK(RN4020_setReadValue(&rn4020, 0x001A, data, sizeof(data)));
+  CHECK(FakeRN4020_countLines("SHW,001A,1234") == 1);
+  FakeRN4020_emit("AOK\r\n");
+  Host_run(&rn4020, 5);
+  CHECK(rn4020.readResponseInFlight < 0);
+
+  holdReadResponses = false;
+  FakeRN4020_emit("RV,001A.\r\n");
+  Host_run(&rn4020, 10);
+  CHECK(FakeRN4020_countLines("SHW,001A,5678") == 1);
+  CHECK(realTimeReads == 0);
+}
+
+int main(void) {
+  RUN_TEST(testOversizedValuesAreRejected);
+  RUN_TEST(testLargestValueIsDelivered);
+  RUN_TEST(testCachedReadIsAnswered);
+  RUN_TEST(testReadValueUpdatedInFlight);
+  return 0;
+}
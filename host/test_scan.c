@@ -0,0 +1,152 @@
+#include "test.h"
+#include <string.h>
+
+static RN4020 rn4020;
+static UART_HandleTypeDef uart;
+
+static uint32_t reports;
+static RN4020_ScanEntry lastEntry;
+static char lastPayload[64];
+
+void RN4020_onScanReport(RN4020* rn4020, const RN4020_ScanEntry* entry, const char* payload, uint16_t payloadLength) {
+  reports++;
+  lastEntry = *entry;
+  snprintf(lastPayload, sizeof(lastPayload), "%.*s", payloadLength, payload);
+}
+
+static void scan(void) {
+  testSetup(&rn4020, &uart);
+  RN4020_resetStats(&rn4020);
+  CHECK_OK(RN4020_startScan(&rn4020, 0, 0));
+  CHECK(RN4020_isScanning(&rn4020));
+  reports = 0;
+}
+
+static void macFor(uint8_t* mac, uint32_t n) {
+  const uint8_t base[RN4020_MAC_LENGTH_BYTES] = { 0x00, 0x1e, 0xc0, 0x00, 0x00, 0x00 };
+  memcpy(mac, base, sizeof(base));
+  mac[4] = n >> 8;
+  mac[5] = n;
+}
+
+static void emitReport(uint32_t n, char addressType, const char* payload, const char* rssi) {
+  uint8_t mac[RN4020_MAC_LENGTH_BYTES];
+  macFor(mac, n);
+  char line[80];
+  snprintf(line, sizeof(line), "%02X%02X%02X%02X%02X%02X,%c,%s,%s\r\n",
+           mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], addressType, payload, rssi);
+  FakeRN4020_emit(line);
+  Host_run(&rn4020, 5);
+}
+
+static const RN4020_ScanEntry* find(uint32_t n) {
+  uint8_t mac[RN4020_MAC_LENGTH_BYTES];
+  macFor(mac, n);
+  return RN4020_findScanEntry(&rn4020, mac);
+}
+
+static void testDuplicatesSuppressed(void) {
+  scan();
+  emitReport(1, '0', "Sensor", "-40");
+  CHECK(reports == 1);
+  CHECK(lastEntry.addressType == 0 && lastEntry.rssi == -0x40 && strcmp(lastPayload, "Sensor") == 0);
+  emitReport(1, '0', "Sensor", "-40");
+  emitReport(1, '0', "Sensor", "-41");
+  CHECK(reports == 1);
+  const RN4020_ScanEntry* entry = find(1);
+  CHECK(entry != NULL && entry->reports == 3 && entry->rssi == -0x41);
+
+  RN4020_Stats stats;
+  RN4020_getStats(&rn4020, &stats);
+  CHECK(stats.scanReports == 3 && stats.scanReportsSuppressed == 2);
+}
+
+static void testRssiThreshold(void) {
+  scan();
+  emitReport(1, '1', "Sensor", "-40");
+  // drift below the threshold is measured from the last reported value, not the last seen one
+  emitReport(1, '1', "Sensor", "-43");
+  emitReport(1, '1', "Sensor", "-45");
+  CHECK(reports == 1);
+  emitReport(1, '1', "Sensor", "-46");
+  CHECK(reports == 2 && lastEntry.rssi == -0x46 && lastEntry.addressType == 1);
+  emitReport(1, '1', "Sensor", "-40");
+  CHECK(reports == 3);
+}
+
+static void testPayloadChange(void) {
+  scan();
+  emitReport(1, '0', "Sensor", "-40");
+  emitReport(1, '0', "Sensor2", "-40");
+  CHECK(reports == 2 && strcmp(lastPayload, "Sensor2") == 0);
+  emitReport(1, '0', "Sensor2", "-40");
+  CHECK(reports == 2);
+}
+
+static void testExpiry(void) {
+  scan();
+  emitReport(1, '0', "Sensor", "-40");
+  uint32_t firstSeen = find(1)->firstSeen;
+  Host_run(&rn4020, RN4020_SCAN_EXPIRE_TIME / 2);
+  emitReport(1, '0', "Sensor", "-40");
+  CHECK(reports == 1);
+  Host_run(&rn4020, RN4020_SCAN_EXPIRE_TIME + 1);
+  emitReport(1, '0', "Sensor", "-40");
+  CHECK(reports == 2);
+  CHECK(lastEntry.reports == 1 && lastEntry.firstSeen != firstSeen);
+}
+
+static void testLeastRecentlySeenEvicted(void) {
+  scan();
+  const uint32_t advertisers = RN4020_SCAN_CACHE_SIZE * 2;
+  for (uint32_t n = 1; n <= advertisers; n++) {
+    emitReport(n, '0', "Tag", "-50");
+    // advertiser 0 is seen between every newcomer and must never be the one replaced
+    emitReport(0, '0', "Tag", "-50");
+    CHECK(find(n) != NULL && find(0) != NULL);
+  }
+  uint32_t cached = 0;
+  for (uint32_t n = 0; n <= advertisers; n++) {
+    cached += find(n) != NULL;
+  }
+  CHECK(cached <= RN4020_SCAN_CACHE_SIZE);
+  CHECK(find(0)->reports == advertisers);
+  CHECK(reports == advertisers + 1);
+
+  RN4020_clearScanCache(&rn4020);
+  CHECK(find(0) == NULL);
+}
+
+static void testMalformedReports(void) {
+  scan();
+  // the full negative range fits, -80 included
+  emitReport(1, '0', "Sensor", "-80");
+  CHECK(reports == 1 && lastEntry.rssi == -128);
+  emitReport(2, '0', "Sensor", "7F");
+  CHECK(reports == 2 && lastEntry.rssi == 127);
+
+  // magnitudes that do not fit an int8_t are not wrapped into the wrong sign
+  emitReport(3, '0', "Sensor", "-9C");
+  emitReport(4, '0', "Sensor", "80");
+  // only public and random address types exist
+  emitReport(5, '2', "Sensor", "-40");
+  emitReport(6, 'A', "Sensor", "-40");
+  emitReport(7, '0', "Sensor", "-4G");
+  CHECK(reports == 2);
+  for (uint32_t n = 3; n <= 7; n++) {
+    CHECK(find(n) == NULL);
+  }
+  RN4020_Stats stats;
+  RN4020_getStats(&rn4020, &stats);
+  CHECK(stats.scanReports == 2);
+}
+
+int main(void) {
+  RUN_TEST(testDuplicatesSuppressed);
+  RUN_TEST(testRssiThreshold);
+  RUN_TEST(testPayloadChange);
+  RUN_TEST(testExpiry);
+  RUN_TEST(testLeastRecentlySeenEvicted);
+  RUN_TEST(testMalformedReports);
+  return 0;
+}
@@ -0,0 +1,104 @@
+#include "test.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+
+/**
+ * Several producer threads push writes through the submission ring while the main thread runs RN4020_tick. Every
+ * line must reach the module whole and each producer's writes must arrive in the order they were submitted. Build
+ * with RN4020_HOST_TSAN to run it under ThreadSanitizer.
+ */
+
+#define PRODUCERS 4
+#define WRITES_PER_PRODUCER 2000
+#define SUBMISSIONS_PER_PRODUCER 4
+
+static RN4020 rn4020;
+static UART_HandleTypeDef uart;
+static RN4020_Submission submissions[PRODUCERS][SUBMISSIONS_PER_PRODUCER];
+static atomic_int producersDone;
+static atomic_int producerFailures;
+
+static uint32_t lines;
+static uint32_t badLines;
+static int32_t lastSequence[PRODUCERS];
+
+// "SHW,001P,PPSSSS" with P the producer and S its sequence number
+static const char* respond(const char* line) {
+  if (strncmp(line, "SHW,", 4) != 0) {
+    return NULL;
+  }
+  lines++;
+  unsigned int handle, producer, sequence;
+  if (strlen(line) != 15 || sscanf(line, "SHW,%4X,%2X%4X", &handle, &producer, &sequence) != 3
+      || producer >= PRODUCERS || handle != 0x0010 + producer || (int32_t)sequence != lastSequence[producer] + 1) {
+    badLines++;
+    fprintf(stderr, "bad line %s\n", line);
+  } else {
+    lastSequence[producer] = sequence;
+  }
+  return "AOK\r\n";
+}
+
+static void waitForSubmission(RN4020_Submission* submission) {
+  while (RN4020_getSubmissionStatus(submission) == HAL_BUSY) {
+    sched_yield();
+  }
+  if (RN4020_getSubmissionStatus(submission) != HAL_OK) {
+    atomic_fetch_add(&producerFailures, 1);
+  }
+}
+
+static void* producer(void* arg) {
+  int id = (int)(intptr_t)arg;
+  for (int i = 0; i < WRITES_PER_PRODUCER; i++) {
+    RN4020_Submission* submission = &submissions[id][i % SUBMISSIONS_PER_PRODUCER];
+    if (i >= SUBMISSIONS_PER_PRODUCER) {
+      waitForSubmission(submission);
+    }
+    uint8_t data[3] = { id, i >> 8, i };
+    while (RN4020_submitWrite(&rn4020, submission, 0x0010 + id, data, sizeof(data), NULL, NULL) == HAL_BUSY) {
+      sched_yield();
+    }
+  }
+  for (int i = 0; i < SUBMISSIONS_PER_PRODUCER; i++) {
+    waitForSubmission(&submissions[id][i]);
+  }
+  atomic_fetch_add(&producersDone, 1);
+  return NULL;
+}
+
+static void testConcurrentProducers(void) {
+  testSetup(&rn4020, &uart);
+  // writes nobody hears would go to the write cache instead
+  FakeRN4020_connect();
+  Host_run(&rn4020, 5);
+  FakeRN4020_respond = respond;
+  for (int i = 0; i < PRODUCERS; i++) {
+    lastSequence[i] = -1;
+  }
+
+  pthread_t threads[PRODUCERS];
+  for (int i = 0; i < PRODUCERS; i++) {
+    CHECK(pthread_create(&threads[i], NULL, producer, (void*)(intptr_t)i) == 0);
+  }
+  while (atomic_load(&producersDone) < PRODUCERS) {
+    Host_run(&rn4020, 1);
+    FakeRN4020_clearTxLog();
+  }
+  for (int i = 0; i < PRODUCERS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  printf("  %lu lines, %lu bad\n", (unsigned long)lines, (unsigned long)badLines);
+  CHECK(lines == PRODUCERS * WRITES_PER_PRODUCER);
+  CHECK(badLines == 0);
+  CHECK(atomic_load(&producerFailures) == 0);
+  CHECK(RN4020_isIdle(&rn4020));
+}
+
+int main(void) {
+  RUN_TEST(testConcurrentProducers);
+  return 0;
+}
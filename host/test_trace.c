@@ -0,0 +1,120 @@
+#include "test.h"
+#include <string.h>
+
+static RN4020 rn4020;
+static UART_HandleTypeDef uart;
+static uint8_t trace[RN4020_TRACE_BUFFER_SIZE];
+static uint32_t traceLength;
+
+static uint32_t writes;
+static uint16_t lastWriteHandle;
+static uint8_t lastWriteData[20];
+static uint32_t connectedChanges;
+
+void RN4020_onWrite(RN4020* rn4020, uint16_t characteristicHandle, uint8_t* data, uint8_t dataLength) {
+  writes++;
+  lastWriteHandle = characteristicHandle;
+  memcpy(lastWriteData, data, dataLength);
+}
+
+void RN4020_connectedStateChanged(RN4020* rn4020, bool connected) {
+  connectedChanges++;
+}
+
+static void capture(void) {
+  testSetup(&rn4020, &uart);
+  RN4020_traceClear(&rn4020);
+  CHECK_OK(RN4020_setSupportedFeatures(&rn4020, 0));
+  Host_advanceNs(100 * 1000000ULL);
+  FakeRN4020_connect();
+  FakeRN4020_emit("WV,001A,CAFE.\r\n");
+  Host_run(&rn4020, 20);
+  FakeRN4020_disconnect();
+  Host_run(&rn4020, 20);
+  traceLength = RN4020_traceDump(&rn4020, trace, sizeof(trace));
+}
+
+static void testCaptureAndReplay(void) {
+  capture();
+  CHECK(traceLength > 0);
+  CHECK(trace[0] == RN4020_TRACE_TX);
+  CHECK(memcmp(trace + RN4020_TRACE_HEADER_LENGTH, "SR,00000000\n", trace[1]) == 0);
+  CHECK(writes == 1 && connectedChanges == 2);
+
+  writes = 0;
+  connectedChanges = 0;
+  testSetup(&rn4020, &uart);
+  RN4020_traceClear(&rn4020);
+  uint32_t replayed = RN4020_traceReplay(&rn4020, trace, traceLength, 0);
+  // AOK, Connected, WV and Connection End, the TX record is skipped
+  CHECK(replayed == 4);
+  CHECK(writes == 1 && lastWriteHandle == 0x001a && lastWriteData[0] == 0xca && lastWriteData[1] == 0xfe);
+  CHECK(connectedChanges == 2);
+
+  // RX fed by the replay is not traced again
+  uint8_t replayTrace[RN4020_TRACE_BUFFER_SIZE];
+  uint32_t replayTraceLength = RN4020_traceDump(&rn4020, replayTrace, sizeof(replayTrace));
+  for (uint32_t offset = 0; offset < replayTraceLength; offset += RN4020_TRACE_HEADER_LENGTH + replayTrace[offset + 1]) {
+    CHECK(replayTrace[offset] != RN4020_TRACE_RX);
+  }
+}
+
+static void testReplayPace(void) {
+  capture();
+  testSetup(&rn4020, &uart);
+  uint32_t startTime = HAL_GetTick();
+  RN4020_traceReplay(&rn4020, trace, traceLength, 1);
+  // the Connected line was recorded 100ms after the first record
+  CHECK(HAL_GetTick() - startTime >= 100);
+
+  testSetup(&rn4020, &uart);
+  startTime = HAL_GetTick();
+  RN4020_traceReplay(&rn4020, trace, traceLength, 10);
+  uint32_t elapsed = HAL_GetTick() - startTime;
+  CHECK(elapsed >= 10 && elapsed < 100);
+}
+
+static void enterMLDP(void) {
+  testSetup(&rn4020, &uart);
+  CHECK_OK(RN4020_setSupportedFeatures(&rn4020, RN4020_FEATURE_ENABLE_MLDP));
+  FakeRN4020_connect();
+  Host_run(&rn4020, 5);
+  CHECK_OK(RN4020_enterMLDP(&rn4020));
+  CHECK(RN4020_isMLDP(&rn4020));
+  RN4020_traceClear(&rn4020);
+}
+
+static void testReplayMLDPConnectionEnd(void) {
+  enterMLDP();
+  FakeRN4020_emit("payload");
+  Host_run(&rn4020, 5);
+  // the module reports the dropped link in the data stream
+  FakeRN4020_disconnect();
+  Host_run(&rn4020, 5);
+  CHECK(!RN4020_isMLDP(&rn4020) && !RN4020_isConnected(&rn4020));
+  uint8_t mldpTrace[RN4020_TRACE_BUFFER_SIZE];
+  uint32_t mldpTraceLength = RN4020_traceDump(&rn4020, mldpTrace, sizeof(mldpTrace));
+  CHECK(mldpTraceLength > 0 && mldpTrace[0] == RN4020_TRACE_MLDP_RX);
+
+  enterMLDP();
+  connectedChanges = 0;
+  RN4020_traceReplay(&rn4020, mldpTrace, mldpTraceLength, 0);
+  CHECK(!RN4020_isMLDP(&rn4020) && !RN4020_isConnected(&rn4020));
+  CHECK(connectedChanges == 1);
+}
+
+int main(int argc, char** argv) {
+  RUN_TEST(testCaptureAndReplay);
+  RUN_TEST(testReplayPace);
+  RUN_TEST(testReplayMLDPConnectionEnd);
+
+  // leave a trace behind for the rn4020_replay smoke test
+  if (argc > 1) {
+    capture();
+    FILE* file = fopen(argv[1], "wb");
+    CHECK(file != NULL);
+    CHECK(fwrite(trace, 1, traceLength, file) == traceLength);
+    fclose(file);
+  }
+  return 0;
+}
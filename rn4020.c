@@ -1,10 +1,10 @@
 
 #include "rn4020.h"
+#include "rn4020_hex.h"
 #include <utils/utils.h>
 #include <utils/time.h>
 #include <utils/ringbufferdma.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
 
 #ifdef RN4020_DEBUG
@@ -13,21 +13,200 @@
 #define RN4020_DEBUG_OUT(format, ...)
 #endif
 
-#define RN4020_MAX_RX_LINE_LENGTH 100
+#ifdef RN4020_TRACE
+#define _RN4020_TRACE(rn4020, type, data, length) _RN4020_traceRecord(rn4020, type, (const uint8_t*)(data), length)
+#else
+#define _RN4020_TRACE(rn4020, type, data, length)
+#endif
+
+#define _RN4020_LINE_EQUALS(line, lineLength, str) \
+  ((lineLength) == sizeof(str) - 1 && memcmp((line), (str), sizeof(str) - 1) == 0)
+#define _RN4020_LINE_STARTS_WITH(line, lineLength, str) \
+  ((lineLength) >= sizeof(str) - 1 && memcmp((line), (str), sizeof(str) - 1) == 0)
+
+// the module reports a dropped link in the MLDP stream too
+#define _RN4020_MLDP_CONNECTION_END "Connection End\r\n"
+
+typedef enum {
+  RN4020_LINE_UNKNOWN,
+  RN4020_LINE_CMD,
+  RN4020_LINE_AOK,
+  RN4020_LINE_REBOOT,
+  RN4020_LINE_END,
+  RN4020_LINE_CONNECTED,
+  RN4020_LINE_CONNECTION_END,
+  RN4020_LINE_REAL_TIME_READ,
+  RN4020_LINE_WRITE,
+  RN4020_LINE_LS_CHARACTERISTIC,
+  RN4020_LINE_MLDP,
+  RN4020_LINE_ERR,
+  RN4020_LINE_SCAN_REPORT,
+  RN4020_LINE_REMOTE_READ,
+  RN4020_LINE_NOTIFY,
+  RN4020_LINE_INDICATE,
+  RN4020_LINE_CONNECTION_PARAMETERS
+} RN4020_LineType;
+
+#if (RN4020_UUID_INDEX_SIZE & (RN4020_UUID_INDEX_SIZE - 1)) != 0 || RN4020_UUID_INDEX_SIZE <= RN4020_LOOKUP_TABLE_SIZE || RN4020_LOOKUP_TABLE_SIZE > 255
+#error "RN4020_UUID_INDEX_SIZE must be a power of two larger than RN4020_LOOKUP_TABLE_SIZE (at most 255)"
+#endif
+
+#if RN4020_READ_CACHE_SIZE > 32
+#error "RN4020_READ_CACHE_SIZE must be at most 32"
+#endif
+
+#if (RN4020_SCAN_CACHE_SIZE & (RN4020_SCAN_CACHE_SIZE - 1)) != 0
+#error "RN4020_SCAN_CACHE_SIZE must be a power of two"
+#endif
+
+#if (RN4020_SUBMIT_QUEUE_SIZE & (RN4020_SUBMIT_QUEUE_SIZE - 1)) != 0
+#error "RN4020_SUBMIT_QUEUE_SIZE must be a power of two"
+#endif
+
+#if RN4020_MESSAGE_PIPELINE_DEPTH >= RN4020_COMMAND_QUEUE_SIZE
+#error "RN4020_MESSAGE_PIPELINE_DEPTH must be less than RN4020_COMMAND_QUEUE_SIZE"
+#endif
+
+// slots probed for a MAC before the least recently seen one in the run is replaced
+#define _RN4020_SCAN_CACHE_PROBE (RN4020_SCAN_CACHE_SIZE < 8 ? RN4020_SCAN_CACHE_SIZE : 8)
 
-void _RN4020_processLine(RN4020* rn4020, const char* line);
+void _RN4020_processRx(RN4020* rn4020);
+void _RN4020_processMLDPRx(RN4020* rn4020);
+bool _RN4020_scanMLDPStatus(RN4020* rn4020, const uint8_t* data, uint16_t length);
+void _RN4020_leaveMLDP(RN4020* rn4020);
+void _RN4020_processMLDPTx(RN4020* rn4020);
+void _RN4020_processMessageTx(RN4020* rn4020);
+void _RN4020_messageChunkDone(RN4020* rn4020, RN4020_CommandToken token, HAL_StatusTypeDef status, void* userData);
+void _RN4020_processMessageChunk(RN4020* rn4020, RN4020_MessageChannel* channel, const char* hex, uint16_t hexLength);
+void _RN4020_dropMessage(RN4020* rn4020, RN4020_MessageChannel* channel, RN4020_MessageError error);
+void _RN4020_processLine(RN4020* rn4020, const char* line, uint16_t lineLength);
+RN4020_LineType _RN4020_classifyLine(const char* line, uint16_t lineLength);
+void _RN4020_processWriteLine(RN4020* rn4020, const char* line, uint16_t lineLength);
+void _RN4020_processNotifyLine(RN4020* rn4020, const char* line, uint16_t lineLength, uint8_t prefixLength, bool indication);
+bool _RN4020_parseHandleValueLine(
+  const char* line,
+  uint16_t lineLength,
+  uint8_t prefixLength,
+  uint16_t* handle,
+  uint8_t* data,
+  uint32_t dataCapacity,
+  int32_t* dataLength
+);
+void _RN4020_processRemoteReadLine(RN4020* rn4020, const char* line, uint16_t lineLength);
+void _RN4020_processLCLine(RN4020* rn4020, RN4020_LineType lineType, const char* line, uint16_t lineLength);
+bool _RN4020_processScanReport(RN4020* rn4020, const char* line, uint16_t lineLength);
+RN4020_ScanEntry* _RN4020_scanCacheSlot(RN4020* rn4020, const uint8_t* mac, uint32_t now);
 void _RN4020_setState(RN4020* rn4020, RN4020_State newState);
 void _RN4020_setConnected(RN4020* rn4020, bool connected);
-HAL_StatusTypeDef _RN4020_waitForReadyState(RN4020* rn4020);
+HAL_StatusTypeDef _RN4020_runCommand(RN4020* rn4020, const char* cmd, RN4020_State waitState, uint32_t timeout);
 HAL_StatusTypeDef _RN4020_runAOKCommand(RN4020* rn4020, const char* cmd);
-void _RN4020_parseUUIDString(const char* str, uint8_t strLen, uint8_t* uuid, uint8_t* uuidLen);
-bool _RN4020_parseHandleUUIDLine(const char* line, RN4020_handleLookupItem* handleLookupItem);
+HAL_StatusTypeDef _RN4020_waitForQueueSpace(RN4020* rn4020);
+RN4020_Command* _RN4020_allocCommand(RN4020* rn4020, RN4020_State waitState);
+void _RN4020_commitCommand(RN4020* rn4020, RN4020_Command* command, RN4020_CommandCallback callback, void* userData, RN4020_CommandToken* token);
+void _RN4020_processCommandQueue(RN4020* rn4020);
+void _RN4020_completeCommand(RN4020* rn4020, HAL_StatusTypeDef status);
+RN4020_CommandType _RN4020_commandType(const RN4020_Command* command);
+void _RN4020_recordLatency(RN4020* rn4020, uint32_t latency);
+void _RN4020_processWriteCache(RN4020* rn4020);
+void _RN4020_writeCacheCallback(RN4020* rn4020, RN4020_CommandToken token, HAL_StatusTypeDef status, void* userData);
+void _RN4020_writeCacheDone(RN4020* rn4020, RN4020_WriteCacheItem* item, HAL_StatusTypeDef status);
+bool _RN4020_isListenedTo(RN4020* rn4020, uint16_t handle);
+void _RN4020_processClientConfigurationWrite(RN4020* rn4020, uint16_t handle, const uint8_t* data, int32_t dataLength);
+void _RN4020_processConnectionTuner(RN4020* rn4020);
+void _RN4020_processPowerSchedule(RN4020* rn4020);
+void _RN4020_processReconnect(RN4020* rn4020);
+bool _RN4020_isPowerIdle(RN4020* rn4020);
+bool _RN4020_isWakeWindowDue(RN4020* rn4020, uint32_t now);
+void _RN4020_wake(RN4020* rn4020);
+void _RN4020_powerAwake(RN4020* rn4020);
+void _RN4020_processConnectionParametersLine(RN4020* rn4020, const char* line, uint16_t lineLength);
+char* _RN4020_encodeConnectionParameters(char* dest, const char* prefix, const RN4020_ConnectionParameters* parameters);
+int8_t _RN4020_findReadCacheItem(RN4020* rn4020, uint16_t handle);
+void _RN4020_dispatchReadResponse(RN4020* rn4020);
+void _RN4020_finishReadResponse(RN4020* rn4020);
+void _RN4020_encodeReadValue(RN4020_ReadCacheItem* item, const uint8_t* data, uint32_t dataLength);
+bool _RN4020_isTxBusy(RN4020* rn4020);
+#ifdef RN4020_TRACE
+void _RN4020_traceRecord(RN4020* rn4020, RN4020_TraceRecordType type, const uint8_t* data, uint32_t length);
+void _RN4020_traceWrite(RN4020* rn4020, const uint8_t* data, uint32_t length);
+uint32_t _RN4020_traceRecordLength(RN4020* rn4020, uint32_t index);
+#endif
+#ifdef RN4020_SUBMIT_QUEUE
+HAL_StatusTypeDef _RN4020_submit(RN4020* rn4020, RN4020_Submission* submission);
+void _RN4020_processSubmissions(RN4020* rn4020);
+void _RN4020_submissionDone(RN4020* rn4020, RN4020_CommandToken token, HAL_StatusTypeDef status, void* userData);
+#endif
+int8_t _RN4020_baudRateIndex(uint32_t baudRate);
+HAL_StatusTypeDef _RN4020_configureUart(RN4020* rn4020, uint32_t baudRate, bool flowControl);
+HAL_StatusTypeDef _RN4020_setModuleBaudRate(RN4020* rn4020, uint32_t baudRate, bool flowControl);
+HAL_StatusTypeDef _RN4020_verifyLink(RN4020* rn4020);
+HAL_StatusTypeDef _RN4020_transmit(RN4020* rn4020, const uint8_t* data, uint16_t length);
+void _RN4020_buildHandleIndex(RN4020* rn4020);
+uint32_t _RN4020_hashUUID(const uint8_t* uuid, uint8_t uuidLength);
+void _RN4020_bindGattHandles(RN4020* rn4020);
+uint32_t _RN4020_fnv1a(uint32_t hash, const uint8_t* data, uint32_t dataLength);
+uint32_t _RN4020_privateFingerprintService(uint32_t fingerprint, const uint8_t* uuid);
+uint32_t _RN4020_privateFingerprintCharacteristic(uint32_t fingerprint, const uint8_t* uuid, uint8_t properties);
+HAL_StatusTypeDef _RN4020_getValue(RN4020* rn4020, const char* cmd);
+bool _RN4020_parseUUIDString(const char* str, uint8_t strLen, uint8_t* uuid, uint8_t* uuidLen);
+bool _RN4020_parseHandleUUIDLine(const char* line, uint16_t lineLength, RN4020_handleLookupItem* handleLookupItem);
 HAL_StatusTypeDef _RN4020_writeServerCharacteristic(RN4020* rn4020, const uint8_t* uuid, uint8_t uuidLen, const uint8_t* data, uint32_t dataLength);
+HAL_StatusTypeDef _RN4020_writeServerCharacteristicAsync(
+  RN4020* rn4020,
+  const uint8_t* uuid,
+  uint8_t uuidLen,
+  const uint8_t* data,
+  uint32_t dataLength,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+);
 
 HAL_StatusTypeDef RN4020_setup(RN4020* rn4020) {
   RingBufferDmaU8_initUSARTRx(&rn4020->rxRing, rn4020->uart, rn4020->rxBuffer, RN4020_RX_BUFFER_SIZE);
   rn4020->connected = false;
   rn4020->handleLookupLength = 0;
+  rn4020->handleLookupOverflow = false;
+  memset(rn4020->uuidIndex, 0, sizeof(rn4020->uuidIndex));
+  rn4020->gattTable = NULL;
+  rn4020->commandQueueHead = 0;
+  rn4020->commandQueueLength = 0;
+  rn4020->commandInFlight = false;
+  rn4020->nextCommandToken = 1;
+  rn4020->lastCompletedCommandToken = 0;
+  rn4020->writeCacheLength = 0;
+  rn4020->writeCacheFlushInterval = 0;
+  rn4020->writeCacheLastFlush = 0;
+  rn4020->writeCacheFlushNow = false;
+  rn4020->messageChannel = NULL;
+#ifdef RN4020_SUBMIT_QUEUE
+  for (uint32_t i = 0; i < RN4020_SUBMIT_QUEUE_SIZE; i++) {
+    atomic_init(&rn4020->submitQueue[i].sequence, i);
+  }
+  atomic_init(&rn4020->submitTail, 0);
+  rn4020->submitHead = 0;
+#endif
+  rn4020->connectionParametersValid = false;
+  rn4020->tuner = NULL;
+  rn4020->tunerWrites = 0;
+  rn4020->powerSchedule = NULL;
+  rn4020->powerState = RN4020_POWER_AWAKE;
+  rn4020->wakeLatencyAverage = 0;
+  rn4020->reconnectPolicy = NULL;
+  rn4020->reconnecting = false;
+  rn4020->readCacheLength = 0;
+  rn4020->readResponsesPending = 0;
+  rn4020->readResponseInFlight = -1;
+  rn4020->rxScanned = 0;
+  RN4020_traceClear(rn4020);
+  RN4020_resetStats(rn4020);
+  rn4020->mldp = false;
+  rn4020->mldpTxHead = 0;
+  rn4020->mldpTxTail = 0;
+  rn4020->mldpTxInFlight = 0;
+  rn4020->mldpStatusMatched = 0;
+  rn4020->scanning = false;
+  RN4020_clearScanCache(rn4020);
   _RN4020_setState(rn4020, RN4020_STATE_INITIALIZING);
 
   HAL_GPIO_WritePin(rn4020->wakeswPort, rn4020->wakeswPin, GPIO_PIN_RESET);
@@ -35,61 +214,410 @@ HAL_StatusTypeDef RN4020_setup(RN4020* rn4020) {
   HAL_GPIO_WritePin(rn4020->wakehwPort, rn4020->wakehwPin, GPIO_PIN_RESET);
   sleep_ms(500);
 
-  _RN4020_setState(rn4020, RN4020_STATE_WAITING_FOR_CMD);
+  // an empty command is never transmitted, it only waits for the CMD prompt the module prints on wake
+  _RN4020_setState(rn4020, RN4020_STATE_READY);
+  RN4020_CommandToken token;
+  RN4020_Command* command = _RN4020_allocCommand(rn4020, RN4020_STATE_WAITING_FOR_CMD);
+  _RN4020_commitCommand(rn4020, command, NULL, NULL, &token);
   HAL_GPIO_WritePin(rn4020->wakehwPort, rn4020->wakehwPin, GPIO_PIN_SET);
   sleep_ms(100);
   HAL_GPIO_WritePin(rn4020->wakeswPort, rn4020->wakeswPin, GPIO_PIN_SET);
-  returnNonOKHALStatus(_RN4020_waitForReadyState(rn4020));
+  HAL_StatusTypeDef status = RN4020_waitForCommand(rn4020, token);
+
+  bool flowControl = rn4020->uart->Init.HwFlowCtl == UART_HWCONTROL_RTS_CTS;
+  bool rateChanged = rn4020->baudRate != 0 && (rn4020->baudRate != rn4020->uart->Init.BaudRate || rn4020->flowControl != flowControl);
+  if (status != HAL_OK && rateChanged) {
+    // the module kept the rate negotiated on an earlier boot
+    uint32_t previousBaudRate = rn4020->uart->Init.BaudRate;
+    returnNonOKHALStatus(_RN4020_configureUart(rn4020, rn4020->baudRate, rn4020->flowControl));
+    status = _RN4020_verifyLink(rn4020);
+    if (status == HAL_OK) {
+      rateChanged = false;
+    } else {
+      // or only the prompt was missed, leave the uart as the caller configured it either way
+      returnNonOKHALStatus(_RN4020_configureUart(rn4020, previousBaudRate, flowControl));
+      status = _RN4020_verifyLink(rn4020);
+    }
+  }
+  returnNonOKHALStatus(status);
+
+  if (rateChanged) {
+    status = RN4020_setBaudRate(rn4020, rn4020->baudRate, rn4020->flowControl);
+    if (status == HAL_ERROR) {
+      RN4020_DEBUG_OUT("baud rate upgrade failed, staying at %lu\n", (unsigned long)rn4020->uart->Init.BaudRate);
+    } else {
+      returnNonOKHALStatus(status);
+    }
+  }
 
   return HAL_OK;
 }
 
 void RN4020_tick(RN4020* rn4020) {
-  char line[RN4020_MAX_RX_LINE_LENGTH];
-  if (RingBufferDmaU8_readLine(&rn4020->rxRing, line, sizeof(line)) > 0) {
-    strTrimRight(line);
-    if (strlen(line) > 0) {
-      _RN4020_processLine(rn4020, line);
+  _RN4020_processCommandQueue(rn4020);
+  _RN4020_processRx(rn4020);
+#ifdef RN4020_SUBMIT_QUEUE
+  _RN4020_processSubmissions(rn4020);
+#endif
+  _RN4020_processCommandQueue(rn4020);
+  _RN4020_processWriteCache(rn4020);
+  _RN4020_processMessageTx(rn4020);
+  _RN4020_processConnectionTuner(rn4020);
+  _RN4020_processReconnect(rn4020);
+  _RN4020_processPowerSchedule(rn4020);
+  _RN4020_processMLDPTx(rn4020);
+}
+
+void RN4020_getStats(RN4020* rn4020, RN4020_Stats* stats) {
+  memcpy(stats, &rn4020->stats, sizeof(RN4020_Stats));
+}
+
+void RN4020_resetStats(RN4020* rn4020) {
+  memset(&rn4020->stats, 0, sizeof(RN4020_Stats));
+}
+
+void RN4020_getRxStats(RN4020* rn4020, uint16_t* highWatermark, uint32_t* overruns) {
+  *highWatermark = rn4020->stats.rxHighWatermark;
+  *overruns = rn4020->stats.rxOverruns;
+}
+
+void _RN4020_processRx(RN4020* rn4020) {
+  RingBufferDmaU8* ring = &rn4020->rxRing;
+  while (1) {
+    if (rn4020->mldp) {
+      _RN4020_processMLDPRx(rn4020);
+      return;
+    }
+
+    uint16_t available = RingBufferDmaU8_available(ring);
+    if (available > rn4020->stats.rxHighWatermark) {
+      rn4020->stats.rxHighWatermark = available;
+    }
+
+    // rxScanned remembers how much of a partial line was already searched so bytes are only looked at once
+    uint16_t tailIndex = ring->tailPtr - ring->buffer;
+    uint16_t lineLength = rn4020->rxScanned;
+    uint16_t index = (tailIndex + lineLength) % ring->size;
+    while (lineLength < available && ring->buffer[index] != '\n') {
+      lineLength++;
+      index = (index + 1 == ring->size) ? 0 : index + 1;
+    }
+    if (lineLength == available) {
+      rn4020->rxScanned = lineLength;
+      if (available >= ring->size - 1) {
+        // the ring is full without a complete line, drop it to resynchronize
+        RN4020_DEBUG_OUT("rx overrun\n");
+        rn4020->stats.rxOverruns++;
+        rn4020->stats.bytesRx += available;
+        ring->tailPtr = ring->buffer + index;
+        rn4020->rxScanned = 0;
+      }
+      return;
+    }
+
+    // lines are parsed in place, only a line that wraps around the end of the ring is copied
+    const char* line;
+    if (tailIndex + lineLength <= ring->size) {
+      line = (const char*)ring->buffer + tailIndex;
+    } else if (lineLength <= sizeof(rn4020->rxLineScratch)) {
+      uint16_t firstLength = ring->size - tailIndex;
+      memcpy(rn4020->rxLineScratch, ring->buffer + tailIndex, firstLength);
+      memcpy(rn4020->rxLineScratch + firstLength, ring->buffer, lineLength - firstLength);
+      line = (const char*)rn4020->rxLineScratch;
+    } else {
+      RN4020_DEBUG_OUT("rx line too long\n");
+      rn4020->stats.rxOverruns++;
+      line = NULL;
+    }
+
+    // consume the line before dispatching so callbacks that call back into RN4020_tick see the next line
+    ring->tailPtr = ring->buffer + ((index + 1 == ring->size) ? 0 : index + 1);
+    rn4020->rxScanned = 0;
+    rn4020->stats.bytesRx += lineLength + 1;
+
+    if (line != NULL) {
+      while (lineLength > 0 && (line[lineLength - 1] == '\r' || line[lineLength - 1] == ' ')) {
+        lineLength--;
+      }
+      if (lineLength > 0) {
+        _RN4020_processLine(rn4020, line, lineLength);
+      }
+    }
+  }
+}
+
+bool RN4020_isIdle(RN4020* rn4020) {
+  return rn4020->commandQueueLength == 0;
+}
+
+HAL_StatusTypeDef RN4020_sendCommandAsync(
+  RN4020* rn4020,
+  const char* cmd,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+) {
+  uint32_t cmdLength = strlen(cmd);
+  if (cmdLength > RN4020_MAX_COMMAND_LENGTH - 2) {
+    return HAL_ERROR;
+  }
+  RN4020_Command* command = _RN4020_allocCommand(rn4020, RN4020_STATE_WAITING_FOR_AOK);
+  if (command == NULL) {
+    return HAL_BUSY;
+  }
+  memcpy(command->line, cmd, cmdLength);
+  command->lineLength = cmdLength;
+  _RN4020_commitCommand(rn4020, command, callback, userData, token);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef RN4020_getCommandStatus(RN4020* rn4020, RN4020_CommandToken token) {
+  if ((int32_t)(token - rn4020->lastCompletedCommandToken) > 0) {
+    return HAL_BUSY;
+  }
+  return rn4020->commandResults[token % RN4020_COMMAND_QUEUE_SIZE];
+}
+
+HAL_StatusTypeDef RN4020_waitForCommand(RN4020* rn4020, RN4020_CommandToken token) {
+  uint32_t startTime = RN4020_GET_TICK();
+  HAL_StatusTypeDef status;
+  while ((status = RN4020_getCommandStatus(rn4020, token)) == HAL_BUSY) {
+    if ((RN4020_GET_TICK() - startTime) > RN4020_WAIT_TIMEOUT) {
+      RN4020_DEBUG_OUT("wait timeout\n");
+      return HAL_TIMEOUT;
+    }
+    RN4020_tick(rn4020);
+  }
+  return status;
+}
+
+RN4020_Command* _RN4020_allocCommand(RN4020* rn4020, RN4020_State waitState) {
+  // the module does not parse commands in MLDP mode, refuse them instead of holding them
+  if (rn4020->mldp || rn4020->commandQueueLength >= RN4020_COMMAND_QUEUE_SIZE) {
+    return NULL;
+  }
+  uint8_t index = (rn4020->commandQueueHead + rn4020->commandQueueLength) % RN4020_COMMAND_QUEUE_SIZE;
+  RN4020_Command* command = &rn4020->commandQueue[index];
+  command->waitState = waitState;
+  switch (waitState) {
+  case RN4020_STATE_WAITING_FOR_AOK:
+  case RN4020_STATE_WAITING_FOR_MLDP:
+  case RN4020_STATE_WAITING_FOR_VALUE:
+  case RN4020_STATE_WAITING_FOR_READ:
+    command->timeout = RN4020_AOK_TIMEOUT;
+    break;
+  case RN4020_STATE_WAITING_FOR_LS:
+  case RN4020_STATE_WAITING_FOR_LC:
+    command->timeout = RN4020_LS_TIMEOUT;
+    break;
+  default:
+    command->timeout = RN4020_TIMEOUT;
+    break;
+  }
+  command->result = NULL;
+  command->lineLength = 0;
+  return command;
+}
+
+void _RN4020_commitCommand(RN4020* rn4020, RN4020_Command* command, RN4020_CommandCallback callback, void* userData, RN4020_CommandToken* token) {
+  command->token = rn4020->nextCommandToken++;
+  command->type = _RN4020_commandType(command);
+  command->callback = callback;
+  command->userData = userData;
+  command->line[command->lineLength++] = '\n';
+  command->line[command->lineLength] = '\0';
+  if (token) {
+    *token = command->token;
+  }
+  rn4020->commandQueueLength++;
+}
+
+HAL_StatusTypeDef _RN4020_waitForQueueSpace(RN4020* rn4020) {
+  uint32_t startTime = RN4020_GET_TICK();
+  while (rn4020->commandQueueLength >= RN4020_COMMAND_QUEUE_SIZE) {
+    if (rn4020->mldp) {
+      return HAL_BUSY;
+    }
+    if ((RN4020_GET_TICK() - startTime) > RN4020_WAIT_TIMEOUT) {
+      return HAL_TIMEOUT;
+    }
+    RN4020_tick(rn4020);
+  }
+  return rn4020->mldp ? HAL_BUSY : HAL_OK;
+}
+
+void _RN4020_processCommandQueue(RN4020* rn4020) {
+  if (rn4020->commandInFlight) {
+    HAL_StatusTypeDef status;
+    uint32_t timeout = rn4020->readResponseInFlight >= 0 ? RN4020_AOK_TIMEOUT : rn4020->commandQueue[rn4020->commandQueueHead].timeout;
+    if (rn4020->state == RN4020_STATE_READY) {
+      status = rn4020->commandStatus;
+    } else if ((RN4020_GET_TICK() - rn4020->commandStartTime) > timeout) {
+      RN4020_DEBUG_OUT("command timeout\n");
+      rn4020->stats.commandTimeouts++;
+      _RN4020_setState(rn4020, RN4020_STATE_READY);
+      status = HAL_TIMEOUT;
+    } else {
+      return;
+    }
+    if (rn4020->readResponseInFlight >= 0) {
+      // read responses bypass the queue, nothing waits on their result
+      if (status == HAL_OK) {
+        _RN4020_recordLatency(rn4020, RN4020_GET_TICK() - rn4020->commandStartTime);
+      } else if (status == HAL_ERROR) {
+        rn4020->stats.commandErrors++;
+      }
+      _RN4020_finishReadResponse(rn4020);
+      rn4020->commandInFlight = false;
+    } else {
+      _RN4020_completeCommand(rn4020, status);
+    }
+  }
+
+  if (rn4020->commandQueueLength > 0 && !rn4020->commandInFlight
+      && rn4020->commandQueue[rn4020->commandQueueHead].waitState == RN4020_STATE_READY) {
+    // a write that went to the write cache, nothing to send so the module is not woken for it
+    rn4020->commandStartTime = RN4020_GET_TICK();
+    _RN4020_completeCommand(rn4020, HAL_OK);
+    return;
+  }
+
+  if (rn4020->state != RN4020_STATE_READY || rn4020->mldp || rn4020->powerState != RN4020_POWER_AWAKE) {
+    return;
+  }
+  if (rn4020->readResponsesPending != 0) {
+    _RN4020_dispatchReadResponse(rn4020);
+    return;
+  }
+  if (rn4020->commandQueueLength == 0) {
+    return;
+  }
+
+  RN4020_Command* command = &rn4020->commandQueue[rn4020->commandQueueHead];
+  if (command->waitState == RN4020_STATE_WAITING_FOR_LS) {
+    rn4020->handleLookupLength = 0;
+    rn4020->handleLookupOverflow = false;
+    rn4020->privateFingerprint = 2166136261u;
+    memset(rn4020->uuidIndex, 0, sizeof(rn4020->uuidIndex));
+  } else if (command->waitState == RN4020_STATE_WAITING_FOR_LC) {
+    RN4020_RemoteGatt* remote = command->result;
+    remote->discovered = false;
+    remote->overflow = false;
+    remote->length = 0;
+  }
+  rn4020->commandInFlight = true;
+  rn4020->commandStatus = HAL_OK;
+  rn4020->stats.commands[command->type]++;
+  if (command->type == RN4020_COMMAND_TYPE_WRITE) {
+    rn4020->tunerWrites++;
+  }
+  rn4020->commandStartTime = RN4020_GET_TICK();
+  _RN4020_setState(rn4020, command->waitState);
+  if (command->lineLength > 1) {
+    RN4020_DEBUG_OUT("tx: %s", command->line);
+    if (_RN4020_transmit(rn4020, (const uint8_t*)command->line, command->lineLength) != HAL_OK) {
+      _RN4020_setState(rn4020, RN4020_STATE_READY);
+      _RN4020_completeCommand(rn4020, HAL_ERROR);
     }
   }
 }
 
+void _RN4020_completeCommand(RN4020* rn4020, HAL_StatusTypeDef status) {
+  RN4020_Command* command = &rn4020->commandQueue[rn4020->commandQueueHead];
+  RN4020_CommandCallback callback = command->callback;
+  void* userData = command->userData;
+  RN4020_CommandToken token = command->token;
+
+  if (status == HAL_OK) {
+    _RN4020_recordLatency(rn4020, RN4020_GET_TICK() - rn4020->commandStartTime);
+  } else if (status == HAL_ERROR) {
+    rn4020->stats.commandErrors++;
+  }
+
+  rn4020->commandQueueHead = (rn4020->commandQueueHead + 1) % RN4020_COMMAND_QUEUE_SIZE;
+  rn4020->commandQueueLength--;
+  rn4020->commandInFlight = false;
+  rn4020->commandResults[token % RN4020_COMMAND_QUEUE_SIZE] = status;
+  rn4020->lastCompletedCommandToken = token;
+
+  if (callback) {
+    callback(rn4020, token, status, userData);
+  }
+}
+
+void _RN4020_recordLatency(RN4020* rn4020, uint32_t latency) {
+  if (latency > rn4020->stats.latencyMax) {
+    rn4020->stats.latencyMax = latency;
+  }
+  uint8_t bucket = 0;
+  while (latency > 0 && bucket < RN4020_LATENCY_HISTOGRAM_BUCKETS - 1) {
+    latency >>= 1;
+    bucket++;
+  }
+  rn4020->stats.latencyHistogram[bucket]++;
+}
+
+RN4020_CommandType _RN4020_commandType(const RN4020_Command* command) {
+  const char* line = command->line;
+  switch (line[0]) {
+  case '\n':
+    return RN4020_COMMAND_TYPE_WAKE;
+  case 'S':
+    return (line[1] == 'H' || line[1] == 'U') && line[2] == 'W' ? RN4020_COMMAND_TYPE_WRITE : RN4020_COMMAND_TYPE_SET;
+  case 'P':
+    return RN4020_COMMAND_TYPE_PRIVATE;
+  case 'R':
+    return RN4020_COMMAND_TYPE_RESET;
+  case 'L':
+    return RN4020_COMMAND_TYPE_LIST;
+  case 'A':
+    return RN4020_COMMAND_TYPE_ADVERTISE;
+  case 'I':
+    return RN4020_COMMAND_TYPE_MLDP;
+  case 'C':
+    return RN4020_COMMAND_TYPE_CLIENT;
+  default:
+    return RN4020_COMMAND_TYPE_OTHER;
+  }
+}
+
 bool RN4020_isConnected(RN4020* rn4020) {
   return rn4020->connected;
 }
 
 HAL_StatusTypeDef RN4020_resetToFactoryDefaults(RN4020* rn4020) {
-  return _RN4020_runAOKCommand(rn4020, "SF,1");
+  // erasing the configuration is slower than other set commands
+  return _RN4020_runCommand(rn4020, "SF,1", RN4020_STATE_WAITING_FOR_AOK, RN4020_TIMEOUT);
 }
 
 HAL_StatusTypeDef RN4020_setSupportedServices(RN4020* rn4020, uint32_t services) {
   char line[15];
-  sprintf(line, "SS,%08lX", services);
+  strcpy(line, "SS,");
+  *RN4020_hexEncodeU32(line + 3, services) = '\0';
   return _RN4020_runAOKCommand(rn4020, line);
 }
 
 HAL_StatusTypeDef RN4020_setSupportedFeatures(RN4020* rn4020, uint32_t features) {
   char line[15];
-  sprintf(line, "SR,%08lX", features);
+  strcpy(line, "SR,");
+  *RN4020_hexEncodeU32(line + 3, features) = '\0';
   return _RN4020_runAOKCommand(rn4020, line);
 }
 
 HAL_StatusTypeDef RN4020_setDeviceNameWithMAC(RN4020* rn4020, const char* deviceName) {
-  char line[15];
-  sprintf(line, "S-,%s", deviceName);
+  char line[RN4020_MAX_COMMAND_LENGTH];
+  snprintf(line, sizeof(line), "S-,%s", deviceName);
   return _RN4020_runAOKCommand(rn4020, line);
 }
 
 HAL_StatusTypeDef RN4020_setDeviceName(RN4020* rn4020, const char* deviceName) {
-  char line[15];
-  sprintf(line, "SN,%s", deviceName);
+  char line[RN4020_MAX_COMMAND_LENGTH];
+  snprintf(line, sizeof(line), "SN,%s", deviceName);
   return _RN4020_runAOKCommand(rn4020, line);
 }
 
 HAL_StatusTypeDef RN4020_reset(RN4020* rn4020) {
-  _RN4020_setState(rn4020, RN4020_STATE_WAITING_FOR_RESET);
-  RN4020_send(rn4020, "R,1");
-  return _RN4020_waitForReadyState(rn4020);
+  return _RN4020_runCommand(rn4020, "R,1", RN4020_STATE_WAITING_FOR_RESET, 0);
 }
 
 HAL_StatusTypeDef RN4020_advertise(RN4020* rn4020) {
@@ -101,10 +629,80 @@ HAL_StatusTypeDef RN4020_removeBond(RN4020* rn4020) {
 }
 
 HAL_StatusTypeDef RN4020_refreshHandleLookup(RN4020* rn4020) {
-  rn4020->handleLookupLength = 0;
-  _RN4020_setState(rn4020, RN4020_STATE_WAITING_FOR_LS);
-  RN4020_send(rn4020, "LS");
-  return _RN4020_waitForReadyState(rn4020);
+  return _RN4020_runCommand(rn4020, "LS", RN4020_STATE_WAITING_FOR_LS, 0);
+}
+
+HAL_StatusTypeDef RN4020_getSupportedServices(RN4020* rn4020, uint32_t* services) {
+  returnNonOKHALStatus(_RN4020_getValue(rn4020, "GS"));
+  return (strlen(rn4020->value) == 8 && RN4020_hexDecodeU32(rn4020->value, services)) ? HAL_OK : HAL_ERROR;
+}
+
+HAL_StatusTypeDef RN4020_getSupportedFeatures(RN4020* rn4020, uint32_t* features) {
+  returnNonOKHALStatus(_RN4020_getValue(rn4020, "GR"));
+  return (strlen(rn4020->value) == 8 && RN4020_hexDecodeU32(rn4020->value, features)) ? HAL_OK : HAL_ERROR;
+}
+
+HAL_StatusTypeDef RN4020_getDeviceName(RN4020* rn4020, char* deviceName, uint32_t deviceNameSize) {
+  returnNonOKHALStatus(_RN4020_getValue(rn4020, "GN"));
+  if (strlen(rn4020->value) >= deviceNameSize) {
+    return HAL_ERROR;
+  }
+  strcpy(deviceName, rn4020->value);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef _RN4020_getValue(RN4020* rn4020, const char* cmd) {
+  rn4020->value[0] = '\0';
+  return _RN4020_runCommand(rn4020, cmd, RN4020_STATE_WAITING_FOR_VALUE, 0);
+}
+
+HAL_StatusTypeDef RN4020_provision(RN4020* rn4020, const RN4020_Config* config, bool* changed) {
+  uint32_t services, features;
+  char deviceName[RN4020_MAX_VALUE_LENGTH + 1];
+  bool servicesChanged = RN4020_getSupportedServices(rn4020, &services) != HAL_OK || services != config->services;
+  bool featuresChanged = RN4020_getSupportedFeatures(rn4020, &features) != HAL_OK || features != config->features;
+  bool deviceNameChanged = config->deviceName != NULL
+                           && (RN4020_getDeviceName(rn4020, deviceName, sizeof(deviceName)) != HAL_OK
+                               || strcmp(deviceName, config->deviceName) != 0);
+
+  uint32_t expectedFingerprint = 2166136261u;
+  for (int i = 0; i < config->privateEntriesLength; i++) {
+    const RN4020_GattEntry* entry = &config->privateEntries[i];
+    if (entry->isService) {
+      expectedFingerprint = _RN4020_privateFingerprintService(expectedFingerprint, entry->uuid);
+    } else {
+      expectedFingerprint = _RN4020_privateFingerprintCharacteristic(expectedFingerprint, entry->uuid, entry->propertyOptions);
+    }
+  }
+  bool privateChanged = RN4020_refreshHandleLookup(rn4020) != HAL_OK || rn4020->privateFingerprint != expectedFingerprint;
+
+  bool anyChanged = servicesChanged || featuresChanged || deviceNameChanged || privateChanged;
+  if (changed) {
+    *changed = anyChanged;
+  }
+  if (!anyChanged) {
+    RN4020_DEBUG_OUT("provision: already configured\n");
+    return HAL_OK;
+  }
+
+  if (servicesChanged) {
+    returnNonOKHALStatus(RN4020_setSupportedServices(rn4020, config->services));
+  }
+  if (featuresChanged) {
+    returnNonOKHALStatus(RN4020_setSupportedFeatures(rn4020, config->features));
+  }
+  if (deviceNameChanged) {
+    returnNonOKHALStatus(RN4020_setDeviceName(rn4020, config->deviceName));
+  }
+  if (privateChanged) {
+    returnNonOKHALStatus(RN4020_clearPrivate(rn4020));
+    for (int i = 0; i < config->privateEntriesLength; i++) {
+      const RN4020_GattEntry* entry = &config->privateEntries[i];
+      returnNonOKHALStatus(RN4020_addGattEntry(rn4020, entry));
+    }
+  }
+  returnNonOKHALStatus(RN4020_reset(rn4020));
+  return RN4020_refreshHandleLookup(rn4020);
 }
 
 HAL_StatusTypeDef RN4020_clearPrivate(RN4020* rn4020) {
@@ -112,10 +710,8 @@ HAL_StatusTypeDef RN4020_clearPrivate(RN4020* rn4020) {
 }
 
 HAL_StatusTypeDef RN4020_addPrivateService(RN4020* rn4020, const uint8_t* uuid) {
-  char line[50];
-  strcpy(line, "PS,");
-  RN4020_uuidToString(line + 3, uuid, RN4020_PRIVATE_UUID_LENGTH_BYTES);
-  return _RN4020_runAOKCommand(rn4020, line);
+  RN4020_GattEntry entry = { true, uuid, 0, 0, 0, NULL };
+  return RN4020_addGattEntry(rn4020, &entry);
 }
 
 HAL_StatusTypeDef RN4020_addPrivateCharacteristic(
@@ -125,36 +721,160 @@ HAL_StatusTypeDef RN4020_addPrivateCharacteristic(
   uint8_t size,
   uint8_t securityOptions
 ) {
-  char line[50];
-  char* dest;
-  strcpy(line, "PC,");
-  RN4020_uuidToString(line + 3, uuid, RN4020_PRIVATE_UUID_LENGTH_BYTES);
-  dest = line + strlen(line);
-  sprintf(dest, ",%02X,%02X", propertyOptions, size);
-  if (securityOptions != RN4020_PRIVATE_CHARACTERISTIC_SECURITY_NONE) {
-    dest = line + strlen(line);
-    sprintf(dest, ",%02X", securityOptions);
+  RN4020_GattEntry entry = { false, uuid, propertyOptions, size, securityOptions, NULL };
+  return RN4020_addGattEntry(rn4020, &entry);
+}
+
+HAL_StatusTypeDef RN4020_addGattEntry(RN4020* rn4020, const RN4020_GattEntry* entry) {
+  RN4020_CommandToken token;
+  returnNonOKHALStatus(_RN4020_waitForQueueSpace(rn4020));
+  RN4020_Command* command = _RN4020_allocCommand(rn4020, RN4020_STATE_WAITING_FOR_AOK);
+  if (command == NULL) {
+    return HAL_BUSY;
   }
-  return _RN4020_runAOKCommand(rn4020, line);
+  char* dest = command->line;
+  if (entry->command != NULL) {
+    uint32_t commandLength = strlen(entry->command);
+    memcpy(dest, entry->command, commandLength);
+    dest += commandLength;
+  } else {
+    memcpy(dest, entry->isService ? "PS," : "PC,", 3);
+    dest = RN4020_hexEncode(dest + 3, entry->uuid, RN4020_PRIVATE_UUID_LENGTH_BYTES);
+  }
+  if (!entry->isService) {
+    *dest++ = ',';
+    dest = RN4020_hexEncodeU8(dest, entry->propertyOptions);
+    *dest++ = ',';
+    dest = RN4020_hexEncodeU8(dest, entry->size);
+    if (entry->securityOptions != RN4020_PRIVATE_CHARACTERISTIC_SECURITY_NONE) {
+      *dest++ = ',';
+      dest = RN4020_hexEncodeU8(dest, entry->securityOptions);
+    }
+  }
+  command->lineLength = dest - command->line;
+  _RN4020_commitCommand(rn4020, command, NULL, NULL, &token);
+  return RN4020_waitForCommand(rn4020, token);
 }
 
-void RN4020_uuidToString(char* dest, const uint8_t* uuid, uint8_t uuidLength) {
-  for (int i = 0; i < uuidLength; i++) {
-    sprintf(dest, "%02X", uuid[i]);
-    dest += 2;
+HAL_StatusTypeDef RN4020_addGattTable(RN4020* rn4020, const RN4020_GattTable* table) {
+  for (int i = 0; i < table->length; i++) {
+    returnNonOKHALStatus(RN4020_addGattEntry(rn4020, &table->entries[i]));
+  }
+  return HAL_OK;
+}
+
+void RN4020_bindGattTable(RN4020* rn4020, const RN4020_GattTable* table) {
+  rn4020->gattTable = table;
+  _RN4020_bindGattHandles(rn4020);
+}
+
+void _RN4020_bindGattHandles(RN4020* rn4020) {
+  const RN4020_GattTable* table = rn4020->gattTable;
+  if (table == NULL) {
+    return;
   }
+  for (int i = 0; i < table->length; i++) {
+    const RN4020_GattEntry* entry = &table->entries[i];
+    RN4020_handleLookupItem* item = entry->isService ? NULL : RN4020_lookupUUID(rn4020, entry->uuid, RN4020_PRIVATE_UUID_LENGTH_BYTES);
+    table->handles[i] = item ? item->handle : 0;
+  }
+}
+
+HAL_StatusTypeDef RN4020_writeGattCharacteristic(RN4020* rn4020, const RN4020_GattTable* table, uint8_t id, const uint8_t* data, uint32_t dataLength) {
+  if (table->handles[id] == 0) {
+    return RN4020_writeServerPrivateCharacteristic(rn4020, table->entries[id].uuid, data, dataLength);
+  }
+  return RN4020_writeServerCharacteristicHandle(rn4020, table->handles[id], data, dataLength);
+}
+
+void RN4020_uuidToString(char* dest, const uint8_t* uuid, uint8_t uuidLength) {
+  *RN4020_hexEncode(dest, uuid, uuidLength) = '\0';
 }
 
 RN4020_handleLookupItem* RN4020_lookupHandle(RN4020* rn4020, uint16_t handle) {
-  for (int i = 0; i < rn4020->handleLookupLength; i++) {
-    RN4020_handleLookupItem* item = &rn4020->handleLookup[i];
+  uint32_t low = 0;
+  uint32_t high = rn4020->handleLookupLength;
+  while (low < high) {
+    uint32_t mid = (low + high) / 2;
+    RN4020_handleLookupItem* item = &rn4020->handleLookup[mid];
     if (item->handle == handle) {
       return item;
+    } else if (item->handle < handle) {
+      low = mid + 1;
+    } else {
+      high = mid;
     }
   }
   return NULL;
 }
 
+RN4020_handleLookupItem* RN4020_lookupUUID(RN4020* rn4020, const uint8_t* uuid, uint8_t uuidLength) {
+  uint32_t slot = _RN4020_hashUUID(uuid, uuidLength);
+  for (int i = 0; i < RN4020_UUID_INDEX_SIZE; i++, slot = (slot + 1) & (RN4020_UUID_INDEX_SIZE - 1)) {
+    uint8_t entry = rn4020->uuidIndex[slot];
+    if (entry == 0) {
+      return NULL;
+    }
+    RN4020_handleLookupItem* item = &rn4020->handleLookup[entry - 1];
+    if (item->characteristicUUIDLength == uuidLength && memcmp(item->characteristicUUID, uuid, uuidLength) == 0) {
+      return item;
+    }
+  }
+  return NULL;
+}
+
+uint32_t _RN4020_hashUUID(const uint8_t* uuid, uint8_t uuidLength) {
+  uint32_t hash = _RN4020_fnv1a(2166136261u, uuid, uuidLength);
+  return (hash ^ (hash >> 16)) & (RN4020_UUID_INDEX_SIZE - 1);
+}
+
+uint32_t _RN4020_fnv1a(uint32_t hash, const uint8_t* data, uint32_t dataLength) {
+  for (uint32_t i = 0; i < dataLength; i++) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+uint32_t _RN4020_privateFingerprintService(uint32_t fingerprint, const uint8_t* uuid) {
+  uint8_t tag = 'S';
+  fingerprint = _RN4020_fnv1a(fingerprint, &tag, 1);
+  return _RN4020_fnv1a(fingerprint, uuid, RN4020_PRIVATE_UUID_LENGTH_BYTES);
+}
+
+uint32_t _RN4020_privateFingerprintCharacteristic(uint32_t fingerprint, const uint8_t* uuid, uint8_t properties) {
+  uint8_t tag = 'C';
+  fingerprint = _RN4020_fnv1a(fingerprint, &tag, 1);
+  fingerprint = _RN4020_fnv1a(fingerprint, uuid, RN4020_PRIVATE_UUID_LENGTH_BYTES);
+  return _RN4020_fnv1a(fingerprint, &properties, 1);
+}
+
+void _RN4020_buildHandleIndex(RN4020* rn4020) {
+  // LS lists handles in ascending order so this insertion sort is normally a single pass
+  for (uint32_t i = 1; i < rn4020->handleLookupLength; i++) {
+    RN4020_handleLookupItem item = rn4020->handleLookup[i];
+    uint32_t j = i;
+    while (j > 0 && rn4020->handleLookup[j - 1].handle > item.handle) {
+      rn4020->handleLookup[j] = rn4020->handleLookup[j - 1];
+      j--;
+    }
+    rn4020->handleLookup[j] = item;
+  }
+
+  // a uuid can be listed more than once (value and descriptor handles), the index points at the lowest handle
+  memset(rn4020->uuidIndex, 0, sizeof(rn4020->uuidIndex));
+  for (uint32_t i = 0; i < rn4020->handleLookupLength; i++) {
+    RN4020_handleLookupItem* item = &rn4020->handleLookup[i];
+    if (RN4020_lookupUUID(rn4020, item->characteristicUUID, item->characteristicUUIDLength) != NULL) {
+      continue;
+    }
+    uint32_t slot = _RN4020_hashUUID(item->characteristicUUID, item->characteristicUUIDLength);
+    while (rn4020->uuidIndex[slot] != 0) {
+      slot = (slot + 1) & (RN4020_UUID_INDEX_SIZE - 1);
+    }
+    rn4020->uuidIndex[slot] = i + 1;
+  }
+}
+
 bool RN4020_isHandleLookupItemUUIDEqual16(RN4020_handleLookupItem* handleLookupItem, uint16_t uuid) {
   if (handleLookupItem->characteristicUUIDLength != 2) {
     return false;
@@ -175,44 +895,129 @@ bool RN4020_isHandleLookupItemUUIDEqual128(RN4020_handleLookupItem* handleLookup
   return true;
 }
 
-void _RN4020_processLine(RN4020* rn4020, const char* line) {
-  RN4020_DEBUG_OUT("rx: %s\n", line);
+RN4020_LineType _RN4020_classifyLine(const char* line, uint16_t lineLength) {
+  // <12 hex digit MAC>,<address type>,...,<RSSI>
+  if (lineLength >= 17 && line[12] == ',' && line[14] == ',') {
+    return RN4020_LINE_SCAN_REPORT;
+  }
+  switch (line[0]) {
+  case ' ':
+    return _RN4020_LINE_STARTS_WITH(line, lineLength, "  ") ? RN4020_LINE_LS_CHARACTERISTIC : RN4020_LINE_UNKNOWN;
+  case 'A':
+    return _RN4020_LINE_EQUALS(line, lineLength, "AOK") ? RN4020_LINE_AOK : RN4020_LINE_UNKNOWN;
+  case 'C':
+    if (_RN4020_LINE_EQUALS(line, lineLength, "CMD")) {
+      return RN4020_LINE_CMD;
+    } else if (_RN4020_LINE_EQUALS(line, lineLength, "Connected")) {
+      return RN4020_LINE_CONNECTED;
+    } else if (_RN4020_LINE_EQUALS(line, lineLength, "Connection End")) {
+      return RN4020_LINE_CONNECTION_END;
+    } else if (_RN4020_LINE_STARTS_WITH(line, lineLength, "ConnParam:")) {
+      return RN4020_LINE_CONNECTION_PARAMETERS;
+    }
+    return RN4020_LINE_UNKNOWN;
+  case 'E':
+    if (_RN4020_LINE_EQUALS(line, lineLength, "END")) {
+      return RN4020_LINE_END;
+    } else if (_RN4020_LINE_EQUALS(line, lineLength, "ERR")) {
+      return RN4020_LINE_ERR;
+    }
+    return RN4020_LINE_UNKNOWN;
+  case 'R':
+    if (_RN4020_LINE_STARTS_WITH(line, lineLength, "RV,")) {
+      return RN4020_LINE_REAL_TIME_READ;
+    } else if (_RN4020_LINE_STARTS_WITH(line, lineLength, "R,")) {
+      return RN4020_LINE_REMOTE_READ;
+    } else if (_RN4020_LINE_EQUALS(line, lineLength, "Reboot")) {
+      return RN4020_LINE_REBOOT;
+    }
+    return RN4020_LINE_UNKNOWN;
+  case 'M':
+    return _RN4020_LINE_EQUALS(line, lineLength, "MLDP") ? RN4020_LINE_MLDP : RN4020_LINE_UNKNOWN;
+  case 'N':
+    return _RN4020_LINE_STARTS_WITH(line, lineLength, "Notify,") ? RN4020_LINE_NOTIFY : RN4020_LINE_UNKNOWN;
+  case 'I':
+    return _RN4020_LINE_STARTS_WITH(line, lineLength, "Indicate,") ? RN4020_LINE_INDICATE : RN4020_LINE_UNKNOWN;
+  case 'W':
+    return _RN4020_LINE_STARTS_WITH(line, lineLength, "WV,") ? RN4020_LINE_WRITE : RN4020_LINE_UNKNOWN;
+  default:
+    return RN4020_LINE_UNKNOWN;
+  }
+}
+
+void _RN4020_processLine(RN4020* rn4020, const char* line, uint16_t lineLength) {
+  RN4020_DEBUG_OUT("rx: %.*s\n", lineLength, line);
+#ifdef RN4020_TRACE
+  if (!rn4020->traceReplaying) {
+    _RN4020_traceRecord(rn4020, RN4020_TRACE_RX, (const uint8_t*)line, lineLength);
+  }
+#endif
 
-  if (strcmp(line, "Connected") == 0) {
-    _RN4020_setConnected(rn4020, true);
+  RN4020_LineType lineType = _RN4020_classifyLine(line, lineLength);
+  if (lineType == RN4020_LINE_CMD && rn4020->powerState == RN4020_POWER_WAKING) {
+    _RN4020_powerAwake(rn4020);
     return;
   }
+  switch (lineType) {
+  case RN4020_LINE_CONNECTED:
+    _RN4020_setConnected(rn4020, true);
+    return;
 
-  if (strcmp(line, "Connection End") == 0) {
+  case RN4020_LINE_CONNECTION_END:
     _RN4020_setConnected(rn4020, false);
     return;
-  }
 
-  if (strncmp(line, "RV,", 3) == 0) {
-    char handleStr[5];
-    strncpy(handleStr, line + 3, 4);
-    handleStr[4] = '\0';
-    uint16_t handle = strtol(handleStr, NULL, 16);
-    RN4020_onRealTimeRead(rn4020, handle);
-    return;
+  case RN4020_LINE_REAL_TIME_READ: {
+    uint16_t handle;
+    if (lineLength >= 7 && RN4020_hexDecodeU16(line + 3, &handle)) {
+      int8_t index = _RN4020_findReadCacheItem(rn4020, handle);
+      if (index >= 0) {
+        rn4020->readResponsesPending |= 1u << index;
+        rn4020->stats.realTimeReadsAnswered++;
+      } else {
+        RN4020_onRealTimeRead(rn4020, handle);
+      }
+      return;
+    }
+    break;
   }
 
-  if (strncmp(line, "WV,", 3) == 0) {
-    char handleStr[5];
-    strncpy(handleStr, line + 3, 4);
-    handleStr[4] = '\0';
-    uint16_t handle = strtol(handleStr, NULL, 16);
-    const char* dataStringPtr = line + 8;
-    int dataLength = (strlen(dataStringPtr) - 1) / 2; // WV ends with period so subtract 1
-    uint8_t data[RN4020_MAX_RX_LINE_LENGTH];
-    for (int i = 0; i < dataLength; i++, dataStringPtr += 2) {
-      char temp[3];
-      strncpy(temp, dataStringPtr, 2);
-      temp[2] = '\0';
-      data[i] = strtol(temp, NULL, 16);
+  case RN4020_LINE_WRITE:
+    if (lineLength >= 8) {
+      _RN4020_processWriteLine(rn4020, line, lineLength);
+      return;
+    }
+    break;
+
+  case RN4020_LINE_ERR:
+    if (rn4020->commandInFlight && rn4020->state != RN4020_STATE_READY) {
+      RN4020_DEBUG_OUT("command rejected: %s", rn4020->commandQueue[rn4020->commandQueueHead].line);
+      rn4020->commandStatus = HAL_ERROR;
+      _RN4020_setState(rn4020, RN4020_STATE_READY);
+      return;
     }
-    RN4020_onWrite(rn4020, handle, data, dataLength);
+    break;
+
+  case RN4020_LINE_CONNECTION_PARAMETERS:
+    _RN4020_processConnectionParametersLine(rn4020, line, lineLength);
+    return;
+
+  case RN4020_LINE_NOTIFY:
+    _RN4020_processNotifyLine(rn4020, line, lineLength, 7, false);
+    return;
+
+  case RN4020_LINE_INDICATE:
+    _RN4020_processNotifyLine(rn4020, line, lineLength, 9, true);
     return;
+
+  case RN4020_LINE_SCAN_REPORT:
+    if (rn4020->scanning && _RN4020_processScanReport(rn4020, line, lineLength)) {
+      return;
+    }
+    break;
+
+  default:
+    break;
   }
 
   switch (rn4020->state) {
@@ -220,35 +1025,93 @@ void _RN4020_processLine(RN4020* rn4020, const char* line) {
     break;
 
   case RN4020_STATE_WAITING_FOR_CMD:
-    if (strcmp(line, "CMD") == 0) {
+    if (lineType == RN4020_LINE_CMD) {
       _RN4020_setState(rn4020, RN4020_STATE_READY);
       return;
     }
     break;
 
   case RN4020_STATE_WAITING_FOR_AOK:
-    if (strcmp(line, "AOK") == 0) {
+    if (lineType == RN4020_LINE_AOK) {
       _RN4020_setState(rn4020, RN4020_STATE_READY);
       return;
     }
     break;
 
   case RN4020_STATE_WAITING_FOR_RESET:
-    if (strcmp(line, "Reboot") == 0) {
+    if (lineType == RN4020_LINE_REBOOT) {
       _RN4020_setState(rn4020, RN4020_STATE_WAITING_FOR_CMD);
       return;
     }
     break;
 
   case RN4020_STATE_WAITING_FOR_LS:
-    if (_RN4020_parseHandleUUIDLine(line, &rn4020->handleLookup[rn4020->handleLookupLength])) {
-      rn4020->handleLookupLength++;
+    if (lineType == RN4020_LINE_LS_CHARACTERISTIC) {
+      if (rn4020->handleLookupLength >= RN4020_LOOKUP_TABLE_SIZE) {
+        RN4020_handleLookupItem ignored;
+        if (_RN4020_parseHandleUUIDLine(line, lineLength, &ignored)) {
+          RN4020_DEBUG_OUT("handle lookup table full, increase RN4020_LOOKUP_TABLE_SIZE\n");
+          rn4020->handleLookupOverflow = true;
+          rn4020->commandStatus = HAL_ERROR;
+          return;
+        }
+      } else if (_RN4020_parseHandleUUIDLine(line, lineLength, &rn4020->handleLookup[rn4020->handleLookupLength])) {
+        RN4020_handleLookupItem* item = &rn4020->handleLookup[rn4020->handleLookupLength];
+        // a characteristic with notify or indicate is listed a second time for its configuration descriptor
+        bool repeated = rn4020->handleLookupLength > 0
+                        && rn4020->handleLookup[rn4020->handleLookupLength - 1].characteristicUUIDLength == item->characteristicUUIDLength
+                        && memcmp(rn4020->handleLookup[rn4020->handleLookupLength - 1].characteristicUUID, item->characteristicUUID, item->characteristicUUIDLength) == 0;
+        if (repeated) {
+          rn4020->handleLookup[rn4020->handleLookupLength - 1].configurationHandle = item->handle;
+        } else if (item->characteristicUUIDLength == RN4020_PRIVATE_UUID_LENGTH_BYTES) {
+          rn4020->privateFingerprint = _RN4020_privateFingerprintCharacteristic(rn4020->privateFingerprint, item->characteristicUUID, item->characteristicProperties);
+        }
+        rn4020->handleLookupLength++;
+        return;
+      }
+    } else if (lineType == RN4020_LINE_END) {
+      _RN4020_buildHandleIndex(rn4020);
+      _RN4020_bindGattHandles(rn4020);
+      _RN4020_setState(rn4020, RN4020_STATE_READY);
       return;
-    } else if (strcmp(line, "END") == 0) {
+    } else if (lineLength == 4) {
+      // public service uuid
+      return;
+    } else if (lineLength == RN4020_PRIVATE_UUID_HEX_STRING_LENGTH) {
+      uint8_t uuid[RN4020_PRIVATE_UUID_LENGTH_BYTES];
+      if (RN4020_hexDecode(uuid, line, lineLength) == RN4020_PRIVATE_UUID_LENGTH_BYTES) {
+        rn4020->privateFingerprint = _RN4020_privateFingerprintService(rn4020->privateFingerprint, uuid);
+        return;
+      }
+    }
+    break;
+
+  case RN4020_STATE_WAITING_FOR_VALUE:
+    if (lineLength <= RN4020_MAX_VALUE_LENGTH) {
+      memcpy(rn4020->value, line, lineLength);
+      rn4020->value[lineLength] = '\0';
       _RN4020_setState(rn4020, RN4020_STATE_READY);
       return;
-    } else if (strlen(line) == 4 || strlen(line) == RN4020_PRIVATE_UUID_HEX_STRING_LENGTH) {
-      // service uuid
+    }
+    break;
+
+  case RN4020_STATE_WAITING_FOR_LC:
+    _RN4020_processLCLine(rn4020, lineType, line, lineLength);
+    return;
+
+  case RN4020_STATE_WAITING_FOR_READ:
+    if (lineType == RN4020_LINE_REMOTE_READ) {
+      _RN4020_processRemoteReadLine(rn4020, line, lineLength);
+      return;
+    }
+    break;
+
+  case RN4020_STATE_WAITING_FOR_MLDP:
+    if (lineType == RN4020_LINE_MLDP) {
+      // everything after this line is payload
+      rn4020->mldp = true;
+      rn4020->mldpStatusMatched = 0;
+      _RN4020_setState(rn4020, RN4020_STATE_READY);
       return;
     }
     break;
@@ -256,28 +1119,221 @@ void _RN4020_processLine(RN4020* rn4020, const char* line) {
   case RN4020_STATE_READY:
     break;
   }
-  RN4020_DEBUG_OUT("unexpected line: %s\n", line);
+  RN4020_DEBUG_OUT("unexpected line: %.*s\n", lineLength, line);
+  rn4020->stats.unexpectedLines++;
 }
 
-bool _RN4020_parseHandleUUIDLine(const char* line, RN4020_handleLookupItem* handleLookupItem) {
-  if (strncmp(line, "  ", 2) != 0) {
-    return false;
+void _RN4020_processWriteLine(RN4020* rn4020, const char* line, uint16_t lineLength) {
+  uint16_t handle;
+  uint8_t data[RN4020_MAX_RX_LINE_LENGTH / 2];
+  int32_t dataLength;
+  RN4020_MessageChannel* channel = rn4020->messageChannel;
+  if (channel != NULL && lineLength >= 8 && line[7] == ',' && RN4020_hexDecodeU16(line + 3, &handle) && handle == channel->rxHandle) {
+    _RN4020_processMessageChunk(rn4020, channel, line + 8, lineLength - 8);
+    return;
   }
+  if (!_RN4020_parseHandleValueLine(line, lineLength, 3, &handle, data, sizeof(data), &dataLength)) {
+    RN4020_DEBUG_OUT("invalid write line: %.*s\n", lineLength, line);
+    rn4020->stats.unexpectedLines++;
+    return;
+  }
+  _RN4020_processClientConfigurationWrite(rn4020, handle, data, dataLength);
+  RN4020_onWrite(rn4020, handle, data, dataLength);
+}
+
+void _RN4020_processClientConfigurationWrite(RN4020* rn4020, uint16_t handle, const uint8_t* data, int32_t dataLength) {
+  for (uint32_t i = 0; i < rn4020->handleLookupLength; i++) {
+    RN4020_handleLookupItem* item = &rn4020->handleLookup[i];
+    if (item->configurationHandle != handle) {
+      continue;
+    }
+    // descriptor values are little endian
+    uint16_t configuration = dataLength > 0 ? data[0] : 0;
+    if (dataLength > 1) {
+      configuration |= (uint16_t)data[1] << 8;
+    }
+    bool subscribed = item->clientConfiguration == RN4020_CLIENT_CONFIGURATION_NONE && configuration != RN4020_CLIENT_CONFIGURATION_NONE;
+    item->clientConfiguration = configuration;
+    if (!subscribed) {
+      return;
+    }
+    // give the new subscriber the latest value right away
+    for (int j = 0; j < rn4020->writeCacheLength; j++) {
+      if (rn4020->writeCache[j].handle == item->handle) {
+        rn4020->writeCache[j].pending = true;
+        rn4020->writeCacheFlushNow = true;
+      }
+    }
+    return;
+  }
+}
+
+uint16_t RN4020_getClientConfiguration(RN4020* rn4020, uint16_t handle) {
+  RN4020_handleLookupItem* item = RN4020_lookupHandle(rn4020, handle);
+  if (item == NULL) {
+    return RN4020_CLIENT_CONFIGURATION_NONE;
+  }
+  return item->clientConfiguration;
+}
+
+bool _RN4020_isListenedTo(RN4020* rn4020, uint16_t handle) {
+  if (!rn4020->connected) {
+    return false;
+  }
+  RN4020_handleLookupItem* item = RN4020_lookupHandle(rn4020, handle);
+  if (item == NULL || item->configurationHandle == 0) {
+    return true;
+  }
+  return item->clientConfiguration != RN4020_CLIENT_CONFIGURATION_NONE;
+}
+
+void _RN4020_processNotifyLine(RN4020* rn4020, const char* line, uint16_t lineLength, uint8_t prefixLength, bool indication) {
+  uint16_t handle;
+  uint8_t data[RN4020_MAX_RX_LINE_LENGTH / 2];
+  int32_t dataLength;
+  if (!_RN4020_parseHandleValueLine(line, lineLength, prefixLength, &handle, data, sizeof(data), &dataLength)) {
+    RN4020_DEBUG_OUT("invalid notify line: %.*s\n", lineLength, line);
+    rn4020->stats.unexpectedLines++;
+    return;
+  }
+  RN4020_onRemoteNotify(rn4020, handle, data, dataLength, indication);
+}
+
+// <prefix>hhhh,<hex data>[.], values longer than dataCapacity bytes are rejected as malformed
+bool _RN4020_parseHandleValueLine(
+  const char* line,
+  uint16_t lineLength,
+  uint8_t prefixLength,
+  uint16_t* handle,
+  uint8_t* data,
+  uint32_t dataCapacity,
+  int32_t* dataLength
+) {
+  if (lineLength < prefixLength + 5 || line[prefixLength + 4] != ',' || !RN4020_hexDecodeU16(line + prefixLength, handle)) {
+    return false;
+  }
+  const char* dataStringPtr = line + prefixLength + 5;
+  uint16_t dataStringLength = lineLength - prefixLength - 5;
+  if (dataStringLength > 0 && dataStringPtr[dataStringLength - 1] == '.') {
+    dataStringLength--; // values end with period
+  }
+  if (dataStringLength > dataCapacity * 2) {
+    return false;
+  }
+  *dataLength = RN4020_hexDecode(data, dataStringPtr, dataStringLength);
+  return *dataLength >= 0;
+}
+
+void _RN4020_processRemoteReadLine(RN4020* rn4020, const char* line, uint16_t lineLength) {
+  RN4020_RemoteValue* result = rn4020->commandQueue[rn4020->commandQueueHead].result;
+  const char* dataStringPtr = line + 2;
+  uint16_t dataStringLength = lineLength - 2;
+  if (dataStringLength > 0 && dataStringPtr[dataStringLength - 1] == '.') {
+    dataStringLength--;
+  }
+  if (dataStringLength > RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH * 2) {
+    RN4020_DEBUG_OUT("remote value too long\n");
+    rn4020->commandStatus = HAL_ERROR;
+  } else if (result != NULL) {
+    int32_t dataLength = RN4020_hexDecode(result->data, dataStringPtr, dataStringLength);
+    if (dataLength < 0) {
+      rn4020->commandStatus = HAL_ERROR;
+    } else {
+      result->dataLength = dataLength;
+    }
+  }
+  _RN4020_setState(rn4020, RN4020_STATE_READY);
+}
 
-  const char* startOfUUIDPtr = line + 2;
-  const char* firstCommaPtr = strchr(startOfUUIDPtr, ',');
-  _RN4020_parseUUIDString(startOfUUIDPtr, firstCommaPtr - startOfUUIDPtr, handleLookupItem->characteristicUUID, &handleLookupItem->characteristicUUIDLength);
-
-  char handleStr[5];
-  strncpy(handleStr, firstCommaPtr + 1, 4);
-  handleStr[4] = 0;
-  handleLookupItem->handle = strtol(handleStr, NULL, 16);
+void _RN4020_processLCLine(RN4020* rn4020, RN4020_LineType lineType, const char* line, uint16_t lineLength) {
+  RN4020_RemoteGatt* remote = rn4020->commandQueue[rn4020->commandQueueHead].result;
+  if (lineType == RN4020_LINE_END) {
+    remote->discovered = !remote->overflow;
+    if (remote->overflow) {
+      rn4020->commandStatus = HAL_ERROR;
+    }
+    _RN4020_setState(rn4020, RN4020_STATE_READY);
+  } else if (lineType == RN4020_LINE_LS_CHARACTERISTIC) {
+    RN4020_handleLookupItem item;
+    if (!_RN4020_parseHandleUUIDLine(line, lineLength, &item)) {
+      RN4020_DEBUG_OUT("invalid LC line: %.*s\n", lineLength, line);
+    } else if (remote->length >= RN4020_REMOTE_LOOKUP_TABLE_SIZE) {
+      RN4020_DEBUG_OUT("remote lookup table full, increase RN4020_REMOTE_LOOKUP_TABLE_SIZE\n");
+      remote->overflow = true;
+    } else {
+      remote->items[remote->length++] = item;
+    }
+  }
+  // service lines carry no handles
+}
 
+bool _RN4020_parseHandleUUIDLine(const char* line, uint16_t lineLength, RN4020_handleLookupItem* handleLookupItem) {
+  const char* startOfUUIDPtr = line + 2;
+  const char* firstCommaPtr = memchr(startOfUUIDPtr, ',', lineLength - 2);
+  if (firstCommaPtr == NULL
+      || firstCommaPtr - startOfUUIDPtr > RN4020_MAX_UUID_LEN_BYTES * 2
+      || (line + lineLength) - (firstCommaPtr + 1) < 4) {
+    return false;
+  }
+  if (!_RN4020_parseUUIDString(startOfUUIDPtr, firstCommaPtr - startOfUUIDPtr, handleLookupItem->characteristicUUID, &handleLookupItem->characteristicUUIDLength)) {
+    return false;
+  }
+  if (!RN4020_hexDecodeU16(firstCommaPtr + 1, &handleLookupItem->handle)) {
+    return false;
+  }
+  const char* propertiesPtr = firstCommaPtr + 6;
+  handleLookupItem->characteristicProperties = 0;
+  handleLookupItem->configurationHandle = 0;
+  handleLookupItem->clientConfiguration = RN4020_CLIENT_CONFIGURATION_NONE;
+  if ((line + lineLength) - propertiesPtr >= 2 && propertiesPtr[-1] == ',') {
+    RN4020_hexDecode(&handleLookupItem->characteristicProperties, propertiesPtr, 2);
+  }
   return true;
 }
 
 void _RN4020_setConnected(RN4020* rn4020, bool connected) {
+  if (connected) {
+    rn4020->stats.connects++;
+  } else {
+    rn4020->stats.disconnects++;
+  }
   rn4020->connected = connected;
+  rn4020->connectionParametersValid = false;
+  const RN4020_ReconnectPolicy* policy = rn4020->reconnectPolicy;
+  if (connected) {
+    rn4020->writeCacheFlushNow = true;
+    if (rn4020->reconnecting) {
+      uint32_t reconnectTime = RN4020_GET_TICK() - rn4020->reconnectStart;
+      rn4020->stats.reconnects++;
+      rn4020->stats.reconnectTimeTotal += reconnectTime;
+      if (reconnectTime > rn4020->stats.reconnectTimeMax) {
+        rn4020->stats.reconnectTimeMax = reconnectTime;
+      }
+      rn4020->reconnecting = false;
+    }
+  } else {
+    if (rn4020->mldp) {
+      _RN4020_leaveMLDP(rn4020);
+    }
+    if (policy == NULL || !policy->keepSubscriptions) {
+      for (uint32_t i = 0; i < rn4020->handleLookupLength; i++) {
+        rn4020->handleLookup[i].clientConfiguration = RN4020_CLIENT_CONFIGURATION_NONE;
+      }
+    }
+    if (policy != NULL) {
+      rn4020->reconnecting = true;
+      rn4020->reconnectAdvertised = false;
+      rn4020->reconnectInterval = policy->fastInterval;
+      rn4020->reconnectStart = RN4020_GET_TICK();
+      _RN4020_processReconnect(rn4020);
+    }
+  }
+  // the central starts every connection with its own parameters
+  rn4020->tunerFast = false;
+  rn4020->tunerWindowStart = RN4020_GET_TICK();
+  rn4020->tunerWindowWrites = rn4020->tunerWrites;
+  rn4020->tunerSeenWrites = rn4020->tunerWindowWrites;
+  rn4020->tunerLastWrite = rn4020->tunerWindowStart;
   RN4020_connectedStateChanged(rn4020, connected);
 }
 
@@ -289,6 +1345,35 @@ __weak void RN4020_onRealTimeRead(RN4020* rn4020, uint16_t characteristicHandle)
   RN4020_DEBUG_OUT("real time read: 0x%04X\n", characteristicHandle);
 }
 
+__weak void RN4020_onMLDPData(RN4020* rn4020, const uint8_t* data, uint16_t dataLength) {
+  RN4020_DEBUG_OUT("mldp rx: %d bytes\n", dataLength);
+}
+
+__weak void RN4020_onMessage(RN4020* rn4020, RN4020_MessageChannel* channel, uint8_t* data, uint16_t dataLength) {
+  RN4020_DEBUG_OUT("message: %d bytes\n", dataLength);
+}
+
+__weak void RN4020_onMessageSent(RN4020* rn4020, RN4020_MessageChannel* channel, HAL_StatusTypeDef status) {
+  RN4020_DEBUG_OUT("message sent: %d\n", status);
+}
+
+__weak void RN4020_onMessageError(RN4020* rn4020, RN4020_MessageChannel* channel, RN4020_MessageError error) {
+  RN4020_DEBUG_OUT("message dropped: %d\n", error);
+}
+
+__weak void RN4020_onScanReport(RN4020* rn4020, const RN4020_ScanEntry* entry, const char* payload, uint16_t payloadLength) {
+  RN4020_DEBUG_OUT("onScanReport %02X%02X%02X%02X%02X%02X rssi %d\n",
+                   entry->mac[0], entry->mac[1], entry->mac[2], entry->mac[3], entry->mac[4], entry->mac[5], entry->rssi);
+}
+
+__weak void RN4020_onRemoteNotify(RN4020* rn4020, uint16_t characteristicHandle, uint8_t* data, uint8_t dataLength, bool indication) {
+  RN4020_DEBUG_OUT("onRemoteNotify 0x%04x (%d bytes)\n", characteristicHandle, dataLength);
+}
+
+__weak void RN4020_onConnectionParameters(RN4020* rn4020, const RN4020_ConnectionParameters* parameters) {
+  RN4020_DEBUG_OUT("onConnectionParameters interval %d latency %d timeout %d\n", parameters->interval, parameters->latency, parameters->timeout);
+}
+
 __weak void RN4020_onWrite(RN4020* rn4020, uint16_t characteristicHandle, uint8_t* data, uint8_t dataLength) {
 #ifdef RN4020_DEBUG
   RN4020_DEBUG_OUT("write: 0x%04X: ", characteristicHandle);
@@ -300,26 +1385,28 @@ __weak void RN4020_onWrite(RN4020* rn4020, uint16_t characteristicHandle, uint8_
 }
 
 HAL_StatusTypeDef _RN4020_runAOKCommand(RN4020* rn4020, const char* cmd) {
-  _RN4020_setState(rn4020, RN4020_STATE_WAITING_FOR_AOK);
-  RN4020_send(rn4020, cmd);
-  return _RN4020_waitForReadyState(rn4020);
+  return _RN4020_runCommand(rn4020, cmd, RN4020_STATE_WAITING_FOR_AOK, 0);
 }
 
-HAL_StatusTypeDef _RN4020_waitForReadyState(RN4020* rn4020) {
-  if (rn4020->state == RN4020_STATE_READY) {
-    return HAL_OK;
+// timeout 0 uses the default for waitState
+HAL_StatusTypeDef _RN4020_runCommand(RN4020* rn4020, const char* cmd, RN4020_State waitState, uint32_t timeout) {
+  RN4020_CommandToken token;
+  uint32_t cmdLength = strlen(cmd);
+  if (cmdLength > RN4020_MAX_COMMAND_LENGTH - 2) {
+    return HAL_ERROR;
   }
-
-  uint32_t startTime = HAL_GetTick();
-  while (1) {
-    if (rn4020->state == RN4020_STATE_READY) {
-      return HAL_OK;
-    }
-    if ((HAL_GetTick() - startTime) > RN4020_TIMEOUT) {
-      return HAL_TIMEOUT;
-    }
-    RN4020_tick(rn4020);
+  returnNonOKHALStatus(_RN4020_waitForQueueSpace(rn4020));
+  RN4020_Command* command = _RN4020_allocCommand(rn4020, waitState);
+  if (command == NULL) {
+    return HAL_BUSY;
+  }
+  if (timeout != 0) {
+    command->timeout = timeout;
   }
+  memcpy(command->line, cmd, cmdLength);
+  command->lineLength = cmdLength;
+  _RN4020_commitCommand(rn4020, command, NULL, NULL, &token);
+  return RN4020_waitForCommand(rn4020, token);
 }
 
 void _RN4020_setState(RN4020* rn4020, RN4020_State newState) {
@@ -343,28 +1430,68 @@ void _RN4020_setState(RN4020* rn4020, RN4020_State newState) {
   case RN4020_STATE_WAITING_FOR_LS:
     RN4020_DEBUG_OUT("state: WAITING_FOR_LS\n");
     break;
+  case RN4020_STATE_WAITING_FOR_MLDP:
+    RN4020_DEBUG_OUT("state: WAITING_FOR_MLDP\n");
+    break;
+  case RN4020_STATE_WAITING_FOR_VALUE:
+    RN4020_DEBUG_OUT("state: WAITING_FOR_VALUE\n");
+    break;
+  case RN4020_STATE_WAITING_FOR_LC:
+    RN4020_DEBUG_OUT("state: WAITING_FOR_LC\n");
+    break;
+  case RN4020_STATE_WAITING_FOR_READ:
+    RN4020_DEBUG_OUT("state: WAITING_FOR_READ\n");
+    break;
   }
 #endif
   rn4020->state = newState;
 }
 
-void _RN4020_parseUUIDString(const char* str, uint8_t strLen, uint8_t* uuid, uint8_t* uuidLen) {
-  char temp[3];
-  uint8_t strIndex, destIndex;
-  for (strIndex = 0, destIndex = 0; strIndex < strLen; strIndex += 2) {
-    temp[0] = str[strIndex];
-    temp[1] = str[strIndex + 1];
-    temp[2] = '\0';
-    uuid[destIndex++] = strtol(temp, NULL, 16);
+bool _RN4020_parseUUIDString(const char* str, uint8_t strLen, uint8_t* uuid, uint8_t* uuidLen) {
+  int32_t length = RN4020_hexDecode(uuid, str, strLen);
+  if (length < 0) {
+    return false;
   }
-  *uuidLen = destIndex;
+  *uuidLen = length;
+  return true;
 }
 
 void RN4020_send(RN4020* rn4020, const char* line) {
-  char newLineCh = '\n';
+  uint32_t lineLength = strlen(line);
   RN4020_DEBUG_OUT("tx: %s\n", line);
-  HAL_UART_Transmit(rn4020->uart, (uint8_t*)line, strlen(line), RN4020_TIMEOUT);
-  HAL_UART_Transmit(rn4020->uart, (uint8_t*)&newLineCh, 1, RN4020_TIMEOUT);
+  if (lineLength > sizeof(rn4020->txBuffer) - 1) {
+    RN4020_DEBUG_OUT("tx line too long\n");
+    return;
+  }
+  // the staging buffer may still be in use by the previous transfer
+  uint32_t startTime = RN4020_GET_TICK();
+  while (_RN4020_isTxBusy(rn4020)) {
+    if ((RN4020_GET_TICK() - startTime) > RN4020_TIMEOUT) {
+      return;
+    }
+  }
+  memcpy(rn4020->txBuffer, line, lineLength);
+  rn4020->txBuffer[lineLength++] = '\n';
+  _RN4020_transmit(rn4020, rn4020->txBuffer, lineLength);
+}
+
+bool _RN4020_isTxBusy(RN4020* rn4020) {
+  return (HAL_UART_GetState(rn4020->uart) & HAL_UART_STATE_BUSY_TX) == HAL_UART_STATE_BUSY_TX;
+}
+
+HAL_StatusTypeDef _RN4020_transmit(RN4020* rn4020, const uint8_t* data, uint16_t length) {
+  uint32_t startTime = RN4020_GET_TICK();
+  HAL_StatusTypeDef status;
+  while ((status = HAL_UART_Transmit_DMA(rn4020->uart, (uint8_t*)data, length)) == HAL_BUSY) {
+    if ((RN4020_GET_TICK() - startTime) > RN4020_TIMEOUT) {
+      return HAL_TIMEOUT;
+    }
+  }
+  if (status == HAL_OK) {
+    rn4020->stats.bytesTx += length;
+    _RN4020_TRACE(rn4020, RN4020_TRACE_TX, data, length);
+  }
+  return status;
 }
 
 HAL_StatusTypeDef RN4020_writeServerPublicCharacteristic(RN4020* rn4020, uint16_t uuid, const uint8_t* data, uint32_t dataLength) {
@@ -378,54 +1505,1483 @@ HAL_StatusTypeDef RN4020_writeServerPrivateCharacteristic(RN4020* rn4020, const
   return _RN4020_writeServerCharacteristic(rn4020, uuid, RN4020_PRIVATE_UUID_LENGTH_BYTES, data, dataLength);
 }
 
+HAL_StatusTypeDef RN4020_writeServerPrivateCharacteristicAsync(
+  RN4020* rn4020,
+  const uint8_t* uuid,
+  const uint8_t* data,
+  uint32_t dataLength,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+) {
+  return _RN4020_writeServerCharacteristicAsync(rn4020, uuid, RN4020_PRIVATE_UUID_LENGTH_BYTES, data, dataLength, callback, userData, token);
+}
+
 HAL_StatusTypeDef _RN4020_writeServerCharacteristic(RN4020* rn4020, const uint8_t* uuid, uint8_t uuidLen, const uint8_t* data, uint32_t dataLength) {
-  char newLineCh = '\n';
-  char uuidStr[RN4020_PRIVATE_UUID_HEX_STRING_LENGTH + 1];
-  char line[20];
-  RN4020_uuidToString(uuidStr, uuid, uuidLen);
-#ifdef RN4020_DEBUG
-  RN4020_DEBUG_OUT("tx: SUW,%s,", uuidStr);
-  for (int i = 0; i < dataLength; i++) {
-    printf("%02X", data[i]);
+  RN4020_CommandToken token;
+  returnNonOKHALStatus(_RN4020_waitForQueueSpace(rn4020));
+  returnNonOKHALStatus(_RN4020_writeServerCharacteristicAsync(rn4020, uuid, uuidLen, data, dataLength, NULL, NULL, &token));
+  return RN4020_waitForCommand(rn4020, token);
+}
+
+HAL_StatusTypeDef _RN4020_writeServerCharacteristicAsync(
+  RN4020* rn4020,
+  const uint8_t* uuid,
+  uint8_t uuidLen,
+  const uint8_t* data,
+  uint32_t dataLength,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+) {
+  RN4020_handleLookupItem* item = RN4020_lookupUUID(rn4020, uuid, uuidLen);
+  if (item != NULL) {
+    return RN4020_writeServerCharacteristicHandleAsync(rn4020, item->handle, data, dataLength, callback, userData, token);
   }
-  printf("\n");
-#endif
-  _RN4020_setState(rn4020, RN4020_STATE_WAITING_FOR_AOK);
-  sprintf(line, "SUW,");
-  HAL_UART_Transmit(rn4020->uart, (uint8_t*)line, strlen(line), RN4020_TIMEOUT);
-  HAL_UART_Transmit(rn4020->uart, (uint8_t*)uuidStr, strlen(uuidStr), RN4020_TIMEOUT);
-  strcpy(line, ",");
-  HAL_UART_Transmit(rn4020->uart, (uint8_t*)line, strlen(line), RN4020_TIMEOUT);
-  for (uint32_t i = 0; i < dataLength; i++) {
-    sprintf(line, "%02X", data[i]);
-    HAL_UART_Transmit(rn4020->uart, (uint8_t*)line, 2, RN4020_TIMEOUT);
+
+  if (dataLength > RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH) {
+    return HAL_ERROR;
+  }
+  RN4020_Command* command = _RN4020_allocCommand(rn4020, RN4020_STATE_WAITING_FOR_AOK);
+  if (command == NULL) {
+    return HAL_BUSY;
   }
-  HAL_UART_Transmit(rn4020->uart, (uint8_t*)&newLineCh, 1, RN4020_TIMEOUT);
-  return _RN4020_waitForReadyState(rn4020);
+  char* dest = command->line;
+  memcpy(dest, "SUW,", 4);
+  dest = RN4020_hexEncode(dest + 4, uuid, uuidLen);
+  *dest++ = ',';
+  dest = RN4020_hexEncode(dest, data, dataLength);
+  command->lineLength = dest - command->line;
+  _RN4020_commitCommand(rn4020, command, callback, userData, token);
+  return HAL_OK;
 }
 
 HAL_StatusTypeDef RN4020_writeServerCharacteristicHandle(RN4020* rn4020, uint16_t handle, const uint8_t* data, uint32_t dataLength) {
-  char newLineCh = '\n';
-  char line[20];
-#ifdef RN4020_DEBUG
-  RN4020_DEBUG_OUT("tx: SHW,%04X,", handle);
-  for (int i = 0; i < dataLength; i++) {
-    printf("%02X", data[i]);
+  RN4020_CommandToken token;
+  returnNonOKHALStatus(_RN4020_waitForQueueSpace(rn4020));
+  returnNonOKHALStatus(RN4020_writeServerCharacteristicHandleAsync(rn4020, handle, data, dataLength, NULL, NULL, &token));
+  return RN4020_waitForCommand(rn4020, token);
+}
+
+HAL_StatusTypeDef RN4020_writeServerCharacteristicHandleAsync(
+  RN4020* rn4020,
+  uint16_t handle,
+  const uint8_t* data,
+  uint32_t dataLength,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+) {
+  if (dataLength > RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH) {
+    return HAL_ERROR;
   }
-  printf("\n");
-#endif
+  RN4020_Command* command = _RN4020_allocCommand(rn4020, RN4020_STATE_WAITING_FOR_AOK);
+  if (command == NULL) {
+    return HAL_BUSY;
+  }
+  if (!_RN4020_isListenedTo(rn4020, handle)
+      && RN4020_writeServerCharacteristicHandleDeferred(rn4020, handle, data, dataLength) == HAL_OK) {
+    // nobody would hear it, the write cache sends the value on connect or subscribe. The token completes in queue
+    // order without anything being sent
+    command->waitState = RN4020_STATE_READY;
+    _RN4020_commitCommand(rn4020, command, callback, userData, token);
+    return HAL_OK;
+  }
+  char* dest = command->line;
+  memcpy(dest, "SHW,", 4);
+  dest = RN4020_hexEncodeU16(dest + 4, handle);
+  *dest++ = ',';
+  dest = RN4020_hexEncode(dest, data, dataLength);
+  command->lineLength = dest - command->line;
+  _RN4020_commitCommand(rn4020, command, callback, userData, token);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef RN4020_writeServerCharacteristicHandleDeferred(RN4020* rn4020, uint16_t handle, const uint8_t* data, uint32_t dataLength) {
+  if (dataLength > RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH) {
+    return HAL_ERROR;
+  }
+
+  RN4020_WriteCacheItem* item = NULL;
+  for (int i = 0; i < rn4020->writeCacheLength; i++) {
+    if (rn4020->writeCache[i].handle == handle) {
+      item = &rn4020->writeCache[i];
+      break;
+    }
+  }
+  if (item == NULL) {
+    if (rn4020->writeCacheLength >= RN4020_WRITE_CACHE_SIZE) {
+      return HAL_BUSY;
+    }
+    item = &rn4020->writeCache[rn4020->writeCacheLength++];
+    item->handle = handle;
+    item->pending = false;
+  }
+
+  if (item->pending) {
+    rn4020->stats.writesCoalesced++;
+  }
+  if (!_RN4020_isListenedTo(rn4020, handle)) {
+    rn4020->stats.writesSuppressed++;
+  }
+  memcpy(item->data, data, dataLength);
+  item->dataLength = dataLength;
+  item->pending = true;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef RN4020_writeServerPrivateCharacteristicDeferred(RN4020* rn4020, const uint8_t* uuid, const uint8_t* data, uint32_t dataLength) {
+  RN4020_handleLookupItem* item = RN4020_lookupUUID(rn4020, uuid, RN4020_PRIVATE_UUID_LENGTH_BYTES);
+  if (item == NULL) {
+    RN4020_DEBUG_OUT("deferred write to unknown uuid, call RN4020_refreshHandleLookup first\n");
+    return HAL_ERROR;
+  }
+  return RN4020_writeServerCharacteristicHandleDeferred(rn4020, item->handle, data, dataLength);
+}
+
+void RN4020_setWriteCacheFlushInterval(RN4020* rn4020, uint32_t interval) {
+  rn4020->writeCacheFlushInterval = interval;
+}
+
+HAL_StatusTypeDef RN4020_flushWriteCache(RN4020* rn4020) {
+  for (int i = 0; i < rn4020->writeCacheLength; i++) {
+    RN4020_WriteCacheItem* item = &rn4020->writeCache[i];
+    if (item->pending && _RN4020_isListenedTo(rn4020, item->handle)) {
+      // cleared while the write is in flight so RN4020_tick does not send it again, a newer value sets it again
+      item->pending = false;
+      HAL_StatusTypeDef status = RN4020_writeServerCharacteristicHandle(rn4020, item->handle, item->data, item->dataLength);
+      _RN4020_writeCacheDone(rn4020, item, status);
+      returnNonOKHALStatus(status);
+    }
+  }
+  rn4020->writeCacheLastFlush = RN4020_GET_TICK();
+  return HAL_OK;
+}
+
+void RN4020_getWriteCacheStats(RN4020* rn4020, uint32_t* writesCoalesced, uint32_t* writesSent) {
+  *writesCoalesced = rn4020->stats.writesCoalesced;
+  *writesSent = rn4020->stats.writesSent;
+}
+
+int8_t _RN4020_findReadCacheItem(RN4020* rn4020, uint16_t handle) {
+  for (int8_t i = 0; i < rn4020->readCacheLength; i++) {
+    if (rn4020->readCache[i].handle == handle) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+HAL_StatusTypeDef RN4020_setReadValue(RN4020* rn4020, uint16_t handle, const uint8_t* data, uint32_t dataLength) {
+  if (dataLength > RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH) {
+    return HAL_ERROR;
+  }
+  int8_t index = _RN4020_findReadCacheItem(rn4020, handle);
+  if (index < 0) {
+    if (rn4020->readCacheLength >= RN4020_READ_CACHE_SIZE) {
+      return HAL_BUSY;
+    }
+    index = rn4020->readCacheLength++;
+    rn4020->readCache[index].handle = handle;
+    rn4020->readCache[index].dirty = false;
+  }
+
+  RN4020_ReadCacheItem* item = &rn4020->readCache[index];
+  if (rn4020->readResponseInFlight == index) {
+    // the line may be going out over DMA right now, it is re-encoded once the module has answered it
+    memcpy(item->value, data, dataLength);
+    item->valueLength = dataLength;
+    item->dirty = true;
+    return HAL_OK;
+  }
+  _RN4020_encodeReadValue(item, data, dataLength);
+  return HAL_OK;
+}
+
+void _RN4020_encodeReadValue(RN4020_ReadCacheItem* item, const uint8_t* data, uint32_t dataLength) {
+  char* dest = item->line;
+  memcpy(dest, "SHW,", 4);
+  dest = RN4020_hexEncodeU16(dest + 4, item->handle);
+  *dest++ = ',';
+  dest = RN4020_hexEncode(dest, data, dataLength);
+  *dest++ = '\n';
+  item->lineLength = dest - item->line;
+  item->dirty = false;
+}
+
+void _RN4020_finishReadResponse(RN4020* rn4020) {
+  RN4020_ReadCacheItem* item = &rn4020->readCache[rn4020->readResponseInFlight];
+  rn4020->readResponseInFlight = -1;
+  if (item->dirty) {
+    _RN4020_encodeReadValue(item, item->value, item->valueLength);
+  }
+}
+
+void _RN4020_dispatchReadResponse(RN4020* rn4020) {
+  int8_t index = 0;
+  while ((rn4020->readResponsesPending & (1u << index)) == 0) {
+    index++;
+  }
+  rn4020->readResponsesPending &= ~(1u << index);
+
+  RN4020_ReadCacheItem* item = &rn4020->readCache[index];
+  rn4020->readResponseInFlight = index;
+  rn4020->commandInFlight = true;
+  rn4020->commandStatus = HAL_OK;
+  rn4020->commandStartTime = RN4020_GET_TICK();
   _RN4020_setState(rn4020, RN4020_STATE_WAITING_FOR_AOK);
-  sprintf(line, "SHW,%04X,", handle);
-  HAL_UART_Transmit(rn4020->uart, (uint8_t*)line, strlen(line), RN4020_TIMEOUT);
-  for (uint32_t i = 0; i < dataLength; i++) {
-    sprintf(line, "%02X", data[i]);
-    HAL_UART_Transmit(rn4020->uart, (uint8_t*)line, 2, RN4020_TIMEOUT);
+  RN4020_DEBUG_OUT("tx: %.*s", item->lineLength, item->line);
+  if (_RN4020_transmit(rn4020, (const uint8_t*)item->line, item->lineLength) != HAL_OK) {
+    rn4020->stats.commandErrors++;
+    _RN4020_finishReadResponse(rn4020);
+    rn4020->commandInFlight = false;
+    _RN4020_setState(rn4020, RN4020_STATE_READY);
   }
-  HAL_UART_Transmit(rn4020->uart, (uint8_t*)&newLineCh, 1, RN4020_TIMEOUT);
-  return _RN4020_waitForReadyState(rn4020);
 }
 
-HAL_StatusTypeDef RN4020_battery_setLevel(RN4020* rn4020, uint8_t level) {
-  return RN4020_writeServerPublicCharacteristic(rn4020, RN4020_BATTERY_LEVEL_UUID, &level, 1);
+void _RN4020_processWriteCache(RN4020* rn4020) {
+  if (rn4020->powerState != RN4020_POWER_AWAKE) {
+    return; // held for the next wake window
+  }
+  // an idle link takes pending values at once, the interval bounds how long they wait behind other commands
+  if (!RN4020_isIdle(rn4020) && !rn4020->writeCacheFlushNow
+      && (rn4020->writeCacheFlushInterval == 0
+          || (RN4020_GET_TICK() - rn4020->writeCacheLastFlush) < rn4020->writeCacheFlushInterval)) {
+    return;
+  }
+
+  bool flushed = false;
+  bool flushNow = rn4020->writeCacheFlushNow;
+  rn4020->writeCacheFlushNow = false;
+  for (int i = 0; i < rn4020->writeCacheLength; i++) {
+    RN4020_WriteCacheItem* item = &rn4020->writeCache[i];
+    if (!item->pending || !_RN4020_isListenedTo(rn4020, item->handle)) {
+      continue;
+    }
+    if (RN4020_writeServerCharacteristicHandleAsync(rn4020, item->handle, item->data, item->dataLength, _RN4020_writeCacheCallback, item, NULL) == HAL_BUSY) {
+      rn4020->writeCacheFlushNow = flushNow;
+      break;
+    }
+    item->pending = false;
+    flushed = true;
+  }
+  if (flushed) {
+    rn4020->writeCacheLastFlush = RN4020_GET_TICK();
+  }
+}
+
+void _RN4020_writeCacheCallback(RN4020* rn4020, RN4020_CommandToken token, HAL_StatusTypeDef status, void* userData) {
+  _RN4020_writeCacheDone(rn4020, (RN4020_WriteCacheItem*)userData, status);
+}
+
+void _RN4020_writeCacheDone(RN4020* rn4020, RN4020_WriteCacheItem* item, HAL_StatusTypeDef status) {
+  if (status == HAL_OK) {
+    rn4020->stats.writesSent++;
+  } else {
+    // sent again with the next flush, unless a newer value has already replaced it
+    item->pending = true;
+  }
+}
+
+HAL_StatusTypeDef RN4020_enterMLDP(RN4020* rn4020) {
+  if (rn4020->mldp) {
+    return HAL_OK;
+  }
+  if (rn4020->cmdMldpPort != NULL) {
+    HAL_GPIO_WritePin(rn4020->cmdMldpPort, rn4020->cmdMldpPin, GPIO_PIN_SET);
+  }
+  return _RN4020_runCommand(rn4020, "I", RN4020_STATE_WAITING_FOR_MLDP, 0);
+}
+
+HAL_StatusTypeDef RN4020_exitMLDP(RN4020* rn4020) {
+  if (!rn4020->mldp) {
+    return HAL_OK;
+  }
+  if (rn4020->cmdMldpPort == NULL) {
+    return HAL_ERROR;
+  }
+
+  // let queued payload drain before switching the module back to command mode
+  uint32_t startTime = RN4020_GET_TICK();
+  while (rn4020->mldpTxHead != rn4020->mldpTxTail || rn4020->mldpTxInFlight > 0) {
+    if ((RN4020_GET_TICK() - startTime) > RN4020_TIMEOUT) {
+      return HAL_TIMEOUT;
+    }
+    RN4020_tick(rn4020);
+  }
+
+  // commands are refused while in MLDP mode, the queue can only be full of ones held from before
+  if (rn4020->commandQueueLength >= RN4020_COMMAND_QUEUE_SIZE) {
+    return HAL_BUSY;
+  }
+  RN4020_CommandToken token;
+  rn4020->mldp = false;
+  rn4020->rxScanned = 0;
+  RN4020_Command* command = _RN4020_allocCommand(rn4020, RN4020_STATE_WAITING_FOR_CMD);
+  _RN4020_commitCommand(rn4020, command, NULL, NULL, &token);
+  HAL_GPIO_WritePin(rn4020->cmdMldpPort, rn4020->cmdMldpPin, GPIO_PIN_RESET);
+  return RN4020_waitForCommand(rn4020, token);
+}
+
+bool RN4020_isMLDP(RN4020* rn4020) {
+  return rn4020->mldp;
+}
+
+uint32_t RN4020_mldpTxFree(RN4020* rn4020) {
+  uint16_t used = (rn4020->mldpTxHead + RN4020_MLDP_TX_BUFFER_SIZE - rn4020->mldpTxTail) % RN4020_MLDP_TX_BUFFER_SIZE;
+  return RN4020_MLDP_TX_BUFFER_SIZE - 1 - used;
+}
+
+uint32_t RN4020_mldpWrite(RN4020* rn4020, const uint8_t* data, uint32_t dataLength) {
+  uint32_t length = RN4020_mldpTxFree(rn4020);
+  if (dataLength < length) {
+    length = dataLength;
+  }
+  uint16_t firstLength = RN4020_MLDP_TX_BUFFER_SIZE - rn4020->mldpTxHead;
+  if (firstLength > length) {
+    firstLength = length;
+  }
+  memcpy(rn4020->mldpTxBuffer + rn4020->mldpTxHead, data, firstLength);
+  memcpy(rn4020->mldpTxBuffer, data + firstLength, length - firstLength);
+  rn4020->mldpTxHead = (rn4020->mldpTxHead + length) % RN4020_MLDP_TX_BUFFER_SIZE;
+  _RN4020_processMLDPTx(rn4020);
+  return length;
+}
+
+void _RN4020_processMLDPTx(RN4020* rn4020) {
+  if (_RN4020_isTxBusy(rn4020)) {
+    return;
+  }
+  if (rn4020->mldpTxInFlight > 0) {
+    rn4020->mldpTxTail = (rn4020->mldpTxTail + rn4020->mldpTxInFlight) % RN4020_MLDP_TX_BUFFER_SIZE;
+    rn4020->mldpTxInFlight = 0;
+  }
+  if (!rn4020->mldp || rn4020->mldpTxHead == rn4020->mldpTxTail) {
+    return;
+  }
+
+  // send the contiguous run up to the end of the buffer, the wrapped part goes out with the next transfer
+  uint16_t length = (rn4020->mldpTxHead > rn4020->mldpTxTail)
+                    ? rn4020->mldpTxHead - rn4020->mldpTxTail
+                    : RN4020_MLDP_TX_BUFFER_SIZE - rn4020->mldpTxTail;
+  if (HAL_UART_Transmit_DMA(rn4020->uart, rn4020->mldpTxBuffer + rn4020->mldpTxTail, length) == HAL_OK) {
+    rn4020->mldpTxInFlight = length;
+    rn4020->stats.bytesTx += length;
+    _RN4020_TRACE(rn4020, RN4020_TRACE_TX, rn4020->mldpTxBuffer + rn4020->mldpTxTail, length);
+  }
+}
+
+void _RN4020_processMLDPRx(RN4020* rn4020) {
+  RingBufferDmaU8* ring = &rn4020->rxRing;
+  uint16_t available = RingBufferDmaU8_available(ring);
+  if (available > rn4020->stats.rxHighWatermark) {
+    rn4020->stats.rxHighWatermark = available;
+  }
+  if (available == 0) {
+    return;
+  }
+
+  uint16_t tailIndex = ring->tailPtr - ring->buffer;
+  uint16_t firstLength = ring->size - tailIndex;
+  if (firstLength > available) {
+    firstLength = available;
+  }
+  // consume before dispatching so the callback may call back into RN4020_tick
+  ring->tailPtr = ring->buffer + ((tailIndex + available) % ring->size);
+  rn4020->stats.bytesRx += available;
+  bool connectionEnded = _RN4020_scanMLDPStatus(rn4020, ring->buffer + tailIndex, firstLength);
+  _RN4020_TRACE(rn4020, RN4020_TRACE_MLDP_RX, ring->buffer + tailIndex, firstLength);
+  RN4020_onMLDPData(rn4020, ring->buffer + tailIndex, firstLength);
+  if (available > firstLength) {
+    connectionEnded |= _RN4020_scanMLDPStatus(rn4020, ring->buffer, available - firstLength);
+    _RN4020_TRACE(rn4020, RN4020_TRACE_MLDP_RX, ring->buffer, available - firstLength);
+    RN4020_onMLDPData(rn4020, ring->buffer, available - firstLength);
+  }
+  if (connectionEnded && rn4020->mldp) {
+    _RN4020_setConnected(rn4020, false);
+  }
+}
+
+// true once the whole Connection End status has gone by, it may be split across reads
+bool _RN4020_scanMLDPStatus(RN4020* rn4020, const uint8_t* data, uint16_t length) {
+  bool found = false;
+  for (uint16_t i = 0; i < length; i++) {
+    if (data[i] == _RN4020_MLDP_CONNECTION_END[rn4020->mldpStatusMatched]) {
+      rn4020->mldpStatusMatched++;
+      if (rn4020->mldpStatusMatched == sizeof(_RN4020_MLDP_CONNECTION_END) - 1) {
+        rn4020->mldpStatusMatched = 0;
+        found = true;
+      }
+    } else {
+      rn4020->mldpStatusMatched = data[i] == _RN4020_MLDP_CONNECTION_END[0] ? 1 : 0;
+    }
+  }
+  return found;
+}
+
+// the module is back in command mode once the link is gone, unsent payload is dropped
+void _RN4020_leaveMLDP(RN4020* rn4020) {
+  rn4020->mldp = false;
+  rn4020->rxScanned = 0;
+  rn4020->mldpTxHead = (rn4020->mldpTxTail + rn4020->mldpTxInFlight) % RN4020_MLDP_TX_BUFFER_SIZE;
+  if (rn4020->cmdMldpPort != NULL) {
+    HAL_GPIO_WritePin(rn4020->cmdMldpPort, rn4020->cmdMldpPin, GPIO_PIN_RESET);
+  }
+}
+
+void RN4020_openMessageChannel(
+  RN4020* rn4020,
+  RN4020_MessageChannel* channel,
+  uint16_t txHandle,
+  uint16_t rxHandle,
+  uint8_t* rxBuffer,
+  uint16_t rxBufferSize
+) {
+  memset(channel, 0, sizeof(RN4020_MessageChannel));
+  channel->txHandle = txHandle;
+  channel->rxHandle = rxHandle;
+  channel->rxBuffer = rxBuffer;
+  channel->rxBufferSize = rxBufferSize;
+  rn4020->messageChannel = channel;
+}
+
+void RN4020_closeMessageChannel(RN4020* rn4020) {
+  rn4020->messageChannel = NULL;
+}
+
+HAL_StatusTypeDef RN4020_sendMessage(RN4020* rn4020, const uint8_t* data, uint16_t dataLength) {
+  RN4020_MessageChannel* channel = rn4020->messageChannel;
+  if (channel == NULL) {
+    return HAL_ERROR;
+  }
+  if (channel->txBusy) {
+    return HAL_BUSY;
+  }
+  channel->txBusy = true;
+  channel->txData = data;
+  channel->txLength = dataLength;
+  channel->txOffset = 0;
+  channel->txChunks = 0;
+  channel->txStatus = HAL_OK;
+  _RN4020_processMessageTx(rn4020);
+  return HAL_OK;
 }
 
+bool RN4020_isMessageSending(RN4020* rn4020) {
+  return rn4020->messageChannel != NULL && rn4020->messageChannel->txBusy;
+}
+
+void _RN4020_processMessageTx(RN4020* rn4020) {
+  RN4020_MessageChannel* channel = rn4020->messageChannel;
+  if (channel == NULL || !channel->txBusy) {
+    return;
+  }
+  while (channel->txStatus == HAL_OK
+         && channel->txChunksInFlight < RN4020_MESSAGE_PIPELINE_DEPTH
+         && (channel->txChunks == 0 || channel->txOffset < channel->txLength)) {
+    RN4020_Command* command = _RN4020_allocCommand(rn4020, RN4020_STATE_WAITING_FOR_AOK);
+    if (command == NULL) {
+      return;
+    }
+    uint8_t header[3];
+    uint8_t headerLength = 1;
+    header[0] = channel->txChunks & RN4020_MESSAGE_SEQUENCE;
+    if (channel->txChunks == 0) {
+      header[0] |= RN4020_MESSAGE_START;
+      header[1] = channel->txLength & 0xff;
+      header[2] = channel->txLength >> 8;
+      headerLength = 3;
+    }
+    uint16_t length = channel->txLength - channel->txOffset;
+    if (length > RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH - headerLength) {
+      length = RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH - headerLength;
+    }
+    if (channel->txOffset + length == channel->txLength) {
+      header[0] |= RN4020_MESSAGE_END;
+    }
+
+    // the payload is hex encoded straight from the caller's buffer into the queued SHW line
+    char* dest = command->line;
+    memcpy(dest, "SHW,", 4);
+    dest = RN4020_hexEncodeU16(dest + 4, channel->txHandle);
+    *dest++ = ',';
+    dest = RN4020_hexEncode(dest, header, headerLength);
+    dest = RN4020_hexEncode(dest, channel->txData + channel->txOffset, length);
+    command->lineLength = dest - command->line;
+    _RN4020_commitCommand(rn4020, command, _RN4020_messageChunkDone, channel, NULL);
+
+    channel->txOffset += length;
+    channel->txChunks++;
+    channel->txChunksInFlight++;
+  }
+}
+
+void _RN4020_messageChunkDone(RN4020* rn4020, RN4020_CommandToken token, HAL_StatusTypeDef status, void* userData) {
+  RN4020_MessageChannel* channel = userData;
+  channel->txChunksInFlight--;
+  if (status != HAL_OK && channel->txStatus == HAL_OK) {
+    channel->txStatus = status;
+  }
+  if (channel->txChunksInFlight > 0) {
+    return;
+  }
+  if (channel->txStatus != HAL_OK || channel->txOffset >= channel->txLength) {
+    channel->txBusy = false;
+    channel->txData = NULL;
+    RN4020_onMessageSent(rn4020, channel, channel->txStatus);
+  }
+}
+
+void _RN4020_processMessageChunk(RN4020* rn4020, RN4020_MessageChannel* channel, const char* hex, uint16_t hexLength) {
+  if (hexLength > 0 && hex[hexLength - 1] == '.') {
+    hexLength--; // values end with period
+  }
+  uint8_t header[3];
+  if (hexLength < 2 || RN4020_hexDecode(header, hex, 2) != 1) {
+    _RN4020_dropMessage(rn4020, channel, RN4020_MESSAGE_ERROR_FORMAT);
+    return;
+  }
+  if (header[0] & RN4020_MESSAGE_START) {
+    if (hexLength < 6 || RN4020_hexDecode(header + 1, hex + 2, 4) != 2) {
+      _RN4020_dropMessage(rn4020, channel, RN4020_MESSAGE_ERROR_FORMAT);
+      return;
+    }
+    hex += 6;
+    hexLength -= 6;
+    channel->rxActive = true;
+    channel->rxExpected = header[1] | ((uint16_t)header[2] << 8);
+    channel->rxLength = 0;
+    channel->rxSequence = 0;
+    if (channel->rxExpected > channel->rxBufferSize) {
+      _RN4020_dropMessage(rn4020, channel, RN4020_MESSAGE_ERROR_OVERFLOW);
+      return;
+    }
+  } else {
+    hex += 2;
+    hexLength -= 2;
+  }
+  if (!channel->rxActive || (header[0] & RN4020_MESSAGE_SEQUENCE) != (channel->rxSequence & RN4020_MESSAGE_SEQUENCE)) {
+    _RN4020_dropMessage(rn4020, channel, RN4020_MESSAGE_ERROR_SEQUENCE);
+    return;
+  }
+  channel->rxSequence++;
+
+  // chunks are decoded in place, rxBuffer is the only copy of the message
+  uint16_t length = hexLength / 2;
+  if (channel->rxLength + length > channel->rxExpected) {
+    _RN4020_dropMessage(rn4020, channel, RN4020_MESSAGE_ERROR_LENGTH);
+    return;
+  }
+  if (RN4020_hexDecode(channel->rxBuffer + channel->rxLength, hex, hexLength) < 0) {
+    _RN4020_dropMessage(rn4020, channel, RN4020_MESSAGE_ERROR_FORMAT);
+    return;
+  }
+  channel->rxLength += length;
+
+  if (header[0] & RN4020_MESSAGE_END) {
+    channel->rxActive = false;
+    if (channel->rxLength != channel->rxExpected) {
+      RN4020_onMessageError(rn4020, channel, RN4020_MESSAGE_ERROR_LENGTH);
+      return;
+    }
+    RN4020_onMessage(rn4020, channel, channel->rxBuffer, channel->rxLength);
+  }
+}
+
+void _RN4020_dropMessage(RN4020* rn4020, RN4020_MessageChannel* channel, RN4020_MessageError error) {
+  channel->rxActive = false;
+  RN4020_onMessageError(rn4020, channel, error);
+}
+
+HAL_StatusTypeDef RN4020_battery_setLevel(RN4020* rn4020, uint8_t level) {
+  return RN4020_writeServerPublicCharacteristic(rn4020, RN4020_BATTERY_LEVEL_UUID, &level, 1);
+}
+
+
+HAL_StatusTypeDef RN4020_startScan(RN4020* rn4020, uint16_t interval, uint16_t window) {
+  char line[RN4020_MAX_COMMAND_LENGTH];
+  if (interval == 0 && window == 0) {
+    strcpy(line, "F");
+  } else {
+    char* dest = line;
+    memcpy(dest, "F,", 2);
+    dest = RN4020_hexEncodeU16(dest + 2, interval);
+    *dest++ = ',';
+    dest = RN4020_hexEncodeU16(dest, window);
+    *dest = '\0';
+  }
+  // reports can follow AOK in the same RX burst
+  rn4020->scanning = true;
+  HAL_StatusTypeDef status = _RN4020_runAOKCommand(rn4020, line);
+  if (status != HAL_OK) {
+    rn4020->scanning = false;
+  }
+  return status;
+}
+
+HAL_StatusTypeDef RN4020_stopScan(RN4020* rn4020) {
+  returnNonOKHALStatus(_RN4020_runAOKCommand(rn4020, "X"));
+  rn4020->scanning = false;
+  return HAL_OK;
+}
+
+bool RN4020_isScanning(RN4020* rn4020) {
+  return rn4020->scanning;
+}
+
+void RN4020_clearScanCache(RN4020* rn4020) {
+  memset(rn4020->scanCache, 0, sizeof(rn4020->scanCache));
+}
+
+const RN4020_ScanEntry* RN4020_findScanEntry(RN4020* rn4020, const uint8_t* mac) {
+  uint32_t slot = _RN4020_fnv1a(2166136261u, mac, RN4020_MAC_LENGTH_BYTES);
+  for (int i = 0; i < _RN4020_SCAN_CACHE_PROBE; i++, slot++) {
+    RN4020_ScanEntry* entry = &rn4020->scanCache[slot & (RN4020_SCAN_CACHE_SIZE - 1)];
+    if (entry->used && memcmp(entry->mac, mac, RN4020_MAC_LENGTH_BYTES) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+RN4020_ScanEntry* _RN4020_scanCacheSlot(RN4020* rn4020, const uint8_t* mac, uint32_t now) {
+  RN4020_ScanEntry* victim = NULL;
+  uint32_t slot = _RN4020_fnv1a(2166136261u, mac, RN4020_MAC_LENGTH_BYTES);
+  for (int i = 0; i < _RN4020_SCAN_CACHE_PROBE; i++, slot++) {
+    RN4020_ScanEntry* entry = &rn4020->scanCache[slot & (RN4020_SCAN_CACHE_SIZE - 1)];
+    if (!entry->used) {
+      if (victim == NULL || victim->used) {
+        victim = entry;
+      }
+      continue;
+    }
+    if (memcmp(entry->mac, mac, RN4020_MAC_LENGTH_BYTES) == 0) {
+      return entry;
+    }
+    if (victim == NULL || (victim->used && (now - entry->lastSeen) > (now - victim->lastSeen))) {
+      victim = entry;
+    }
+  }
+  victim->used = false;
+  return victim;
+}
+
+bool _RN4020_processScanReport(RN4020* rn4020, const char* line, uint16_t lineLength) {
+  uint8_t mac[RN4020_MAC_LENGTH_BYTES];
+  if (RN4020_hexDecode(mac, line, 12) != RN4020_MAC_LENGTH_BYTES) {
+    return false;
+  }
+  // 0 public, 1 random
+  if (line[13] != '0' && line[13] != '1') {
+    return false;
+  }
+
+  // RSSI is the last field, a signed hex byte such as -4F
+  const char* rssiStr = line + lineLength;
+  while (rssiStr[-1] != ',') {
+    rssiStr--;
+  }
+  const char* payload = line + 15;
+  uint16_t payloadLength = rssiStr > payload ? rssiStr - 1 - payload : 0;
+  bool negative = *rssiStr == '-';
+  if (negative) {
+    rssiStr++;
+  }
+  uint8_t rssiMagnitude;
+  if ((line + lineLength) - rssiStr != 2 || RN4020_hexDecode(&rssiMagnitude, rssiStr, 2) != 1) {
+    return false;
+  }
+  // -80 is the only magnitude above 7F that fits an int8_t
+  if (rssiMagnitude > (negative ? 0x80 : 0x7f)) {
+    return false;
+  }
+  int8_t rssi = negative ? -(int16_t)rssiMagnitude : (int16_t)rssiMagnitude;
+
+  uint32_t now = RN4020_GET_TICK();
+  uint32_t payloadHash = _RN4020_fnv1a(2166136261u, (const uint8_t*)payload, payloadLength);
+  RN4020_ScanEntry* entry = _RN4020_scanCacheSlot(rn4020, mac, now);
+  rn4020->stats.scanReports++;
+
+  bool changed;
+  if (!entry->used || (now - entry->lastSeen) > RN4020_SCAN_EXPIRE_TIME) {
+    entry->used = true;
+    memcpy(entry->mac, mac, RN4020_MAC_LENGTH_BYTES);
+    entry->firstSeen = now;
+    entry->reports = 0;
+    changed = true;
+  } else {
+    int16_t rssiDelta = rssi - entry->reportedRssi;
+    changed = entry->payloadHash != payloadHash
+              || rssiDelta >= RN4020_SCAN_RSSI_THRESHOLD
+              || rssiDelta <= -RN4020_SCAN_RSSI_THRESHOLD;
+  }
+  entry->addressType = line[13] - '0';
+  entry->rssi = rssi;
+  entry->lastSeen = now;
+  entry->payloadHash = payloadHash;
+  entry->reports++;
+
+  if (changed) {
+    entry->reportedRssi = rssi;
+    RN4020_onScanReport(rn4020, entry, payload, payloadLength);
+  } else {
+    rn4020->stats.scanReportsSuppressed++;
+  }
+  return true;
+}
+
+HAL_StatusTypeDef RN4020_connect(RN4020* rn4020, const uint8_t* mac, uint8_t addressType) {
+  char line[RN4020_MAX_COMMAND_LENGTH];
+  char* dest = line;
+  memcpy(dest, "E,", 2);
+  dest += 2;
+  *dest++ = '0' + addressType;
+  *dest++ = ',';
+  dest = RN4020_hexEncode(dest, mac, RN4020_MAC_LENGTH_BYTES);
+  *dest = '\0';
+  return _RN4020_runAOKCommand(rn4020, line);
+}
+
+HAL_StatusTypeDef RN4020_discoverRemote(RN4020* rn4020, RN4020_RemoteGatt* remote) {
+  if (remote->discovered) {
+    return HAL_OK;
+  }
+  RN4020_CommandToken token;
+  returnNonOKHALStatus(_RN4020_waitForQueueSpace(rn4020));
+  RN4020_Command* command = _RN4020_allocCommand(rn4020, RN4020_STATE_WAITING_FOR_LC);
+  if (command == NULL) {
+    return HAL_BUSY;
+  }
+  command->result = remote;
+  memcpy(command->line, "LC", 2);
+  command->lineLength = 2;
+  _RN4020_commitCommand(rn4020, command, NULL, NULL, &token);
+  return RN4020_waitForCommand(rn4020, token);
+}
+
+void RN4020_forgetRemote(RN4020_RemoteGatt* remote) {
+  remote->discovered = false;
+  remote->length = 0;
+}
+
+RN4020_handleLookupItem* RN4020_lookupRemoteUUID(RN4020_RemoteGatt* remote, const uint8_t* uuid, uint8_t uuidLength) {
+  if (remote == NULL || !remote->discovered) {
+    return NULL;
+  }
+  for (int i = 0; i < remote->length; i++) {
+    RN4020_handleLookupItem* item = &remote->items[i];
+    if (item->characteristicUUIDLength == uuidLength && memcmp(item->characteristicUUID, uuid, uuidLength) == 0) {
+      return item;
+    }
+  }
+  return NULL;
+}
+
+HAL_StatusTypeDef RN4020_readRemoteHandleAsync(
+  RN4020* rn4020,
+  uint16_t handle,
+  RN4020_RemoteValue* result,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+) {
+  RN4020_Command* command = _RN4020_allocCommand(rn4020, RN4020_STATE_WAITING_FOR_READ);
+  if (command == NULL) {
+    return HAL_BUSY;
+  }
+  result->handle = handle;
+  result->dataLength = 0;
+  command->result = result;
+  char* dest = command->line;
+  memcpy(dest, "CHR,", 4);
+  dest = RN4020_hexEncodeU16(dest + 4, handle);
+  command->lineLength = dest - command->line;
+  _RN4020_commitCommand(rn4020, command, callback, userData, token);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef RN4020_readRemoteCharacteristicAsync(
+  RN4020* rn4020,
+  RN4020_RemoteGatt* remote,
+  const uint8_t* uuid,
+  uint8_t uuidLength,
+  RN4020_RemoteValue* result,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+) {
+  RN4020_handleLookupItem* item = RN4020_lookupRemoteUUID(remote, uuid, uuidLength);
+  if (item != NULL) {
+    return RN4020_readRemoteHandleAsync(rn4020, item->handle, result, callback, userData, token);
+  }
+
+  RN4020_Command* command = _RN4020_allocCommand(rn4020, RN4020_STATE_WAITING_FOR_READ);
+  if (command == NULL) {
+    return HAL_BUSY;
+  }
+  result->handle = 0;
+  result->dataLength = 0;
+  command->result = result;
+  char* dest = command->line;
+  memcpy(dest, "CUR,", 4);
+  dest = RN4020_hexEncode(dest + 4, uuid, uuidLength);
+  command->lineLength = dest - command->line;
+  _RN4020_commitCommand(rn4020, command, callback, userData, token);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef RN4020_readRemoteHandle(RN4020* rn4020, uint16_t handle, RN4020_RemoteValue* result) {
+  RN4020_CommandToken token;
+  returnNonOKHALStatus(_RN4020_waitForQueueSpace(rn4020));
+  returnNonOKHALStatus(RN4020_readRemoteHandleAsync(rn4020, handle, result, NULL, NULL, &token));
+  return RN4020_waitForCommand(rn4020, token);
+}
+
+HAL_StatusTypeDef RN4020_writeRemoteHandleAsync(
+  RN4020* rn4020,
+  uint16_t handle,
+  const uint8_t* data,
+  uint32_t dataLength,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+) {
+  if (dataLength > RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH) {
+    return HAL_ERROR;
+  }
+  RN4020_Command* command = _RN4020_allocCommand(rn4020, RN4020_STATE_WAITING_FOR_AOK);
+  if (command == NULL) {
+    return HAL_BUSY;
+  }
+  char* dest = command->line;
+  memcpy(dest, "CHW,", 4);
+  dest = RN4020_hexEncodeU16(dest + 4, handle);
+  *dest++ = ',';
+  dest = RN4020_hexEncode(dest, data, dataLength);
+  command->lineLength = dest - command->line;
+  _RN4020_commitCommand(rn4020, command, callback, userData, token);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef RN4020_writeRemoteCharacteristicAsync(
+  RN4020* rn4020,
+  RN4020_RemoteGatt* remote,
+  const uint8_t* uuid,
+  uint8_t uuidLength,
+  const uint8_t* data,
+  uint32_t dataLength,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+) {
+  RN4020_handleLookupItem* item = RN4020_lookupRemoteUUID(remote, uuid, uuidLength);
+  if (item != NULL) {
+    return RN4020_writeRemoteHandleAsync(rn4020, item->handle, data, dataLength, callback, userData, token);
+  }
+
+  if (dataLength > RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH) {
+    return HAL_ERROR;
+  }
+  RN4020_Command* command = _RN4020_allocCommand(rn4020, RN4020_STATE_WAITING_FOR_AOK);
+  if (command == NULL) {
+    return HAL_BUSY;
+  }
+  char* dest = command->line;
+  memcpy(dest, "CUW,", 4);
+  dest = RN4020_hexEncode(dest + 4, uuid, uuidLength);
+  *dest++ = ',';
+  dest = RN4020_hexEncode(dest, data, dataLength);
+  command->lineLength = dest - command->line;
+  _RN4020_commitCommand(rn4020, command, callback, userData, token);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef RN4020_writeRemoteHandle(RN4020* rn4020, uint16_t handle, const uint8_t* data, uint32_t dataLength) {
+  RN4020_CommandToken token;
+  returnNonOKHALStatus(_RN4020_waitForQueueSpace(rn4020));
+  returnNonOKHALStatus(RN4020_writeRemoteHandleAsync(rn4020, handle, data, dataLength, NULL, NULL, &token));
+  return RN4020_waitForCommand(rn4020, token);
+}
+
+HAL_StatusTypeDef RN4020_subscribeRemoteAsync(
+  RN4020* rn4020,
+  RN4020_RemoteGatt* remote,
+  const uint8_t* uuid,
+  uint8_t uuidLength,
+  uint16_t configuration,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+) {
+  RN4020_handleLookupItem* item = RN4020_lookupRemoteUUID(remote, uuid, uuidLength);
+  if (item == NULL
+      || item + 1 >= remote->items + remote->length
+      || item[1].characteristicUUIDLength != uuidLength
+      || memcmp(item[1].characteristicUUID, uuid, uuidLength) != 0) {
+    return HAL_ERROR;
+  }
+  // descriptor values are little endian
+  uint8_t value[2] = { configuration & 0xff, configuration >> 8 };
+  return RN4020_writeRemoteHandleAsync(rn4020, item[1].handle, value, sizeof(value), callback, userData, token);
+}
+
+// index is the SB argument
+static const uint32_t _RN4020_baudRates[] = { 2400, 9600, 19200, 38400, 115200, 230400, 460800, 921600 };
+
+int8_t _RN4020_baudRateIndex(uint32_t baudRate) {
+  for (int8_t i = 0; i < (int8_t)(sizeof(_RN4020_baudRates) / sizeof(_RN4020_baudRates[0])); i++) {
+    if (_RN4020_baudRates[i] == baudRate) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+HAL_StatusTypeDef RN4020_setBaudRate(RN4020* rn4020, uint32_t baudRate, bool flowControl) {
+  uint32_t oldBaudRate = rn4020->uart->Init.BaudRate;
+  bool oldFlowControl = rn4020->uart->Init.HwFlowCtl == UART_HWCONTROL_RTS_CTS;
+  if (_RN4020_baudRateIndex(baudRate) < 0 || _RN4020_baudRateIndex(oldBaudRate) < 0) {
+    return HAL_ERROR;
+  }
+
+  if (_RN4020_setModuleBaudRate(rn4020, baudRate, flowControl) == HAL_OK && _RN4020_verifyLink(rn4020) == HAL_OK) {
+    return HAL_OK;
+  }
+  RN4020_DEBUG_OUT("baud rate %lu failed, falling back to %lu\n", (unsigned long)baudRate, (unsigned long)oldBaudRate);
+
+  // SB or the reboot may not have happened
+  returnNonOKHALStatus(_RN4020_configureUart(rn4020, oldBaudRate, oldFlowControl));
+  if (_RN4020_verifyLink(rn4020) == HAL_OK) {
+    return HAL_ERROR;
+  }
+
+  // the module switched but the link does not work at the new rate, retry without flow control to put it back
+  returnNonOKHALStatus(_RN4020_configureUart(rn4020, baudRate, false));
+  if (_RN4020_verifyLink(rn4020) == HAL_OK
+      && _RN4020_setModuleBaudRate(rn4020, oldBaudRate, oldFlowControl) == HAL_OK
+      && _RN4020_verifyLink(rn4020) == HAL_OK) {
+    return HAL_ERROR;
+  }
+  _RN4020_configureUart(rn4020, oldBaudRate, oldFlowControl);
+  return HAL_TIMEOUT;
+}
+
+HAL_StatusTypeDef _RN4020_setModuleBaudRate(RN4020* rn4020, uint32_t baudRate, bool flowControl) {
+  uint32_t features;
+  returnNonOKHALStatus(RN4020_getSupportedFeatures(rn4020, &features));
+  uint32_t newFeatures = flowControl ? (features | RN4020_FEATURE_UART_FLOW_CONTROL) : (features & ~RN4020_FEATURE_UART_FLOW_CONTROL);
+  if (newFeatures != features) {
+    returnNonOKHALStatus(RN4020_setSupportedFeatures(rn4020, newFeatures));
+  }
+  char line[5] = "SB,0";
+  line[3] = '0' + _RN4020_baudRateIndex(baudRate);
+  returnNonOKHALStatus(_RN4020_runAOKCommand(rn4020, line));
+
+  // Reboot is printed at the old rate and CMD at the new one, switch the uart in between
+  RN4020_CommandToken token;
+  HAL_StatusTypeDef status;
+  returnNonOKHALStatus(_RN4020_waitForQueueSpace(rn4020));
+  RN4020_Command* command = _RN4020_allocCommand(rn4020, RN4020_STATE_WAITING_FOR_RESET);
+  if (command == NULL) {
+    return HAL_BUSY;
+  }
+  memcpy(command->line, "R,1", 3);
+  command->lineLength = 3;
+  _RN4020_commitCommand(rn4020, command, NULL, NULL, &token);
+  while ((status = RN4020_getCommandStatus(rn4020, token)) == HAL_BUSY && rn4020->state != RN4020_STATE_WAITING_FOR_CMD) {
+    RN4020_tick(rn4020);
+  }
+  if (status != HAL_BUSY) {
+    return status == HAL_OK ? HAL_ERROR : status;
+  }
+  returnNonOKHALStatus(_RN4020_configureUart(rn4020, baudRate, flowControl));
+  return RN4020_waitForCommand(rn4020, token);
+}
+
+HAL_StatusTypeDef _RN4020_configureUart(RN4020* rn4020, uint32_t baudRate, bool flowControl) {
+  HAL_UART_DMAStop(rn4020->uart);
+  returnNonOKHALStatus(HAL_UART_DeInit(rn4020->uart));
+  rn4020->uart->Init.BaudRate = baudRate;
+  rn4020->uart->Init.HwFlowCtl = flowControl ? UART_HWCONTROL_RTS_CTS : UART_HWCONTROL_NONE;
+  returnNonOKHALStatus(HAL_UART_Init(rn4020->uart));
+  RingBufferDmaU8_initUSARTRx(&rn4020->rxRing, rn4020->uart, rn4020->rxBuffer, RN4020_RX_BUFFER_SIZE);
+  rn4020->rxScanned = 0;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef _RN4020_verifyLink(RN4020* rn4020) {
+  uint32_t features;
+  return RN4020_getSupportedFeatures(rn4020, &features);
+}
+
+#ifdef RN4020_TRACE
+void _RN4020_traceWrite(RN4020* rn4020, const uint8_t* data, uint32_t length) {
+  uint32_t firstLength = RN4020_TRACE_BUFFER_SIZE - rn4020->traceHead;
+  if (firstLength > length) {
+    firstLength = length;
+  }
+  memcpy(rn4020->traceBuffer + rn4020->traceHead, data, firstLength);
+  memcpy(rn4020->traceBuffer, data + firstLength, length - firstLength);
+  rn4020->traceHead = (rn4020->traceHead + length) % RN4020_TRACE_BUFFER_SIZE;
+}
+
+uint32_t _RN4020_traceRecordLength(RN4020* rn4020, uint32_t index) {
+  return RN4020_TRACE_HEADER_LENGTH + rn4020->traceBuffer[(index + 1) % RN4020_TRACE_BUFFER_SIZE];
+}
+
+void _RN4020_traceRecord(RN4020* rn4020, RN4020_TraceRecordType type, const uint8_t* data, uint32_t length) {
+  uint32_t now = RN4020_GET_TICK();
+  while (length > 0) {
+    uint8_t chunkLength = length > 255 ? 255 : length;
+    uint32_t recordLength = RN4020_TRACE_HEADER_LENGTH + chunkLength;
+    if (recordLength >= RN4020_TRACE_BUFFER_SIZE) {
+      return;
+    }
+    // drop the oldest records to make room
+    uint32_t used = (rn4020->traceHead + RN4020_TRACE_BUFFER_SIZE - rn4020->traceTail) % RN4020_TRACE_BUFFER_SIZE;
+    while (RN4020_TRACE_BUFFER_SIZE - 1 - used < recordLength) {
+      uint32_t oldestLength = _RN4020_traceRecordLength(rn4020, rn4020->traceTail);
+      rn4020->traceTail = (rn4020->traceTail + oldestLength) % RN4020_TRACE_BUFFER_SIZE;
+      used -= oldestLength;
+    }
+    uint8_t header[RN4020_TRACE_HEADER_LENGTH] = { type, chunkLength, now, now >> 8, now >> 16, now >> 24 };
+    _RN4020_traceWrite(rn4020, header, sizeof(header));
+    _RN4020_traceWrite(rn4020, data, chunkLength);
+    data += chunkLength;
+    length -= chunkLength;
+  }
+}
+#endif
+
+void RN4020_traceClear(RN4020* rn4020) {
+#ifdef RN4020_TRACE
+  rn4020->traceHead = 0;
+  rn4020->traceTail = 0;
+  rn4020->traceReplaying = false;
+#endif
+}
+
+uint32_t RN4020_traceDump(RN4020* rn4020, uint8_t* dest, uint32_t destLength) {
+  uint32_t copied = 0;
+#ifdef RN4020_TRACE
+  uint32_t index = rn4020->traceTail;
+  while (index != rn4020->traceHead) {
+    uint32_t recordLength = _RN4020_traceRecordLength(rn4020, index);
+    if (copied + recordLength > destLength) {
+      break;
+    }
+    uint32_t firstLength = RN4020_TRACE_BUFFER_SIZE - index;
+    if (firstLength > recordLength) {
+      firstLength = recordLength;
+    }
+    memcpy(dest + copied, rn4020->traceBuffer + index, firstLength);
+    memcpy(dest + copied + firstLength, rn4020->traceBuffer, recordLength - firstLength);
+    copied += recordLength;
+    index = (index + recordLength) % RN4020_TRACE_BUFFER_SIZE;
+  }
+#endif
+  return copied;
+}
+
+uint32_t RN4020_traceReplay(RN4020* rn4020, const uint8_t* trace, uint32_t traceLength, uint32_t speed) {
+  uint32_t replayed = 0;
+  uint32_t offset = 0;
+  uint32_t firstTimestamp = 0;
+  uint32_t startTime = RN4020_GET_TICK();
+#ifdef RN4020_TRACE
+  rn4020->traceReplaying = true;
+#endif
+  while (offset + RN4020_TRACE_HEADER_LENGTH <= traceLength) {
+    const uint8_t* header = trace + offset;
+    uint8_t length = header[1];
+    uint32_t timestamp = header[2] | (header[3] << 8) | (header[4] << 16) | ((uint32_t)header[5] << 24);
+    const uint8_t* data = header + RN4020_TRACE_HEADER_LENGTH;
+    if (offset + RN4020_TRACE_HEADER_LENGTH + length > traceLength) {
+      break;
+    }
+    if (offset == 0) {
+      firstTimestamp = timestamp;
+    }
+    offset += RN4020_TRACE_HEADER_LENGTH + length;
+    if (header[0] == RN4020_TRACE_TX) {
+      continue;
+    }
+
+    if (speed > 0) {
+      while ((RN4020_GET_TICK() - startTime) * speed < timestamp - firstTimestamp) {
+        _RN4020_processCommandQueue(rn4020);
+      }
+    }
+    _RN4020_processCommandQueue(rn4020);
+    if (header[0] == RN4020_TRACE_RX) {
+      _RN4020_processLine(rn4020, (const char*)data, length);
+    } else if (header[0] == RN4020_TRACE_MLDP_RX) {
+      // the same status scan as _RN4020_processMLDPRx so a recorded drop leaves MLDP
+      bool connectionEnded = _RN4020_scanMLDPStatus(rn4020, data, length);
+      RN4020_onMLDPData(rn4020, data, length);
+      if (connectionEnded && rn4020->mldp) {
+        _RN4020_setConnected(rn4020, false);
+      }
+    }
+    _RN4020_processCommandQueue(rn4020);
+    replayed++;
+  }
+#ifdef RN4020_TRACE
+  rn4020->traceReplaying = false;
+#endif
+  return replayed;
+}
+
+#ifdef RN4020_SUBMIT_QUEUE
+HAL_StatusTypeDef RN4020_submitCommand(
+  RN4020* rn4020,
+  RN4020_Submission* submission,
+  const char* cmd,
+  RN4020_CommandCallback callback,
+  void* userData
+) {
+  if (strlen(cmd) > RN4020_MAX_COMMAND_LENGTH - 2) {
+    return HAL_ERROR;
+  }
+  submission->type = RN4020_SUBMISSION_COMMAND;
+  submission->command = cmd;
+  submission->callback = callback;
+  submission->userData = userData;
+  return _RN4020_submit(rn4020, submission);
+}
+
+HAL_StatusTypeDef RN4020_submitWrite(
+  RN4020* rn4020,
+  RN4020_Submission* submission,
+  uint16_t handle,
+  const uint8_t* data,
+  uint32_t dataLength,
+  RN4020_CommandCallback callback,
+  void* userData
+) {
+  if (dataLength > RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH) {
+    return HAL_ERROR;
+  }
+  submission->type = RN4020_SUBMISSION_WRITE;
+  submission->handle = handle;
+  memcpy(submission->data, data, dataLength);
+  submission->dataLength = dataLength;
+  submission->callback = callback;
+  submission->userData = userData;
+  return _RN4020_submit(rn4020, submission);
+}
+
+HAL_StatusTypeDef RN4020_getSubmissionStatus(RN4020_Submission* submission) {
+  return atomic_load_explicit(&submission->status, memory_order_acquire);
+}
+
+// bounded ring with a sequence number per slot: a producer claims a position by advancing submitTail and publishes the
+// slot by setting its sequence to position + 1, the consumer hands it back with position + RN4020_SUBMIT_QUEUE_SIZE
+HAL_StatusTypeDef _RN4020_submit(RN4020* rn4020, RN4020_Submission* submission) {
+  atomic_store_explicit(&submission->status, HAL_BUSY, memory_order_relaxed);
+  uint32_t position = atomic_load_explicit(&rn4020->submitTail, memory_order_relaxed);
+  RN4020_SubmitSlot* slot;
+  while (true) {
+    slot = &rn4020->submitQueue[position & (RN4020_SUBMIT_QUEUE_SIZE - 1)];
+    int32_t diff = (int32_t)(atomic_load_explicit(&slot->sequence, memory_order_acquire) - position);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&rn4020->submitTail, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return HAL_BUSY;
+    } else {
+      position = atomic_load_explicit(&rn4020->submitTail, memory_order_relaxed);
+    }
+  }
+  slot->submission = submission;
+  atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+  return HAL_OK;
+}
+
+void _RN4020_processSubmissions(RN4020* rn4020) {
+  while (true) {
+    RN4020_SubmitSlot* slot = &rn4020->submitQueue[rn4020->submitHead & (RN4020_SUBMIT_QUEUE_SIZE - 1)];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != rn4020->submitHead + 1) {
+      return;
+    }
+    RN4020_Submission* submission = slot->submission;
+    HAL_StatusTypeDef status;
+    if (submission->type == RN4020_SUBMISSION_WRITE) {
+      status = RN4020_writeServerCharacteristicHandleAsync(
+        rn4020, submission->handle, submission->data, submission->dataLength, _RN4020_submissionDone, submission, NULL
+      );
+    } else {
+      status = RN4020_sendCommandAsync(rn4020, submission->command, _RN4020_submissionDone, submission, NULL);
+    }
+    if (status == HAL_BUSY) {
+      return; // command queue full, the slot is retried next tick
+    }
+    atomic_store_explicit(&slot->sequence, rn4020->submitHead + RN4020_SUBMIT_QUEUE_SIZE, memory_order_release);
+    rn4020->submitHead++;
+    if (status != HAL_OK) {
+      _RN4020_submissionDone(rn4020, 0, status, submission);
+    }
+  }
+}
+
+void _RN4020_submissionDone(RN4020* rn4020, RN4020_CommandToken token, HAL_StatusTypeDef status, void* userData) {
+  RN4020_Submission* submission = userData;
+  // the submitter may reuse the submission as soon as status is published
+  RN4020_CommandCallback callback = submission->callback;
+  void* callbackUserData = submission->userData;
+  atomic_store_explicit(&submission->status, status, memory_order_release);
+  if (callback) {
+    callback(rn4020, token, status, callbackUserData);
+  }
+}
+#endif
+
+void RN4020_setPowerSchedule(RN4020* rn4020, const RN4020_PowerSchedule* schedule) {
+  rn4020->powerSchedule = schedule;
+  uint32_t now = RN4020_GET_TICK();
+  rn4020->powerLastActivity = now;
+  rn4020->powerAwakeMark = now;
+  rn4020->wakeWindowTime = now;
+  if (schedule == NULL && rn4020->powerState == RN4020_POWER_ASLEEP) {
+    _RN4020_wake(rn4020);
+  }
+}
+
+RN4020_PowerState RN4020_getPowerState(RN4020* rn4020) {
+  return rn4020->powerState;
+}
+
+void _RN4020_processPowerSchedule(RN4020* rn4020) {
+  const RN4020_PowerSchedule* schedule = rn4020->powerSchedule;
+  uint32_t now = RN4020_GET_TICK();
+  switch (rn4020->powerState) {
+  case RN4020_POWER_AWAKE:
+    if (schedule == NULL) {
+      return;
+    }
+    rn4020->stats.awakeTime += now - rn4020->powerAwakeMark;
+    rn4020->powerAwakeMark = now;
+    if (!_RN4020_isPowerIdle(rn4020)) {
+      rn4020->powerLastActivity = now;
+      return;
+    }
+    if ((now - rn4020->powerLastActivity) < schedule->idleTime) {
+      return;
+    }
+    HAL_GPIO_WritePin(rn4020->wakeswPort, rn4020->wakeswPin, GPIO_PIN_RESET);
+    rn4020->powerState = RN4020_POWER_ASLEEP;
+    rn4020->powerStateTime = now;
+    return;
+
+  case RN4020_POWER_WAKING:
+    if ((now - rn4020->powerStateTime) > RN4020_TIMEOUT) {
+      // no prompt, let the queued commands find out whether the module answers
+      RN4020_DEBUG_OUT("no CMD after wake\n");
+      _RN4020_powerAwake(rn4020);
+    }
+    return;
+
+  case RN4020_POWER_ASLEEP:
+    if (rn4020->connectionPort != NULL) {
+      // status lines are lost while asleep, the pin is the only way to see a central come or go
+      bool connected = HAL_GPIO_ReadPin(rn4020->connectionPort, rn4020->connectionPin) == GPIO_PIN_SET;
+      if (connected != rn4020->connected) {
+        _RN4020_setConnected(rn4020, connected);
+      }
+    }
+    if (schedule == NULL || rn4020->commandQueueLength > 0 || _RN4020_isWakeWindowDue(rn4020, now)
+        || (rn4020->connected && !schedule->sleepWhileConnected)) {
+      _RN4020_wake(rn4020);
+    }
+    return;
+  }
+}
+
+bool _RN4020_isPowerIdle(RN4020* rn4020) {
+  if (rn4020->commandQueueLength > 0 || rn4020->commandInFlight || rn4020->readResponsesPending != 0) {
+    return false;
+  }
+  if (rn4020->mldp || rn4020->scanning || RN4020_isMessageSending(rn4020)) {
+    return false;
+  }
+  return !rn4020->connected || rn4020->powerSchedule->sleepWhileConnected;
+}
+
+bool _RN4020_isWakeWindowDue(RN4020* rn4020, uint32_t now) {
+  const RN4020_PowerSchedule* schedule = rn4020->powerSchedule;
+  uint8_t pending = 0;
+  for (int i = 0; i < rn4020->writeCacheLength; i++) {
+    // while disconnected every pending write counts, a central can only be seen connecting while awake
+    if (rn4020->writeCache[i].pending
+        && (!rn4020->connected || _RN4020_isListenedTo(rn4020, rn4020->writeCache[i].handle))) {
+      pending++;
+    }
+  }
+  if (pending == 0) {
+    return false;
+  }
+  if (schedule->wakeBatch != 0 && pending >= schedule->wakeBatch) {
+    return true;
+  }
+  // start waking early so the module is ready when the window opens
+  return schedule->wakeInterval != 0
+         && (now + rn4020->wakeLatencyAverage - rn4020->wakeWindowTime) >= schedule->wakeInterval;
+}
+
+void _RN4020_wake(RN4020* rn4020) {
+  rn4020->powerState = RN4020_POWER_WAKING;
+  rn4020->powerStateTime = RN4020_GET_TICK();
+  HAL_GPIO_WritePin(rn4020->wakeswPort, rn4020->wakeswPin, GPIO_PIN_SET);
+}
+
+void _RN4020_powerAwake(RN4020* rn4020) {
+  uint32_t now = RN4020_GET_TICK();
+  uint32_t latency = now - rn4020->powerStateTime;
+  rn4020->stats.wakes++;
+  rn4020->stats.wakeLatencyTotal += latency;
+  if (latency > rn4020->stats.wakeLatencyMax) {
+    rn4020->stats.wakeLatencyMax = latency;
+  }
+  rn4020->wakeLatencyAverage = rn4020->stats.wakes == 1 ? latency : (rn4020->wakeLatencyAverage * 3 + latency) / 4;
+  rn4020->powerState = RN4020_POWER_AWAKE;
+  rn4020->powerAwakeMark = rn4020->powerStateTime; // the module draws active current while it wakes
+  rn4020->powerLastActivity = now;
+  rn4020->wakeWindowTime = now;
+  rn4020->writeCacheFlushNow = true;
+}
+
+void RN4020_setReconnectPolicy(RN4020* rn4020, const RN4020_ReconnectPolicy* policy) {
+  rn4020->reconnectPolicy = policy;
+  if (policy == NULL) {
+    rn4020->reconnecting = false;
+  }
+}
+
+void _RN4020_processReconnect(RN4020* rn4020) {
+  const RN4020_ReconnectPolicy* policy = rn4020->reconnectPolicy;
+  if (policy == NULL || !rn4020->reconnecting || rn4020->connected) {
+    return;
+  }
+  uint32_t now = RN4020_GET_TICK();
+  if (rn4020->reconnectAdvertised) {
+    if (policy->window == 0 || (now - rn4020->reconnectStepTime) < policy->window) {
+      return;
+    }
+    // the window ended without a connection, advertise again less often
+    rn4020->reconnectInterval = rn4020->reconnectInterval > policy->slowInterval / 2
+                                ? policy->slowInterval
+                                : rn4020->reconnectInterval * 2;
+  }
+
+  RN4020_Command* command = _RN4020_allocCommand(rn4020, RN4020_STATE_WAITING_FOR_AOK);
+  if (command == NULL) {
+    return; // retried next tick
+  }
+  char* dest = command->line;
+  memcpy(dest, "A,", 2);
+  dest = RN4020_hexEncodeU16(dest + 2, rn4020->reconnectInterval);
+  if (policy->window != 0) {
+    *dest++ = ',';
+    dest = RN4020_hexEncodeU16(dest, policy->window);
+  }
+  command->lineLength = dest - command->line;
+  _RN4020_commitCommand(rn4020, command, NULL, NULL, NULL);
+  rn4020->reconnectAdvertised = true;
+  rn4020->reconnectStepTime = now;
+}
+
+char* _RN4020_encodeConnectionParameters(char* dest, const char* prefix, const RN4020_ConnectionParameters* parameters) {
+  uint32_t prefixLength = strlen(prefix);
+  memcpy(dest, prefix, prefixLength);
+  dest = RN4020_hexEncodeU16(dest + prefixLength, parameters->interval);
+  *dest++ = ',';
+  dest = RN4020_hexEncodeU16(dest, parameters->latency);
+  *dest++ = ',';
+  return RN4020_hexEncodeU16(dest, parameters->timeout);
+}
+
+HAL_StatusTypeDef RN4020_setPreferredConnectionParameters(RN4020* rn4020, const RN4020_ConnectionParameters* parameters) {
+  char line[RN4020_MAX_COMMAND_LENGTH];
+  *_RN4020_encodeConnectionParameters(line, "ST,", parameters) = '\0';
+  return _RN4020_runAOKCommand(rn4020, line);
+}
+
+HAL_StatusTypeDef RN4020_requestConnectionParametersAsync(
+  RN4020* rn4020,
+  const RN4020_ConnectionParameters* parameters,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+) {
+  RN4020_Command* command = _RN4020_allocCommand(rn4020, RN4020_STATE_WAITING_FOR_AOK);
+  if (command == NULL) {
+    return HAL_BUSY;
+  }
+  command->lineLength = _RN4020_encodeConnectionParameters(command->line, "T,", parameters) - command->line;
+  _RN4020_commitCommand(rn4020, command, callback, userData, token);
+  return HAL_OK;
+}
+
+bool RN4020_getConnectionParameters(RN4020* rn4020, RN4020_ConnectionParameters* parameters) {
+  if (rn4020->connectionParametersValid) {
+    *parameters = rn4020->connectionParameters;
+  }
+  return rn4020->connectionParametersValid;
+}
+
+void _RN4020_processConnectionParametersLine(RN4020* rn4020, const char* line, uint16_t lineLength) {
+  // ConnParam:iiii,llll,tttt
+  RN4020_ConnectionParameters parameters;
+  if (lineLength < 24
+      || line[14] != ','
+      || line[19] != ','
+      || !RN4020_hexDecodeU16(line + 10, &parameters.interval)
+      || !RN4020_hexDecodeU16(line + 15, &parameters.latency)
+      || !RN4020_hexDecodeU16(line + 20, &parameters.timeout)) {
+    RN4020_DEBUG_OUT("invalid connection parameters: %.*s\n", lineLength, line);
+    return;
+  }
+  rn4020->connectionParameters = parameters;
+  rn4020->connectionParametersValid = true;
+  RN4020_onConnectionParameters(rn4020, &parameters);
+}
+
+void RN4020_setConnectionTuner(RN4020* rn4020, const RN4020_ConnectionTuner* tuner) {
+  rn4020->tuner = tuner;
+  rn4020->tunerFast = false;
+  rn4020->tunerWindowStart = RN4020_GET_TICK();
+  rn4020->tunerWindowWrites = rn4020->tunerWrites;
+  rn4020->tunerSeenWrites = rn4020->tunerWindowWrites;
+  rn4020->tunerLastWrite = rn4020->tunerWindowStart;
+}
+
+void _RN4020_processConnectionTuner(RN4020* rn4020) {
+  const RN4020_ConnectionTuner* tuner = rn4020->tuner;
+  if (tuner == NULL || !rn4020->connected || rn4020->mldp) {
+    return;
+  }
+  uint32_t now = RN4020_GET_TICK();
+  uint32_t writes = rn4020->tunerWrites;
+  if (writes != rn4020->tunerSeenWrites) {
+    rn4020->tunerSeenWrites = writes;
+    rn4020->tunerLastWrite = now;
+  }
+  if ((now - rn4020->tunerWindowStart) < RN4020_TUNER_WINDOW) {
+    return;
+  }
+
+  uint32_t windowWrites = writes - rn4020->tunerWindowWrites;
+  const RN4020_ConnectionParameters* parameters = NULL;
+  if (!rn4020->tunerFast && windowWrites >= tuner->fastWritesPerWindow) {
+    parameters = &tuner->fast;
+  } else if (rn4020->tunerFast && (now - rn4020->tunerLastWrite) >= tuner->idleTime) {
+    parameters = &tuner->idle;
+  }
+  // a full queue means the request is retried with the next window
+  if (parameters != NULL && RN4020_requestConnectionParametersAsync(rn4020, parameters, NULL, NULL, NULL) == HAL_OK) {
+    rn4020->tunerFast = !rn4020->tunerFast;
+  }
+  rn4020->tunerWindowStart = now;
+  rn4020->tunerWindowWrites = writes;
+}
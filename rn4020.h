@@ -4,21 +4,115 @@
 
 #include <platform_config.h>
 #include <utils/ringbufferdma.h>
+#ifdef RN4020_SUBMIT_QUEUE
+#include <stdatomic.h>
+#endif
 
 #ifndef RN4020_TIMEOUT
 #define RN4020_TIMEOUT 5000
 #endif
 
+// per command timeouts, commands that reboot the module or wait for the CMD prompt use RN4020_TIMEOUT
+#ifndef RN4020_AOK_TIMEOUT
+#define RN4020_AOK_TIMEOUT 1000
+#endif
+
+#ifndef RN4020_LS_TIMEOUT
+#define RN4020_LS_TIMEOUT 2000
+#endif
+
+// overall limit for a blocking call, including the time its command waits behind others in the queue
+#ifndef RN4020_WAIT_TIMEOUT
+#define RN4020_WAIT_TIMEOUT (RN4020_TIMEOUT * 2)
+#endif
+
+// millisecond clock used for timeouts and flush intervals, override to run the driver against a simulated clock
+#ifndef RN4020_GET_TICK
+#define RN4020_GET_TICK() HAL_GetTick()
+#endif
+
 #ifndef RN4020_LOOKUP_TABLE_SIZE
 #define RN4020_LOOKUP_TABLE_SIZE 20
 #endif
 
+#ifndef RN4020_REMOTE_LOOKUP_TABLE_SIZE
+#define RN4020_REMOTE_LOOKUP_TABLE_SIZE 16
+#endif
+
+// must be a power of two larger than RN4020_LOOKUP_TABLE_SIZE
+#ifndef RN4020_UUID_INDEX_SIZE
+#define RN4020_UUID_INDEX_SIZE 64
+#endif
+
+#ifndef RN4020_COMMAND_QUEUE_SIZE
+#define RN4020_COMMAND_QUEUE_SIZE 8
+#endif
+
+#ifndef RN4020_WRITE_CACHE_SIZE
+#define RN4020_WRITE_CACHE_SIZE 8
+#endif
+
+// at most 32
+#ifndef RN4020_READ_CACHE_SIZE
+#define RN4020_READ_CACHE_SIZE 8
+#endif
+
+// message chunks kept in the command queue at once, must be less than RN4020_COMMAND_QUEUE_SIZE
+#ifndef RN4020_MESSAGE_PIPELINE_DEPTH
+#define RN4020_MESSAGE_PIPELINE_DEPTH 4
+#endif
+
+#ifndef RN4020_MLDP_TX_BUFFER_SIZE
+#define RN4020_MLDP_TX_BUFFER_SIZE 256
+#endif
+
+// must be a power of two, advertisers beyond this many replace the least recently seen one
+#ifndef RN4020_SCAN_CACHE_SIZE
+#define RN4020_SCAN_CACHE_SIZE 32
+#endif
+
+// an RSSI change of at least this many dBm is reported as a change
+#ifndef RN4020_SCAN_RSSI_THRESHOLD
+#define RN4020_SCAN_RSSI_THRESHOLD 6
+#endif
+
+// an advertiser not seen for this many ms is reported again as if it were new
+#ifndef RN4020_SCAN_EXPIRE_TIME
+#define RN4020_SCAN_EXPIRE_TIME 10000
+#endif
+
+// define RN4020_TRACE to record timestamped UART traffic into a ring on the RN4020 struct
+#ifndef RN4020_TRACE_BUFFER_SIZE
+#define RN4020_TRACE_BUFFER_SIZE 1024
+#endif
+
+// define RN4020_SUBMIT_QUEUE to let other tasks and interrupts hand commands to the RN4020_tick context, must be a power
+// of two
+#ifndef RN4020_SUBMIT_QUEUE_SIZE
+#define RN4020_SUBMIT_QUEUE_SIZE 16
+#endif
+
+// ms of write traffic the connection tuner averages over
+#ifndef RN4020_TUNER_WINDOW
+#define RN4020_TUNER_WINDOW 1000
+#endif
+
+#ifndef RN4020_RX_BUFFER_SIZE
 #define RN4020_RX_BUFFER_SIZE 500
+#endif
+
+#define RN4020_MAX_RX_LINE_LENGTH 100
+#define RN4020_MAX_VALUE_LENGTH   40
+
+#define RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH 20
+#define RN4020_MAX_COMMAND_LENGTH              80
+#define RN4020_READ_CACHE_LINE_LENGTH          (sizeof("SHW,hhhh,\n") - 1 + RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH * 2)
 
 #define RN4020_PRIVATE_UUID_LENGTH_BITS       128
 #define RN4020_PRIVATE_UUID_LENGTH_BYTES      (128 / 8)
 #define RN4020_PRIVATE_UUID_HEX_STRING_LENGTH (RN4020_PRIVATE_UUID_LENGTH_BYTES * 2)
 #define RN4020_MAX_UUID_LEN_BYTES             (128 / 8)
+#define RN4020_MAC_LENGTH_BYTES               6
 
 #define RN4020_SERVICE_DEVICE_INFORMATION    0x80000000
 #define RN4020_SERVICE_BATTERY               0x40000000
@@ -92,35 +186,509 @@ typedef enum {
   RN4020_STATE_WAITING_FOR_CMD,
   RN4020_STATE_WAITING_FOR_AOK,
   RN4020_STATE_WAITING_FOR_RESET,
-  RN4020_STATE_WAITING_FOR_LS
+  RN4020_STATE_WAITING_FOR_LS,
+  RN4020_STATE_WAITING_FOR_MLDP,
+  RN4020_STATE_WAITING_FOR_VALUE,
+  RN4020_STATE_WAITING_FOR_LC,
+  RN4020_STATE_WAITING_FOR_READ
 } RN4020_State;
 
 typedef struct {
   uint16_t handle;
   uint8_t characteristicUUID[RN4020_MAX_UUID_LEN_BYTES];
   uint8_t characteristicUUIDLength;
+  uint8_t characteristicProperties;
+  uint16_t configurationHandle; // client configuration descriptor, 0 if the characteristic has none
+  uint16_t clientConfiguration; // RN4020_CLIENT_CONFIGURATION_ bits the connected client has written
 } RN4020_handleLookupItem;
 
+/**
+ * One private service, or one characteristic of the service before it. command is the pre-rendered "PS,<uuid>" or
+ * "PC,<uuid>" line produced by RN4020_GATT_TABLE, when NULL the line is formatted from uuid at runtime.
+ */
+typedef struct {
+  bool isService;
+  const uint8_t* uuid;
+  uint8_t propertyOptions;
+  uint8_t size;
+  uint8_t securityOptions;
+  const char* command;
+} RN4020_GattEntry;
+
+typedef struct {
+  const RN4020_GattEntry* entries;
+  uint8_t length;
+  uint16_t* handles;
+} RN4020_GattTable;
+
+/**
+ * Declares a private GATT table at compile time. LIST is a macro taking SERVICE and CHARACTERISTIC macros, uuids are
+ * written as 16 bare hex bytes so both the byte array and the hex string live in flash:
+ *
+ *   #define MY_GATT(SERVICE, CHARACTERISTIC) \
+ *     SERVICE(MY_SERVICE, (00, 11, 22, 33, 44, 55, 66, 77, 88, 99, AA, BB, CC, DD, EE, FF)) \
+ *     CHARACTERISTIC(MY_VALUE, (00, 11, 22, 33, 44, 55, 66, 77, 88, 99, AA, BB, CC, DD, EE, 01), \
+ *                    RN4020_PRIVATE_CHARACTERISTIC_PROPERTY_READ | RN4020_PRIVATE_CHARACTERISTIC_PROPERTY_NOTIFY, \
+ *                    20, RN4020_PRIVATE_CHARACTERISTIC_SECURITY_NONE)
+ *   RN4020_GATT_TABLE(myGatt, MY_GATT);
+ *
+ * This defines myGatt, myGatt_entries, myGatt_COUNT and an enum with MY_SERVICE and MY_VALUE. After
+ * RN4020_bindGattTable, RN4020_refreshHandleLookup stores each characteristic's handle in
+ * RN4020_GATT_HANDLE(myGatt, MY_VALUE). A uuid with the wrong number of bytes, a bad hex digit or a byte not written
+ * as exactly two digits fails to compile.
+ */
+#define RN4020_GATT_TABLE(name, LIST) \
+  LIST(_RN4020_GATT_CHECK_SERVICE, _RN4020_GATT_CHECK_CHARACTERISTIC) \
+  enum { LIST(_RN4020_GATT_ENUM_SERVICE, _RN4020_GATT_ENUM_CHARACTERISTIC) name##_COUNT }; \
+  static const RN4020_GattEntry name##_entries[] = { \
+    LIST(_RN4020_GATT_ENTRY_SERVICE, _RN4020_GATT_ENTRY_CHARACTERISTIC) \
+  }; \
+  static uint16_t name##_handles[name##_COUNT]; \
+  static const RN4020_GattTable name = { name##_entries, name##_COUNT, name##_handles }
+
+#define RN4020_GATT_HANDLE(name, id) (name##_handles[id])
+
+#define _RN4020_GATT_UUID_BYTES(b0, b1, b2, b3, b4, b5, b6, b7, b8, b9, b10, b11, b12, b13, b14, b15) \
+  ((const uint8_t[RN4020_PRIVATE_UUID_LENGTH_BYTES]) { \
+    0x##b0, 0x##b1, 0x##b2, 0x##b3, 0x##b4, 0x##b5, 0x##b6, 0x##b7, \
+    0x##b8, 0x##b9, 0x##b10, 0x##b11, 0x##b12, 0x##b13, 0x##b14, 0x##b15 \
+  })
+#define _RN4020_GATT_UUID_STRING(b0, b1, b2, b3, b4, b5, b6, b7, b8, b9, b10, b11, b12, b13, b14, b15) \
+  #b0 #b1 #b2 #b3 #b4 #b5 #b6 #b7 #b8 #b9 #b10 #b11 #b12 #b13 #b14 #b15
+// the string is sent as is, a short byte like 0A written as A would shift every byte after it
+#define _RN4020_GATT_UUID_CHECK(b0, b1, b2, b3, b4, b5, b6, b7, b8, b9, b10, b11, b12, b13, b14, b15) \
+  _Static_assert( \
+    sizeof(#b0) == 3 && sizeof(#b1) == 3 && sizeof(#b2) == 3 && sizeof(#b3) == 3 \
+    && sizeof(#b4) == 3 && sizeof(#b5) == 3 && sizeof(#b6) == 3 && sizeof(#b7) == 3 \
+    && sizeof(#b8) == 3 && sizeof(#b9) == 3 && sizeof(#b10) == 3 && sizeof(#b11) == 3 \
+    && sizeof(#b12) == 3 && sizeof(#b13) == 3 && sizeof(#b14) == 3 && sizeof(#b15) == 3, \
+    "uuid bytes must be written as two hex digits" \
+  );
+#define _RN4020_GATT_CHECK_SERVICE(id, uuid) _RN4020_GATT_UUID_CHECK uuid
+#define _RN4020_GATT_CHECK_CHARACTERISTIC(id, uuid, propertyOptions, size, securityOptions) _RN4020_GATT_UUID_CHECK uuid
+#define _RN4020_GATT_ENUM_SERVICE(id, uuid) id,
+#define _RN4020_GATT_ENUM_CHARACTERISTIC(id, uuid, propertyOptions, size, securityOptions) id,
+#define _RN4020_GATT_ENTRY_SERVICE(id, uuid) \
+  { true, _RN4020_GATT_UUID_BYTES uuid, 0, 0, 0, "PS," _RN4020_GATT_UUID_STRING uuid },
+#define _RN4020_GATT_ENTRY_CHARACTERISTIC(id, uuid, propertyOptions, size, securityOptions) \
+  { false, _RN4020_GATT_UUID_BYTES uuid, (propertyOptions), (size), (securityOptions), "PC," _RN4020_GATT_UUID_STRING uuid },
+
+typedef struct {
+  uint32_t services;
+  uint32_t features;
+  const char* deviceName; // optional
+  const RN4020_GattEntry* privateEntries;
+  uint8_t privateEntriesLength;
+} RN4020_Config;
+
+typedef enum {
+  RN4020_COMMAND_TYPE_WAKE,
+  RN4020_COMMAND_TYPE_SET,
+  RN4020_COMMAND_TYPE_WRITE,
+  RN4020_COMMAND_TYPE_PRIVATE,
+  RN4020_COMMAND_TYPE_RESET,
+  RN4020_COMMAND_TYPE_LIST,
+  RN4020_COMMAND_TYPE_ADVERTISE,
+  RN4020_COMMAND_TYPE_MLDP,
+  RN4020_COMMAND_TYPE_CLIENT,
+  RN4020_COMMAND_TYPE_OTHER,
+  RN4020_COMMAND_TYPE_COUNT
+} RN4020_CommandType;
+
+// bucket 0 counts round trips under 1ms, bucket n counts [2^(n-1), 2^n) ms and the last bucket everything longer
+#define RN4020_LATENCY_HISTOGRAM_BUCKETS 12
+
+typedef struct {
+  uint32_t commands[RN4020_COMMAND_TYPE_COUNT];
+  uint32_t commandErrors;
+  uint32_t commandTimeouts;
+  uint32_t latencyHistogram[RN4020_LATENCY_HISTOGRAM_BUCKETS];
+  uint32_t latencyMax;
+  uint32_t unexpectedLines;
+  uint16_t rxHighWatermark;
+  uint32_t rxOverruns;
+  uint32_t bytesTx;
+  uint32_t bytesRx;
+  uint32_t connects;
+  uint32_t disconnects;
+  uint32_t writesCoalesced;
+  uint32_t writesSent;
+  uint32_t scanReports;
+  uint32_t scanReportsSuppressed;
+  uint32_t realTimeReadsAnswered;
+  uint32_t writesSuppressed;
+  uint32_t wakes;
+  uint32_t wakeLatencyTotal; // ms from raising WAKE_SW to the CMD prompt, summed over wakes
+  uint32_t wakeLatencyMax;
+  uint32_t awakeTime;        // ms WAKE_SW was held high while a power schedule was set
+  uint32_t reconnects;
+  uint32_t reconnectTimeTotal; // ms from Connection End to Connected, summed over reconnects
+  uint32_t reconnectTimeMax;
+} RN4020_Stats;
+
+typedef struct {
+  bool used;
+  uint8_t mac[RN4020_MAC_LENGTH_BYTES];
+  uint8_t addressType;
+  int8_t rssi;
+  int8_t reportedRssi;
+  uint32_t firstSeen;
+  uint32_t lastSeen;
+  uint32_t payloadHash;
+  uint32_t reports;
+} RN4020_ScanEntry;
+
+typedef struct {
+  uint16_t handle;
+  bool pending;
+  uint8_t dataLength;
+  uint8_t data[RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH];
+} RN4020_WriteCacheItem;
+
+/**
+ * interval is in 1.25ms units (6-3200), latency in connection events and timeout in 10ms units (10-3200).
+ */
+typedef struct {
+  uint16_t interval;
+  uint16_t latency;
+  uint16_t timeout;
+} RN4020_ConnectionParameters;
+
+/**
+ * The tuner asks the central for fast parameters once at least fastWritesPerWindow writes went out in one
+ * RN4020_TUNER_WINDOW, and for idle parameters after idleTime ms without writes. Answers to real-time reads are not
+ * counted as writes.
+ */
+typedef struct {
+  RN4020_ConnectionParameters fast;
+  RN4020_ConnectionParameters idle;
+  uint16_t fastWritesPerWindow;
+  uint32_t idleTime;
+} RN4020_ConnectionTuner;
+
+/**
+ * With a power schedule set WAKE_SW is released after idleTime ms with an empty command queue, no MLDP, no scan and,
+ * unless sleepWhileConnected, no connection. Any queued command wakes the module at once. Deferred writes are left
+ * in the write cache while asleep and sent together in the next wake window, which opens every wakeInterval ms or
+ * as soon as wakeBatch writes are pending (0 disables either trigger). Windows are opened early by the measured wake
+ * latency so the writes go out on time.
+ *
+ * The module's UART is off while WAKE_SW is low, status lines and client writes are only seen while it is awake.
+ * While disconnected every pending deferred write opens wake windows, so a central that connects is noticed in the
+ * next window. With connectionPort wired the pin is sampled while asleep and a connection is noticed at once.
+ */
+typedef struct {
+  uint32_t idleTime;
+  uint32_t wakeInterval;
+  uint8_t wakeBatch;
+  bool sleepWhileConnected;
+} RN4020_PowerSchedule;
+
+/**
+ * With a reconnect policy set, Connection End queues A,<interval>,<window> right away. The advertising interval
+ * starts at fastInterval and doubles after every window that ends without a connection, up to slowInterval. window 0
+ * advertises at fastInterval until connected. All values are in ms.
+ *
+ * A bonded module advertises directed at its bonded peer unless RN4020_FEATURE_NO_DIRECT_ADVERTISE is set. Bonded
+ * centrals do not rewrite configuration descriptors after reconnecting, keepSubscriptions keeps the client
+ * configuration learned on the previous connection instead of clearing it on Connection End.
+ */
 typedef struct {
+  uint16_t fastInterval;
+  uint16_t slowInterval;
+  uint16_t window;
+  bool keepSubscriptions;
+} RN4020_ReconnectPolicy;
+
+typedef enum {
+  RN4020_POWER_AWAKE,
+  RN4020_POWER_WAKING, // WAKE_SW raised, waiting for the CMD prompt
+  RN4020_POWER_ASLEEP
+} RN4020_PowerState;
+
+/**
+ * A trace is a sequence of records: type, payload length, little endian RN4020_GET_TICK() timestamp (4 bytes) and
+ * the payload. RX records hold one line without the line ending, payloads longer than 255 bytes are split.
+ */
+typedef enum {
+  RN4020_TRACE_TX = 1,
+  RN4020_TRACE_RX = 2,
+  RN4020_TRACE_MLDP_RX = 3
+} RN4020_TraceRecordType;
+
+#define RN4020_TRACE_HEADER_LENGTH 6
+
+/**
+ * Messages are split into chunks of at most RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH bytes. Each chunk starts with a
+ * header byte holding RN4020_MESSAGE_START, RN4020_MESSAGE_END and a sequence number that restarts at 0 for every
+ * message, the first chunk follows it with the little endian message length.
+ */
+#define RN4020_MESSAGE_START    0x80
+#define RN4020_MESSAGE_END      0x40
+#define RN4020_MESSAGE_SEQUENCE 0x3F
+
+typedef enum {
+  RN4020_MESSAGE_ERROR_SEQUENCE, // chunk lost or out of order, or a continuation without a start chunk
+  RN4020_MESSAGE_ERROR_OVERFLOW, // announced length does not fit rxBuffer
+  RN4020_MESSAGE_ERROR_LENGTH,   // chunks carried more or fewer bytes than announced
+  RN4020_MESSAGE_ERROR_FORMAT    // chunk is not valid hex or is shorter than its header
+} RN4020_MessageError;
+
+typedef struct {
+  uint16_t txHandle; // server characteristic messages are sent on, notified to a subscribed client
+  uint16_t rxHandle; // server characteristic the client writes messages to
+  uint8_t* rxBuffer;
+  uint16_t rxBufferSize;
+
+  bool txBusy;
+  const uint8_t* txData;
+  uint16_t txLength;
+  uint16_t txOffset;
+  uint16_t txChunks;
+  uint8_t txChunksInFlight;
+  HAL_StatusTypeDef txStatus;
+
+  bool rxActive;
+  uint16_t rxExpected;
+  uint16_t rxLength;
+  uint8_t rxSequence;
+} RN4020_MessageChannel;
+
+typedef struct {
+  uint16_t handle;
+  uint8_t lineLength;
+  char line[RN4020_READ_CACHE_LINE_LENGTH]; // SHW line sent as is when the handle is read
+  bool dirty; // set while line is in flight, value is encoded into line once the module answers
+  uint8_t valueLength;
+  uint8_t value[RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH];
+} RN4020_ReadCacheItem;
+
+typedef struct _RN4020 RN4020;
+
+typedef uint32_t RN4020_CommandToken;
+
+#define RN4020_CLIENT_CONFIGURATION_NONE     0x0000
+#define RN4020_CLIENT_CONFIGURATION_NOTIFY   0x0001
+#define RN4020_CLIENT_CONFIGURATION_INDICATE 0x0002
+
+typedef struct {
+  uint16_t handle;
+  uint8_t dataLength;
+  uint8_t data[RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH];
+} RN4020_RemoteValue;
+
+/**
+ * Handles of one peer's characteristics as listed by LC, owned by the application so a gateway can keep one per
+ * peripheral and skip discovery when it reconnects. A characteristic with notify or indicate appears twice, the second
+ * entry is its client characteristic configuration descriptor.
+ */
+typedef struct {
+  bool discovered;
+  bool overflow;
+  uint8_t length;
+  RN4020_handleLookupItem items[RN4020_REMOTE_LOOKUP_TABLE_SIZE];
+} RN4020_RemoteGatt;
+
+typedef void (*RN4020_CommandCallback)(RN4020* rn4020, RN4020_CommandToken token, HAL_StatusTypeDef status, void* userData);
+
+typedef struct {
+  RN4020_CommandToken token;
+  RN4020_State waitState;
+  RN4020_CommandType type;
+  uint32_t timeout;
+  RN4020_CommandCallback callback;
+  void* userData;
+  void* result; // RN4020_RemoteValue for remote reads, RN4020_RemoteGatt for LC
+  uint16_t lineLength;
+  char line[RN4020_MAX_COMMAND_LENGTH];
+} RN4020_Command;
+
+#ifdef RN4020_SUBMIT_QUEUE
+typedef enum {
+  RN4020_SUBMISSION_COMMAND, // command is sent as is and completes on AOK
+  RN4020_SUBMISSION_WRITE    // data is written to the server characteristic at handle with SHW
+} RN4020_SubmissionType;
+
+/**
+ * Owned by the submitting context and must not be touched until status leaves HAL_BUSY.
+ */
+typedef struct {
+  RN4020_SubmissionType type;
+  const char* command; // must stay valid until the submission completes
+  uint16_t handle;
+  uint8_t dataLength;
+  uint8_t data[RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH];
+  RN4020_CommandCallback callback;
+  void* userData;
+  atomic_int status;
+} RN4020_Submission;
+
+typedef struct {
+  atomic_uint sequence;
+  RN4020_Submission* submission;
+} RN4020_SubmitSlot;
+#endif
+
+struct _RN4020 {
   UART_HandleTypeDef* uart;
   GPIO_TypeDef* wakeswPort;
   uint16_t wakeswPin;
   GPIO_TypeDef* wakehwPort;
   uint16_t wakehwPin;
+  GPIO_TypeDef* cmdMldpPort; // optional, required to leave MLDP mode
+  uint16_t cmdMldpPin;
+  GPIO_TypeDef* connectionPort; // optional, the module's connection status output, sampled while asleep
+  uint16_t connectionPin;
+  uint32_t baudRate; // optional, RN4020_setup switches the module and uart to this rate
+  bool flowControl;  // optional, RTS/CTS must be wired and uart configured for them by the MSP init
 
   volatile RN4020_State state;
   volatile bool connected;
   RingBufferDmaU8 rxRing;
   uint8_t rxBuffer[RN4020_RX_BUFFER_SIZE];
+  uint16_t rxScanned;
+  char rxLineScratch[RN4020_MAX_RX_LINE_LENGTH];
+  uint8_t txBuffer[RN4020_MAX_COMMAND_LENGTH];
+
+  volatile bool mldp;
+  uint8_t mldpTxBuffer[RN4020_MLDP_TX_BUFFER_SIZE];
+  uint16_t mldpTxHead;
+  uint16_t mldpTxTail;
+  uint16_t mldpTxInFlight;
+  uint8_t mldpStatusMatched;
 
   RN4020_handleLookupItem handleLookup[RN4020_LOOKUP_TABLE_SIZE];
   uint32_t handleLookupLength;
-} RN4020;
+  bool handleLookupOverflow;
+  uint32_t privateFingerprint;
+  const RN4020_GattTable* gattTable;
+  uint8_t uuidIndex[RN4020_UUID_INDEX_SIZE];
+
+  RN4020_Command commandQueue[RN4020_COMMAND_QUEUE_SIZE];
+  uint8_t commandQueueHead;
+  uint8_t commandQueueLength;
+  bool commandInFlight;
+  uint32_t commandStartTime;
+  RN4020_CommandToken nextCommandToken;
+  RN4020_CommandToken lastCompletedCommandToken;
+  HAL_StatusTypeDef commandStatus;
+  char value[RN4020_MAX_VALUE_LENGTH + 1];
+  HAL_StatusTypeDef commandResults[RN4020_COMMAND_QUEUE_SIZE];
+
+  RN4020_WriteCacheItem writeCache[RN4020_WRITE_CACHE_SIZE];
+  uint8_t writeCacheLength;
+  uint32_t writeCacheFlushInterval;
+  uint32_t writeCacheLastFlush;
+  bool writeCacheFlushNow;
+
+  RN4020_MessageChannel* messageChannel;
+
+  volatile bool scanning;
+  RN4020_ScanEntry scanCache[RN4020_SCAN_CACHE_SIZE];
+
+  RN4020_ConnectionParameters connectionParameters;
+  bool connectionParametersValid;
+  const RN4020_ConnectionTuner* tuner;
+  bool tunerFast;
+  uint32_t tunerWindowStart;
+  uint32_t tunerWrites; // SHW/SUW lines dispatched, kept apart from stats so RN4020_resetStats does not disturb it
+  uint32_t tunerWindowWrites;
+  uint32_t tunerSeenWrites;
+  uint32_t tunerLastWrite;
+
+  const RN4020_PowerSchedule* powerSchedule;
+  RN4020_PowerState powerState;
+  uint32_t powerStateTime;
+  uint32_t powerLastActivity;
+  uint32_t powerAwakeMark;
+  uint32_t wakeWindowTime;
+  uint32_t wakeLatencyAverage;
+
+  const RN4020_ReconnectPolicy* reconnectPolicy;
+  bool reconnecting;
+  bool reconnectAdvertised;
+  uint16_t reconnectInterval;
+  uint32_t reconnectStart;
+  uint32_t reconnectStepTime;
+
+  RN4020_ReadCacheItem readCache[RN4020_READ_CACHE_SIZE];
+  uint8_t readCacheLength;
+  uint32_t readResponsesPending; // bit per readCache index
+  int8_t readResponseInFlight;
+
+#ifdef RN4020_TRACE
+  uint8_t traceBuffer[RN4020_TRACE_BUFFER_SIZE];
+  uint32_t traceHead;
+  uint32_t traceTail;
+  bool traceReplaying;
+#endif
+
+#ifdef RN4020_SUBMIT_QUEUE
+  RN4020_SubmitSlot submitQueue[RN4020_SUBMIT_QUEUE_SIZE];
+  atomic_uint submitTail; // next position claimed by a producer
+  uint32_t submitHead;    // next position drained by RN4020_tick
+#endif
+
+  RN4020_Stats stats;
+};
+
+/**
+ * Callbacks are weak in rn4020.c, define them in the application to override. They are not declared weak here so the
+ * application's definitions are strong regardless of link order.
+ */
+void RN4020_onWrite(RN4020* rn4020, uint16_t characteristicHandle, uint8_t* data, uint8_t dataLength);
+void RN4020_connectedStateChanged(RN4020* rn4020, bool connected);
+
+/**
+ * Called when the module reports the parameters negotiated for the current connection.
+ */
+void RN4020_onConnectionParameters(RN4020* rn4020, const RN4020_ConnectionParameters* parameters);
+
+/**
+ * Called for RV lines on handles that have no value in the read cache, the application must answer with
+ * RN4020_writeServerCharacteristicHandle.
+ */
+void RN4020_onRealTimeRead(RN4020* rn4020, uint16_t characteristicHandle);
+
+/**
+ * Called from RN4020_tick with raw bytes received while in MLDP mode. data points into the RX DMA ring and is only
+ * valid for the duration of the call.
+ */
+void RN4020_onMLDPData(RN4020* rn4020, const uint8_t* data, uint16_t dataLength);
+
+/**
+ * Called from RN4020_tick when an advertiser is seen for the first time, its name/uuid fields change or its RSSI moves
+ * by RN4020_SCAN_RSSI_THRESHOLD, repeats of the same report are only counted. payload is the text between the address
+ * type and the RSSI, it points into the RX DMA ring and is only valid for the duration of the call.
+ */
+void RN4020_onScanReport(RN4020* rn4020, const RN4020_ScanEntry* entry, const char* payload, uint16_t payloadLength);
+
+/**
+ * Called from RN4020_tick when a peer we are subscribed to sends a notification or indication.
+ */
+void RN4020_onRemoteNotify(RN4020* rn4020, uint16_t characteristicHandle, uint8_t* data, uint8_t dataLength, bool indication);
+
+/**
+ * Called from RN4020_tick once the last chunk of a message has been reassembled. data is the channel's rxBuffer and is
+ * overwritten by the next message.
+ */
+void RN4020_onMessage(RN4020* rn4020, RN4020_MessageChannel* channel, uint8_t* data, uint16_t dataLength);
+
+/**
+ * Called when every chunk of the message passed to RN4020_sendMessage has been acknowledged, or with the first
+ * failing status once the chunks already queued have completed.
+ */
+void RN4020_onMessageSent(RN4020* rn4020, RN4020_MessageChannel* channel, HAL_StatusTypeDef status);
 
-__weak void RN4020_onRealTimeRead(RN4020* rn4020, uint16_t characteristicHandle);
-__weak void RN4020_onWrite(RN4020* rn4020, uint16_t characteristicHandle, uint8_t* data, uint8_t dataLength);
-__weak void RN4020_connectedStateChanged(RN4020* rn4020, bool connected);
+/**
+ * Called when a received message is dropped, reassembly restarts at the next start chunk.
+ */
+void RN4020_onMessageError(RN4020* rn4020, RN4020_MessageChannel* channel, RN4020_MessageError error);
 
+/**
+ * rn4020->uart must have both an RX and a TX DMA channel linked. Commands are sent with a single
+ * HAL_UART_Transmit_DMA call so the CPU is free while the bytes go out.
+ */
 HAL_StatusTypeDef RN4020_setup(RN4020* rn4020);
 HAL_StatusTypeDef RN4020_resetToFactoryDefaults(RN4020* rn4020);
 HAL_StatusTypeDef RN4020_setSupportedServices(RN4020* rn4020, uint32_t services);
@@ -141,17 +709,371 @@ HAL_StatusTypeDef RN4020_addPrivateCharacteristic(
   uint8_t size,
   uint8_t securityOptions
 );
+HAL_StatusTypeDef RN4020_addGattEntry(RN4020* rn4020, const RN4020_GattEntry* entry);
+
+/**
+ * Issues PS/PC for every entry of a table declared with RN4020_GATT_TABLE. Call RN4020_clearPrivate first.
+ */
+HAL_StatusTypeDef RN4020_addGattTable(RN4020* rn4020, const RN4020_GattTable* table);
+
+/**
+ * Makes RN4020_refreshHandleLookup fill in the table's handles, unknown characteristics get handle 0.
+ */
+void RN4020_bindGattTable(RN4020* rn4020, const RN4020_GattTable* table);
+HAL_StatusTypeDef RN4020_writeGattCharacteristic(RN4020* rn4020, const RN4020_GattTable* table, uint8_t id, const uint8_t* data, uint32_t dataLength);
 void RN4020_uuidToString(char* dest, const uint8_t* uuid, uint8_t uuidLength);
+
+/**
+ * Starts scanning for advertisers, requires RN4020_FEATURE_CENTRAL. interval and window are in ms, pass 0 for both to
+ * use the module's defaults. Reports go through the scan cache and RN4020_onScanReport.
+ */
+HAL_StatusTypeDef RN4020_startScan(RN4020* rn4020, uint16_t interval, uint16_t window);
+HAL_StatusTypeDef RN4020_stopScan(RN4020* rn4020);
+bool RN4020_isScanning(RN4020* rn4020);
+const RN4020_ScanEntry* RN4020_findScanEntry(RN4020* rn4020, const uint8_t* mac);
+void RN4020_clearScanCache(RN4020* rn4020);
+
+/**
+ * Connects to a peripheral as central, RN4020_connectedStateChanged fires once the link is up.
+ */
+HAL_StatusTypeDef RN4020_connect(RN4020* rn4020, const uint8_t* mac, uint8_t addressType);
+
+/**
+ * Fills remote with the connected peer's handles using LC. Does nothing if remote was already discovered, call
+ * RN4020_forgetRemote when the peer's GATT database may have changed.
+ */
+HAL_StatusTypeDef RN4020_discoverRemote(RN4020* rn4020, RN4020_RemoteGatt* remote);
+void RN4020_forgetRemote(RN4020_RemoteGatt* remote);
+RN4020_handleLookupItem* RN4020_lookupRemoteUUID(RN4020_RemoteGatt* remote, const uint8_t* uuid, uint8_t uuidLength);
+
+/**
+ * Remote reads complete once the module prints the value, result must stay valid until then. The UUID variants use
+ * the handle from remote when it is discovered (remote may be NULL) and fall back to CUR/CUW otherwise.
+ */
+HAL_StatusTypeDef RN4020_readRemoteHandleAsync(
+  RN4020* rn4020,
+  uint16_t handle,
+  RN4020_RemoteValue* result,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+);
+HAL_StatusTypeDef RN4020_readRemoteCharacteristicAsync(
+  RN4020* rn4020,
+  RN4020_RemoteGatt* remote,
+  const uint8_t* uuid,
+  uint8_t uuidLength,
+  RN4020_RemoteValue* result,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+);
+HAL_StatusTypeDef RN4020_readRemoteHandle(RN4020* rn4020, uint16_t handle, RN4020_RemoteValue* result);
+HAL_StatusTypeDef RN4020_writeRemoteHandleAsync(
+  RN4020* rn4020,
+  uint16_t handle,
+  const uint8_t* data,
+  uint32_t dataLength,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+);
+HAL_StatusTypeDef RN4020_writeRemoteCharacteristicAsync(
+  RN4020* rn4020,
+  RN4020_RemoteGatt* remote,
+  const uint8_t* uuid,
+  uint8_t uuidLength,
+  const uint8_t* data,
+  uint32_t dataLength,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+);
+HAL_StatusTypeDef RN4020_writeRemoteHandle(RN4020* rn4020, uint16_t handle, const uint8_t* data, uint32_t dataLength);
+
+/**
+ * Writes one of the RN4020_CLIENT_CONFIGURATION_ values to the characteristic's configuration descriptor. remote must
+ * be discovered, returns HAL_ERROR if the characteristic has no descriptor.
+ */
+HAL_StatusTypeDef RN4020_subscribeRemoteAsync(
+  RN4020* rn4020,
+  RN4020_RemoteGatt* remote,
+  const uint8_t* uuid,
+  uint8_t uuidLength,
+  uint16_t configuration,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+);
+
+/**
+ * handleLookup is kept sorted by handle after RN4020_refreshHandleLookup so lookups by handle are a binary search and
+ * lookups by uuid go through a hash index. RN4020_refreshHandleLookup returns HAL_ERROR if the module reports more
+ * characteristics than RN4020_LOOKUP_TABLE_SIZE, the entries that did fit are still usable.
+ */
 RN4020_handleLookupItem* RN4020_lookupHandle(RN4020* rn4020, uint16_t handle);
+RN4020_handleLookupItem* RN4020_lookupUUID(RN4020* rn4020, const uint8_t* uuid, uint8_t uuidLength);
 bool RN4020_isHandleLookupItemUUIDEqual16(RN4020_handleLookupItem* handleLookupItem, uint16_t uuid);
 bool RN4020_isHandleLookupItemUUIDEqual128(RN4020_handleLookupItem* handleLookupItem, const uint8_t* uuid);
+
+/**
+ * Returns the RN4020_CLIENT_CONFIGURATION_ bits the connected client wrote to the configuration descriptor of the
+ * characteristic at handle, learned from WV lines on the descriptor handles listed by RN4020_refreshHandleLookup.
+ * Subscriptions are cleared on disconnect. The WV lines are still passed to RN4020_onWrite.
+ */
+uint16_t RN4020_getClientConfiguration(RN4020* rn4020, uint16_t handle);
+
+/**
+ * Dispatches every complete line waiting in the RX ring, then sends the next queued command if the module is ready.
+ */
 void RN4020_tick(RN4020* rn4020);
+
+/**
+ * highWatermark is the most bytes ever waiting in the RX ring, use it to size RN4020_RX_BUFFER_SIZE. overruns counts
+ * lines that were dropped because the ring filled up or a line was longer than RN4020_MAX_RX_LINE_LENGTH.
+ */
+void RN4020_getRxStats(RN4020* rn4020, uint16_t* highWatermark, uint32_t* overruns);
+
+/**
+ * Copies the always-on statistics block. Counters only ever increase until RN4020_resetStats.
+ */
+void RN4020_getStats(RN4020* rn4020, RN4020_Stats* stats);
+void RN4020_resetStats(RN4020* rn4020);
+
+/**
+ * Copies whole trace records, oldest first, into dest and returns the number of bytes copied. The trace is not
+ * consumed. Always returns 0 unless RN4020_TRACE is defined.
+ */
+uint32_t RN4020_traceDump(RN4020* rn4020, uint8_t* dest, uint32_t destLength);
+void RN4020_traceClear(RN4020* rn4020);
+
+/**
+ * Feeds the RX records of a dumped trace through the line parser and state machine, running the command queue in
+ * between, so a captured session can be reproduced against the stand-in HAL. speed 0 replays as fast as possible,
+ * 1 at the recorded pace and n n times faster. TX produced during the replay is still traced, RX is not, so the
+ * replayed TX can be compared with the original. Returns the number of records replayed.
+ */
+uint32_t RN4020_traceReplay(RN4020* rn4020, const uint8_t* trace, uint32_t traceLength, uint32_t speed);
 void RN4020_send(RN4020* rn4020, const char* line);
 
+/**
+ * Queues a command without waiting for the module to answer. The command is sent from RN4020_tick once all
+ * previously queued commands have completed. Returns HAL_BUSY if the queue is full. callback and token may be NULL.
+ */
+HAL_StatusTypeDef RN4020_sendCommandAsync(
+  RN4020* rn4020,
+  const char* cmd,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+);
+
+#ifdef RN4020_SUBMIT_QUEUE
+/**
+ * The only driver calls that are safe outside the context running RN4020_tick. They never block: the submission is
+ * pushed onto a lock-free ring and RN4020_tick moves it into the command queue, so each command goes out whole and
+ * its AOK or ERR completes only that submission. The status is HAL_BUSY until then, callback runs in the
+ * RN4020_tick context and may be NULL. Returns HAL_BUSY if the ring is full and HAL_ERROR if the command or data is
+ * too long. Requires lock-free 32 bit atomics (Cortex-M3 or later).
+ */
+HAL_StatusTypeDef RN4020_submitCommand(
+  RN4020* rn4020,
+  RN4020_Submission* submission,
+  const char* cmd,
+  RN4020_CommandCallback callback,
+  void* userData
+);
+HAL_StatusTypeDef RN4020_submitWrite(
+  RN4020* rn4020,
+  RN4020_Submission* submission,
+  uint16_t handle,
+  const uint8_t* data,
+  uint32_t dataLength,
+  RN4020_CommandCallback callback,
+  void* userData
+);
+HAL_StatusTypeDef RN4020_getSubmissionStatus(RN4020_Submission* submission);
+#endif
+
+/**
+ * Returns HAL_BUSY while the command is queued or in flight, otherwise the status it completed with. A command the
+ * module rejects with ERR completes with HAL_ERROR as soon as the ERR line arrives. Results are
+ * kept for the most recent RN4020_COMMAND_QUEUE_SIZE commands.
+ */
+HAL_StatusTypeDef RN4020_getCommandStatus(RN4020* rn4020, RN4020_CommandToken token);
+
+/**
+ * Ticks until the command completes and returns its status. Gives up with HAL_TIMEOUT after RN4020_WAIT_TIMEOUT,
+ * the command stays queued and its result can still be read with RN4020_getCommandStatus.
+ */
+HAL_StatusTypeDef RN4020_waitForCommand(RN4020* rn4020, RN4020_CommandToken token);
+bool RN4020_isIdle(RN4020* rn4020);
+
+/**
+ * Switches the module to baudRate (one of 2400, 9600, 19200, 38400, 115200, 230400, 460800, 921600) with SB, reboots it
+ * and re-initializes uart and the RX DMA ring to match, then checks the link with a round trip. flowControl also sets
+ * RN4020_FEATURE_UART_FLOW_CONTROL and UART_HWCONTROL_RTS_CTS, include the feature in RN4020_Config::features so
+ * RN4020_provision keeps it. Returns HAL_ERROR if the new rate did not work and the link was restored at the previous
+ * rate, HAL_TIMEOUT if the module could not be reached at either rate.
+ */
+HAL_StatusTypeDef RN4020_setBaudRate(RN4020* rn4020, uint32_t baudRate, bool flowControl);
+
+/**
+ * Sets the parameters the module asks for when a central connects (ST).
+ */
+HAL_StatusTypeDef RN4020_setPreferredConnectionParameters(RN4020* rn4020, const RN4020_ConnectionParameters* parameters);
+
+/**
+ * Asks the central to update the current connection (T), the result arrives through RN4020_onConnectionParameters.
+ */
+HAL_StatusTypeDef RN4020_requestConnectionParametersAsync(
+  RN4020* rn4020,
+  const RN4020_ConnectionParameters* parameters,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+);
+
+/**
+ * Returns false if no parameters were reported since the last connect.
+ */
+bool RN4020_getConnectionParameters(RN4020* rn4020, RN4020_ConnectionParameters* parameters);
+
+/**
+ * Enables the throughput driven tuner, tuner must stay valid while set. Pass NULL to disable it.
+ */
+void RN4020_setConnectionTuner(RN4020* rn4020, const RN4020_ConnectionTuner* tuner);
+
+HAL_StatusTypeDef RN4020_getSupportedServices(RN4020* rn4020, uint32_t* services);
+HAL_StatusTypeDef RN4020_getSupportedFeatures(RN4020* rn4020, uint32_t* features);
+HAL_StatusTypeDef RN4020_getDeviceName(RN4020* rn4020, char* deviceName, uint32_t deviceNameSize);
+
+/**
+ * schedule must stay valid while set, NULL keeps the module awake (the default) and raises WAKE_SW if it was low.
+ */
+void RN4020_setPowerSchedule(RN4020* rn4020, const RN4020_PowerSchedule* schedule);
+RN4020_PowerState RN4020_getPowerState(RN4020* rn4020);
+
+/**
+ * policy must stay valid while set, NULL leaves advertising after Connection End to the application. The handle
+ * lookup and the write cache are kept across reconnects, values still pending are sent as soon as Connected arrives.
+ */
+void RN4020_setReconnectPolicy(RN4020* rn4020, const RN4020_ReconnectPolicy* policy);
+
+/**
+ * Brings the module to config, issuing only the commands whose settings differ from what the module reports
+ * (GS, GR, GN and the private services listed by LS) and rebooting only if something was written. A module that is
+ * already configured costs four queries. changed may be NULL. The handle lookup is refreshed on return.
+ *
+ * LS does not report characteristic sizes or security options, so changing only those in config is not detected.
+ */
+HAL_StatusTypeDef RN4020_provision(RN4020* rn4020, const RN4020_Config* config, bool* changed);
+
+/**
+ * Writes by uuid are sent as the shorter SHW command when RN4020_refreshHandleLookup has learned the handle, and as
+ * SUW otherwise.
+ */
 HAL_StatusTypeDef RN4020_writeServerPublicCharacteristic(RN4020* rn4020, uint16_t uuid, const uint8_t* data, uint32_t dataLength);
 HAL_StatusTypeDef RN4020_writeServerPrivateCharacteristic(RN4020* rn4020, const uint8_t* uuid, const uint8_t* data, uint32_t dataLength);
+
+/**
+ * Writes to a handle nobody listens to (disconnected, or a configuration descriptor the client has not subscribed
+ * to) are not sent. The value goes to the write cache as with RN4020_writeServerCharacteristicHandleDeferred and the
+ * command completes with HAL_OK in queue order. They are sent as usual when the write cache is full.
+ */
 HAL_StatusTypeDef RN4020_writeServerCharacteristicHandle(RN4020* rn4020, uint16_t handle, const uint8_t* data, uint32_t dataLength);
 
+HAL_StatusTypeDef RN4020_writeServerPrivateCharacteristicAsync(
+  RN4020* rn4020,
+  const uint8_t* uuid,
+  const uint8_t* data,
+  uint32_t dataLength,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+);
+HAL_StatusTypeDef RN4020_writeServerCharacteristicHandleAsync(
+  RN4020* rn4020,
+  uint16_t handle,
+  const uint8_t* data,
+  uint32_t dataLength,
+  RN4020_CommandCallback callback,
+  void* userData,
+  RN4020_CommandToken* token
+);
+
+/**
+ * Stores the value in the write cache instead of sending it. Only the latest value per handle is kept and pending
+ * values are sent from RN4020_tick. Returns HAL_BUSY if the cache has no room for another handle.
+ *
+ * Pending values are held back while disconnected and, for characteristics with a configuration descriptor, while
+ * the client has not subscribed; such writes are counted in writesSuppressed. The latest value is sent as soon as the
+ * client connects or subscribes. A client that reads such a characteristic without subscribing gets the last value
+ * sent, use RN4020_setReadValue to answer those reads.
+ */
+HAL_StatusTypeDef RN4020_writeServerCharacteristicHandleDeferred(RN4020* rn4020, uint16_t handle, const uint8_t* data, uint32_t dataLength);
+HAL_StatusTypeDef RN4020_writeServerPrivateCharacteristicDeferred(RN4020* rn4020, const uint8_t* uuid, const uint8_t* data, uint32_t dataLength);
+
+/**
+ * Pending values are sent whenever the command queue is idle. With interval set they are also sent behind queued
+ * commands once interval milliseconds have passed since the last flush, interval 0 waits for an idle queue. A write
+ * the module rejects or does not acknowledge stays pending and is counted in writesSent only once it succeeds.
+ */
+void RN4020_setWriteCacheFlushInterval(RN4020* rn4020, uint32_t interval);
+HAL_StatusTypeDef RN4020_flushWriteCache(RN4020* rn4020);
+void RN4020_getWriteCacheStats(RN4020* rn4020, uint32_t* writesCoalesced, uint32_t* writesSent);
+
+/**
+ * Stores the value the driver answers real-time reads (RN4020_FEATURE_REAL_TIME_READ) of handle with. The SHW line is
+ * encoded here so an RV line is answered straight from the cache, ahead of queued commands, without calling
+ * RN4020_onRealTimeRead. Returns HAL_BUSY if the cache has no room for another handle.
+ */
+HAL_StatusTypeDef RN4020_setReadValue(RN4020* rn4020, uint16_t handle, const uint8_t* data, uint32_t dataLength);
+
+/**
+ * Switches the connected link into MLDP transparent mode. While in MLDP mode received bytes are delivered to
+ * RN4020_onMLDPData instead of being parsed as lines, and command calls return HAL_BUSY until RN4020_exitMLDP.
+ * A "Connection End" in the received stream (it is still passed to RN4020_onMLDPData) leaves MLDP mode, drops
+ * unsent payload and reports the disconnect. RN4020_FEATURE_ENABLE_MLDP must be set.
+ */
+HAL_StatusTypeDef RN4020_enterMLDP(RN4020* rn4020);
+
+/**
+ * Leaves MLDP mode by pulling the CMD/MLDP pin low and waiting for the CMD prompt. Requires cmdMldpPort.
+ */
+HAL_StatusTypeDef RN4020_exitMLDP(RN4020* rn4020);
+bool RN4020_isMLDP(RN4020* rn4020);
+
+/**
+ * Copies data into the MLDP TX ring, it is sent from RN4020_tick. Returns the number of bytes accepted, which is
+ * less than dataLength when the ring is full so the caller can retry the remainder later.
+ */
+uint32_t RN4020_mldpWrite(RN4020* rn4020, const uint8_t* data, uint32_t dataLength);
+uint32_t RN4020_mldpTxFree(RN4020* rn4020);
+
+/**
+ * Frames messages up to 65535 bytes over a pair of server characteristics, both of which should be
+ * RN4020_MAX_CHARACTERISTIC_VALUE_LENGTH bytes long. WV lines for rxHandle are decoded straight into rxBuffer and no
+ * longer reach RN4020_onWrite. channel is owned by the caller and must outlive the channel.
+ */
+void RN4020_openMessageChannel(
+  RN4020* rn4020,
+  RN4020_MessageChannel* channel,
+  uint16_t txHandle,
+  uint16_t rxHandle,
+  uint8_t* rxBuffer,
+  uint16_t rxBufferSize
+);
+void RN4020_closeMessageChannel(RN4020* rn4020);
+
+/**
+ * Queues the message's chunks as SHW writes on txHandle from RN4020_tick, keeping up to RN4020_MESSAGE_PIPELINE_DEPTH
+ * of them in the command queue so chunks go out back to back. data must stay valid until RN4020_onMessageSent.
+ * Returns HAL_BUSY while the previous message is still being sent and HAL_ERROR if no channel is open.
+ */
+HAL_StatusTypeDef RN4020_sendMessage(RN4020* rn4020, const uint8_t* data, uint16_t dataLength);
+bool RN4020_isMessageSending(RN4020* rn4020);
+
 /**
  * level 0x00 (0%) - 0x64 (100%)
  */
@@ -0,0 +1,83 @@
+#include "rn4020_hex.h"
+
+static const char _RN4020_hexDigits[16] = {
+  '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'
+};
+
+// valid digits have bit 4 set so a pair can be validated with a single AND, invalid characters are 0
+static const uint8_t _RN4020_hexNibbles[256] = {
+  ['0'] = 0x10,
+  ['1'] = 0x11,
+  ['2'] = 0x12,
+  ['3'] = 0x13,
+  ['4'] = 0x14,
+  ['5'] = 0x15,
+  ['6'] = 0x16,
+  ['7'] = 0x17,
+  ['8'] = 0x18,
+  ['9'] = 0x19,
+  ['A'] = 0x1A, ['a'] = 0x1A,
+  ['B'] = 0x1B, ['b'] = 0x1B,
+  ['C'] = 0x1C, ['c'] = 0x1C,
+  ['D'] = 0x1D, ['d'] = 0x1D,
+  ['E'] = 0x1E, ['e'] = 0x1E,
+  ['F'] = 0x1F, ['f'] = 0x1F,
+};
+
+char* RN4020_hexEncode(char* dest, const uint8_t* data, uint32_t dataLength) {
+  for (uint32_t i = 0; i < dataLength; i++) {
+    *dest++ = _RN4020_hexDigits[data[i] >> 4];
+    *dest++ = _RN4020_hexDigits[data[i] & 0x0f];
+  }
+  return dest;
+}
+
+char* RN4020_hexEncodeU8(char* dest, uint8_t value) {
+  *dest++ = _RN4020_hexDigits[value >> 4];
+  *dest++ = _RN4020_hexDigits[value & 0x0f];
+  return dest;
+}
+
+char* RN4020_hexEncodeU16(char* dest, uint16_t value) {
+  dest = RN4020_hexEncodeU8(dest, value >> 8);
+  return RN4020_hexEncodeU8(dest, value);
+}
+
+char* RN4020_hexEncodeU32(char* dest, uint32_t value) {
+  dest = RN4020_hexEncodeU16(dest, value >> 16);
+  return RN4020_hexEncodeU16(dest, value);
+}
+
+int32_t RN4020_hexDecode(uint8_t* dest, const char* str, uint32_t strLength) {
+  if (strLength & 1) {
+    return -1;
+  }
+  const uint8_t* src = (const uint8_t*)str;
+  for (uint32_t i = 0; i < strLength / 2; i++, src += 2) {
+    uint8_t high = _RN4020_hexNibbles[src[0]];
+    uint8_t low = _RN4020_hexNibbles[src[1]];
+    if ((high & low & 0x10) == 0) {
+      return -1;
+    }
+    dest[i] = (high << 4) | (low & 0x0f);
+  }
+  return strLength / 2;
+}
+
+bool RN4020_hexDecodeU16(const char* str, uint16_t* value) {
+  uint8_t bytes[2];
+  if (RN4020_hexDecode(bytes, str, 4) != 2) {
+    return false;
+  }
+  *value = ((uint16_t)bytes[0] << 8) | bytes[1];
+  return true;
+}
+
+bool RN4020_hexDecodeU32(const char* str, uint32_t* value) {
+  uint8_t bytes[4];
+  if (RN4020_hexDecode(bytes, str, 8) != 4) {
+    return false;
+  }
+  *value = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+  return true;
+}
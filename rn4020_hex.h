@@ -0,0 +1,28 @@
+#ifndef _RN4020_HEX_H_
+#define _RN4020_HEX_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Writes two upper case hex digits per byte to dest. dest is not null terminated.
+ * Returns a pointer just past the last digit written.
+ */
+char* RN4020_hexEncode(char* dest, const uint8_t* data, uint32_t dataLength);
+char* RN4020_hexEncodeU8(char* dest, uint8_t value);
+char* RN4020_hexEncodeU16(char* dest, uint16_t value);
+char* RN4020_hexEncodeU32(char* dest, uint32_t value);
+
+/**
+ * Decodes strLength hex digits (upper or lower case) into dest.
+ * Returns the number of bytes written, or -1 if strLength is odd or any digit is not a valid nibble.
+ */
+int32_t RN4020_hexDecode(uint8_t* dest, const char* str, uint32_t strLength);
+
+/**
+ * Decodes exactly four hex digits, as used for handles. Returns false if any digit is not a valid nibble.
+ */
+bool RN4020_hexDecodeU16(const char* str, uint16_t* value);
+bool RN4020_hexDecodeU32(const char* str, uint32_t* value);
+
+#endif